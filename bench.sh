@@ -0,0 +1,75 @@
+#!/bin/sh
+
+# bench.sh - run yc_bench against every server that's been built, and print
+# a comparison table
+#
+# usage: ./bench.sh [-o results.json] [-P] [-b backends] [-c conns]
+#                   [-r rates] [-s sizes] [-- yc_bench options]
+#
+# -b, -c, -r and -s each take a space-separated list, and every combination
+# is run, eg:
+#   ./bench.sh -b "poll epoll" -c "100 1000" -r "1000 10000" -s "64 32-512"
+#
+# with -o, each run's results are appended to the given file as a line of
+# JSON. compare two such files with yc_benchcmp.
+#
+# with -P, the server is also measured with perf counters (cycles,
+# instructions, cache misses, context switches), reported per message.
+# whichever of those the system won't give us are left out.
+#
+# anything after -- is passed through to yc_bench (eg -d for the duration).
+# the port can be changed with BENCH_PORT
+
+port=${BENCH_PORT:-9876}
+
+backends="select poll epoll uring kqueue"
+conns_list=100
+rates=1000
+sizes=64
+out=
+perf=
+
+while getopts "o:Pb:c:r:s:" opt; do
+  case $opt in
+    o) out=$OPTARG ;;
+    P) perf=-P ;;
+    b) backends=$OPTARG ;;
+    c) conns_list=$OPTARG ;;
+    r) rates=$OPTARG ;;
+    s) sizes=$OPTARG ;;
+    *) exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+
+for conns in $conns_list; do
+for rate in $rates; do
+for size in $sizes; do
+  echo "== $conns connections, $rate msgs/s, $size bytes"
+  ./yc_bench -T $perf
+
+  for backend in $backends; do
+    server=./yc_$backend
+    [ -x $server ] || continue
+
+    # the servers are chatty on stdout, which would slow them down if it went
+    # to a terminal
+    $server $port > /dev/null 2>&1 &
+    pid=$!
+
+    # give it a moment to start listening
+    sleep 0.5
+
+    if kill -0 $pid 2> /dev/null; then
+      ./yc_bench -t -l $backend -p $pid $perf ${out:+-j "$out"} -c $conns -r $rate -s $size "$@" $port
+    else
+      echo "$server: failed to start" >&2
+    fi
+
+    kill $pid 2> /dev/null
+    wait $pid 2> /dev/null
+  done
+  echo
+done
+done
+done
@@ -0,0 +1,768 @@
+/* yc_bench - a load generator for yoctochat servers */
+
+/* This opens lots of connections to a server from a single process, and has
+ * them send messages at a steady rate. Every message carries the time it was
+ * sent, so when it arrives at the other connections we can work out how long
+ * it took to get through the server. At the end we print throughput and a
+ * latency breakdown.
+ *
+ * It's an epoll loop, just like yc_epoll, for the same reasons: it's the
+ * simplest way on Linux to watch thousands of sockets at once.
+ *
+ * A message looks like:
+ *
+ *   ycb <send time, hex nanoseconds> <padding...>\n
+ *
+ * We look for the "ycb " marker anywhere in each line we receive, so servers
+ * that decorate messages (eg with the sender's name) still work.
+ *
+ * Given the server's pid (-p), we also measure how much CPU it used and how
+ * big it got while we were measuring. With -P, we also attach hardware
+ * performance counters (cycles, instructions, cache misses) and the context
+ * switch counter to every thread in the server for the measurement window,
+ * and report them per delivered message. That's often a much clearer picture
+ * than wall time of what a change actually did. Counters often aren't
+ * available (in containers and VMs especially); we just report whichever
+ * ones we could get. With -j, the results are appended to a
+ * file as a single JSON object per line, for yc_benchcmp to compare later.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <errno.h>
+
+/* size of each connection's receive buffer. lines longer than this are
+ * counted as errors and skipped */
+#define RBUF_SIZE (65536)
+
+/* max events per call to epoll_wait() */
+#define NUM_EVENTS (256)
+
+/* the marker at the start of every message payload */
+#define MARKER     "ycb "
+#define MARKER_LEN (4)
+
+
+/* settings, from the commandline */
+static const char *host     = "127.0.0.1";
+static int         port;
+static int         nconns   = 100;    /* connections to open */
+static double      rate     = 1000;   /* messages per second, across all connections */
+static int         size_min = 64;     /* message size range, including the newline */
+static int         size_max = 64;
+static double      duration = 5;      /* seconds to measure for */
+static double      warmup   = 1;      /* seconds to run before measuring */
+static const char *label    = NULL;   /* name for this run in table output */
+static int         table    = 0;      /* print a single table row instead of a report */
+static int         server_pid = 0;    /* server to measure CPU and memory for */
+static const char *json_path  = NULL; /* file to append JSON results to */
+static int         use_perf   = 0;    /* attach perf counters to the server */
+
+
+/* a client connection */
+typedef struct {
+  int    fd;
+  int    connected;
+
+  /* incoming bytes that don't make up a whole line yet */
+  char  *rbuf;
+  size_t rlen;
+
+  /* outgoing bytes the socket wouldn't take. we don't send anything else on
+   * this connection until it's gone */
+  char   wbuf[256];
+  char  *wpending;
+  size_t wlen;
+} conn_t;
+
+static conn_t *conns;
+
+
+/* latency histogram. buckets are log-linear: values under 16ns get a bucket
+ * each, and after that every power of two is split into 16 equal buckets.
+ * that gives about 6% precision from nanoseconds to hours in 1024 counters */
+#define HIST_SUB_BITS (4)
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 << HIST_SUB_BITS)
+
+static uint64_t hist[HIST_BUCKETS];
+static uint64_t hist_count;
+static uint64_t hist_max;
+
+static int hist_bucket(uint64_t ns) {
+  if (ns < HIST_SUB)
+    return ns;
+  int msb = 63 - __builtin_clzll(ns);
+  int shift = msb - HIST_SUB_BITS;
+  return ((shift + 1) << HIST_SUB_BITS) + ((ns >> shift) & (HIST_SUB-1));
+}
+
+/* the smallest value that lands in a bucket */
+static uint64_t hist_value(int b) {
+  if (b < HIST_SUB)
+    return b;
+  int shift = (b >> HIST_SUB_BITS) - 1;
+  return (uint64_t) (HIST_SUB + (b & (HIST_SUB-1))) << shift;
+}
+
+static void hist_add(uint64_t ns) {
+  hist[hist_bucket(ns)]++;
+  hist_count++;
+  if (ns > hist_max)
+    hist_max = ns;
+}
+
+/* the value below which the given fraction of samples fall. we report the
+ * middle of the bucket */
+static uint64_t hist_percentile(double p) {
+  if (!hist_count)
+    return 0;
+  uint64_t want = (uint64_t) (p * hist_count);
+  if (want >= hist_count)
+    want = hist_count-1;
+  uint64_t seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen > want)
+      return (hist_value(b) + hist_value(b+1)) / 2;
+  }
+  return hist_max;
+}
+
+
+/* counters */
+static uint64_t sent, sent_bytes, skipped;
+static uint64_t delivered, delivered_bytes, bad_lines;
+
+
+/* resource usage of the server process, from /proc */
+typedef struct {
+  double cpu_user;    /* seconds */
+  double cpu_sys;
+  long   rss_kb;      /* resident set size right now */
+  long   rss_peak_kb; /* high water mark */
+} proc_sample_t;
+
+static int proc_sample(int pid, proc_sample_t *ps) {
+  char path[64], buf[1024];
+  memset(ps, 0, sizeof(*ps));
+
+  /* /proc/<pid>/stat is one line of space-separated fields. utime and stime
+   * are the 14th and 15th, in clock ticks. the second field is the program
+   * name in parens, which could have spaces in it, so we skip past the
+   * closing paren before counting */
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return -1;
+  size_t n = fread(buf, 1, sizeof(buf)-1, f);
+  fclose(f);
+  buf[n] = '\0';
+
+  char *p = strrchr(buf, ')');
+  if (!p)
+    return -1;
+  unsigned long utime, stime;
+  if (sscanf(p+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return -1;
+  long hz = sysconf(_SC_CLK_TCK);
+  ps->cpu_user = (double) utime / hz;
+  ps->cpu_sys  = (double) stime / hz;
+
+  /* memory is easier to get from /proc/<pid>/status */
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  f = fopen(path, "r");
+  if (!f)
+    return -1;
+  while (fgets(buf, sizeof(buf), f)) {
+    sscanf(buf, "VmRSS: %ld", &ps->rss_kb);
+    sscanf(buf, "VmHWM: %ld", &ps->rss_peak_kb);
+  }
+  fclose(f);
+
+  return 0;
+}
+
+
+/* performance counters. each one is opened separately on every thread of
+ * the server, and summed when we read them. we don't put them in a group,
+ * because then if any one of them is unavailable they all are */
+static const struct {
+  const char *name;
+  uint32_t    type;
+  uint64_t    config;
+} perf_counters[] = {
+  { "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cache_misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+#define NUM_PERF    (sizeof(perf_counters) / sizeof(perf_counters[0]))
+#define MAX_THREADS (64)
+
+static int perf_fds[NUM_PERF][MAX_THREADS];
+static int perf_nfds[NUM_PERF];
+static int perf_warned[NUM_PERF];
+
+static int perf_open_one(int c, int tid) {
+  struct perf_event_attr attr = {
+    .size        = sizeof(attr),
+    .type        = perf_counters[c].type,
+    .config      = perf_counters[c].config,
+    .disabled    = 1,
+    .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+  };
+
+  /* count in the kernel too if we're allowed, since that's where most of a
+   * chat server's time goes. if not, settle for userspace */
+  int fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+  if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+  }
+  return fd;
+}
+
+/* open every counter on every thread of the process */
+static void perf_open(int pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/task", pid);
+  DIR *dir = opendir(path);
+  if (!dir) {
+    perror(path);
+    return;
+  }
+
+  struct dirent *de;
+  while ((de = readdir(dir))) {
+    int tid = atoi(de->d_name);
+    if (tid <= 0)
+      continue;
+    for (int c = 0; c < NUM_PERF; c++) {
+      if (perf_nfds[c] == MAX_THREADS)
+        continue;
+      int fd = perf_open_one(c, tid);
+      if (fd >= 0)
+        perf_fds[c][perf_nfds[c]++] = fd;
+      else if (errno != ESRCH && !perf_nfds[c] && !perf_warned[c]) {
+        /* just say it once; it'll be the same for every thread */
+        fprintf(stderr, "perf: %s unavailable: %s\n", perf_counters[c].name, strerror(errno));
+        perf_warned[c] = 1;
+      }
+    }
+  }
+  closedir(dir);
+}
+
+static void perf_ioctl(int op) {
+  for (int c = 0; c < NUM_PERF; c++)
+    for (int i = 0; i < perf_nfds[c]; i++)
+      ioctl(perf_fds[c][i], op, 0);
+}
+
+/* total for one counter across all threads, or -1 if we couldn't open it.
+ * if the kernel had to share the hardware between more counters than it has
+ * (multiplexing), it tells us how long each one actually ran for, and we
+ * scale up to estimate the full count */
+static double perf_read(int c) {
+  if (!perf_nfds[c])
+    return -1;
+  double total = 0;
+  for (int i = 0; i < perf_nfds[c]; i++) {
+    uint64_t v[3];
+    if (read(perf_fds[c][i], v, sizeof(v)) != sizeof(v))
+      continue;
+    if (v[2] > 0 && v[2] < v[1])
+      total += (double) v[0] * v[1] / v[2];
+    else
+      total += v[0];
+  }
+  return total;
+}
+
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift; plenty random enough for picking message sizes */
+static uint64_t rng_state = 88172645463325252ULL;
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+
+/* close a connection that failed. the run carries on without it */
+static void conn_fail(int epoll, conn_t *c, const char *what) {
+  fprintf(stderr, "%s(%d): %s\n", what, c->fd, strerror(errno));
+  epoll_ctl(epoll, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+  c->connected = 0;
+}
+
+/* try to send whatever's left over from a previous write */
+static void conn_flush(int epoll, conn_t *c) {
+  while (c->wlen > 0) {
+    ssize_t n = write(c->fd, c->wpending, c->wlen);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      conn_fail(epoll, c, "write");
+      return;
+    }
+    c->wpending += n;
+    c->wlen     -= n;
+  }
+}
+
+/* send one message on a connection */
+static void conn_send(int epoll, conn_t *c, int measuring) {
+  /* pick a size, and make sure there's room for the marker and timestamp */
+  int len = size_min;
+  if (size_max > size_min)
+    len += rng() % (size_max - size_min + 1);
+  if (len < MARKER_LEN + 18)
+    len = MARKER_LEN + 18;
+  if (len > sizeof(c->wbuf))
+    len = sizeof(c->wbuf);
+
+  /* the timestamp goes in as fixed-width hex so it's quick to parse. a zero
+   * timestamp means "warmup, don't count me" */
+  uint64_t ts = measuring ? now_ns() : 0;
+  int n = snprintf(c->wbuf, sizeof(c->wbuf), MARKER "%016llx ", (unsigned long long) ts);
+  memset(c->wbuf + n, 'x', len - n - 1);
+  c->wbuf[len-1] = '\n';
+
+  c->wpending = c->wbuf;
+  c->wlen     = len;
+  conn_flush(epoll, c);
+
+  if (measuring) {
+    sent++;
+    sent_bytes += len;
+  }
+}
+
+/* handle one complete line that arrived on a connection */
+static void handle_line(const char *line, size_t len, uint64_t now, int measuring) {
+  const char *m = memmem(line, len, MARKER, MARKER_LEN);
+  if (!m || (line + len) - m < MARKER_LEN + 16) {
+    bad_lines++;
+    return;
+  }
+
+  uint64_t ts = 0;
+  for (const char *p = m + MARKER_LEN; p < m + MARKER_LEN + 16; p++) {
+    int d = (*p >= '0' && *p <= '9') ? *p - '0' :
+            (*p >= 'a' && *p <= 'f') ? *p - 'a' + 10 : -1;
+    if (d < 0) {
+      bad_lines++;
+      return;
+    }
+    ts = (ts << 4) | d;
+  }
+
+  /* sent during warmup */
+  if (!ts || !measuring)
+    return;
+
+  delivered++;
+  delivered_bytes += len+1;
+  hist_add(now > ts ? now - ts : 0);
+}
+
+/* read whatever's waiting on a connection, and pull out complete lines */
+static void conn_read(int epoll, conn_t *c, int measuring) {
+  for (;;) {
+    ssize_t n = read(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      conn_fail(epoll, c, "read");
+      return;
+    }
+    if (n == 0) {
+      errno = ECONNRESET;
+      conn_fail(epoll, c, "read");
+      return;
+    }
+
+    /* one timestamp for everything in this read; they all arrived together */
+    uint64_t now = now_ns();
+
+    c->rlen += n;
+    char *start = c->rbuf, *end = c->rbuf + c->rlen, *nl;
+    while ((nl = memchr(start, '\n', end - start))) {
+      handle_line(start, nl - start, now, measuring);
+      start = nl+1;
+    }
+
+    /* keep the partial line for next time. if the buffer is full of one
+     * enormous line, give up on it */
+    c->rlen = end - start;
+    if (c->rlen == RBUF_SIZE) {
+      bad_lines++;
+      c->rlen = 0;
+    }
+    else if (c->rlen && start != c->rbuf)
+      memmove(c->rbuf, start, c->rlen);
+  }
+}
+
+
+static void usage(const char *prog) {
+  printf("usage: %s [options] <port>\n"
+         "  -H host     server address (default 127.0.0.1)\n"
+         "  -c conns    number of connections (default 100)\n"
+         "  -r rate     messages per second, total (default 1000)\n"
+         "  -s size     message size in bytes, or min-max for a uniform spread (default 64)\n"
+         "  -d secs     how long to measure for (default 5)\n"
+         "  -w secs     how long to warm up first (default 1)\n"
+         "  -l label    name of this run, for table output\n"
+         "  -t          print one table row instead of a full report\n"
+         "  -p pid      measure the CPU and memory use of this (server) process\n"
+         "  -j file     append results to this file as a line of JSON\n"
+         "  -P          with -p, also measure the server with perf counters\n"
+         "  -T          print the table header and exit\n",
+         prog);
+}
+
+static void print_header(void) {
+  printf("%-12s %10s %12s %10s %10s %10s %10s %10s %6s %8s",
+    "backend", "sent/s", "delivered/s", "MB/s", "p50 us", "p99 us", "p999 us", "max us", "cpu %", "rss kB");
+  if (use_perf)
+    printf(" %9s %9s %9s %9s", "cyc/msg", "ins/msg", "miss/msg", "csw/msg");
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  int opt, header = 0;
+  while ((opt = getopt(argc, argv, "H:c:r:s:d:w:l:tTp:j:Ph")) != -1) {
+    switch (opt) {
+      case 'H': host     = optarg; break;
+      case 'c': nconns   = atoi(optarg); break;
+      case 'r': rate     = atof(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 'w': warmup   = atof(optarg); break;
+      case 'l': label    = optarg; break;
+      case 't': table    = 1; break;
+      case 'p': server_pid = atoi(optarg); break;
+      case 'j': json_path  = optarg; break;
+      case 'T': header   = 1; break;
+      case 'P': use_perf = 1; break;
+      case 's':
+        if (sscanf(optarg, "%d-%d", &size_min, &size_max) < 2)
+          size_max = size_min;
+        break;
+      case 'h':
+        usage(argv[0]);
+        exit(0);
+      default:
+        usage(argv[0]);
+        exit(1);
+    }
+  }
+
+  if (header) {
+    print_header();
+    exit(0);
+  }
+
+  if (optind >= argc || nconns < 2 || rate <= 0 || size_max < size_min) {
+    usage(argv[0]);
+    exit(1);
+  }
+  port = atoi(argv[optind]);
+
+  signal(SIGPIPE, SIG_IGN);
+
+  struct sockaddr_in sin = {
+    .sin_family = AF_INET,
+    .sin_port   = htons(port),
+  };
+  if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+    printf("'%s' not a valid address\n", host);
+    exit(1);
+  }
+
+  int epoll = epoll_create1(0);
+  if (epoll < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+
+  /* open all the connections. they're non-blocking, so connect() returns
+   * straight away and epoll tells us when each one is done */
+  conns = calloc(nconns, sizeof(conn_t));
+  for (int i = 0; i < nconns; i++) {
+    conn_t *c = &conns[i];
+    c->rbuf = malloc(RBUF_SIZE);
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+      perror("socket");
+      exit(1);
+    }
+    int onoff = 1;
+    ioctl(c->fd, FIONBIO, &onoff);
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &onoff, sizeof(onoff));
+
+    if (connect(c->fd, (struct sockaddr *) &sin, sizeof(sin)) < 0 && errno != EINPROGRESS) {
+      perror("connect");
+      exit(1);
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.u32 = i };
+    if (epoll_ctl(epoll, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+      perror("epoll_ctl");
+      exit(1);
+    }
+  }
+
+  struct epoll_event events[NUM_EVENTS];
+
+  /* phases of the run, as times */
+  uint64_t start         = now_ns();
+  uint64_t connect_by    = start + 10ULL * 1000000000;
+  uint64_t send_start    = 0;
+  uint64_t measure_start = 0;
+  uint64_t measure_end   = 0;
+  uint64_t drain_end     = 0;
+
+  /* when the next message is due, and whose turn it is */
+  uint64_t next_send = 0;
+  uint64_t interval  = (uint64_t) (1e9 / rate);
+  if (!interval)
+    interval = 1;
+  int next_conn = 0;
+
+  int nconnected = 0;
+
+  /* server resource usage at the start and end of the measurement */
+  proc_sample_t ps_start, ps_end;
+  int have_ps_start = 0, have_ps_end = 0;
+
+  for (;;) {
+    uint64_t now = now_ns();
+
+    /* wait for everyone to connect before we start. then give the server a
+     * moment to finish accepting them all */
+    if (!send_start) {
+      if (nconnected == nconns || now > connect_by) {
+        if (nconnected < 2) {
+          fprintf(stderr, "only %d of %d connections succeeded\n", nconnected, nconns);
+          exit(1);
+        }
+        send_start    = now + 200000000;
+        measure_start = send_start + (uint64_t) (warmup * 1e9);
+        measure_end   = measure_start + (uint64_t) (duration * 1e9);
+        drain_end     = measure_end + 1000000000;
+        next_send     = send_start;
+      }
+    }
+
+    int measuring = send_start && now >= measure_start && now < measure_end;
+
+    if (server_pid && measuring && !have_ps_start) {
+      have_ps_start = proc_sample(server_pid, &ps_start) == 0;
+      if (use_perf) {
+        perf_open(server_pid);
+        perf_ioctl(PERF_EVENT_IOC_ENABLE);
+      }
+    }
+    if (server_pid && have_ps_start && !have_ps_end && now >= measure_end) {
+      if (use_perf)
+        perf_ioctl(PERF_EVENT_IOC_DISABLE);
+      have_ps_end = proc_sample(server_pid, &ps_end) == 0;
+    }
+
+    /* send everything that's due. if we've fallen behind (eg the machine is
+     * overloaded) we catch up in a burst, just like real clients would */
+    if (send_start && now < measure_end) {
+      while (next_send <= now) {
+        /* find someone who isn't still busy with their last message */
+        int tries;
+        for (tries = 0; tries < nconns; tries++) {
+          conn_t *c = &conns[next_conn];
+          next_conn = (next_conn + 1) % nconns;
+          if (c->connected && !c->wlen) {
+            conn_send(epoll, c, measuring);
+            break;
+          }
+        }
+        if (tries == nconns && measuring)
+          skipped++;
+        next_send += interval;
+      }
+    }
+
+    if (drain_end && now >= drain_end)
+      break;
+
+    /* sleep until the next message is due, or something happens */
+    int timeout = 100;
+    if (send_start && now < measure_end)
+      timeout = next_send > now ? (next_send - now + 999999) / 1000000 : 0;
+
+    int nevents = epoll_wait(epoll, events, NUM_EVENTS, timeout);
+    if (nevents < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(1);
+    }
+
+    now = now_ns();
+    measuring = send_start && now >= measure_start && now < drain_end;
+
+    for (int n = 0; n < nevents; n++) {
+      conn_t *c = &conns[events[n].data.u32];
+      if (c->fd < 0)
+        continue;
+
+      if (!c->connected) {
+        /* connect finished. find out if it worked */
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err) {
+          errno = err;
+          conn_fail(epoll, c, "connect");
+          continue;
+        }
+        c->connected = 1;
+        nconnected++;
+
+        /* from now on we only care about writability when a write is stuck.
+         * we use edge triggering for that, so we're not woken constantly */
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.u32 = events[n].data.u32 };
+        epoll_ctl(epoll, EPOLL_CTL_MOD, c->fd, &ev);
+        continue;
+      }
+
+      if (events[n].events & EPOLLOUT)
+        conn_flush(epoll, c);
+      if (c->fd >= 0 && events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        conn_read(epoll, c, measuring);
+    }
+  }
+
+  /* every message should reach everyone except the sender */
+  double secs = duration;
+  uint64_t expected = sent * (nconnected - 1);
+
+  /* how hard the server worked for it */
+  int have_ps = have_ps_start && have_ps_end;
+  double cpu_user = have_ps ? ps_end.cpu_user - ps_start.cpu_user : 0;
+  double cpu_sys  = have_ps ? ps_end.cpu_sys  - ps_start.cpu_sys  : 0;
+
+  /* perf counters, per delivered message. -1 if we don't have them */
+  double perf_per_msg[NUM_PERF];
+  for (int c = 0; c < NUM_PERF; c++) {
+    double v = use_perf ? perf_read(c) : -1;
+    perf_per_msg[c] = v >= 0 && delivered ? v / delivered : -1;
+  }
+
+  if (json_path) {
+    FILE *f = fopen(json_path, "a");
+    if (!f) {
+      perror(json_path);
+      exit(1);
+    }
+    fprintf(f, "{\"backend\": \"%s\", \"conns\": %d, \"size_min\": %d, \"size_max\": %d, "
+               "\"rate\": %.0f, \"duration\": %.1f, \"time\": %ld, "
+               "\"sent\": %llu, \"delivered\": %llu, \"delivery_ratio\": %.4f, "
+               "\"sent_per_sec\": %.1f, \"delivered_per_sec\": %.1f, \"delivered_mb_per_sec\": %.3f, "
+               "\"lat_p50_us\": %.1f, \"lat_p99_us\": %.1f, \"lat_p999_us\": %.1f, \"lat_max_us\": %.1f",
+      label ? label : "-", nconnected, size_min, size_max, rate, duration, (long) time(NULL),
+      (unsigned long long) sent, (unsigned long long) delivered, expected ? (double) delivered / expected : 0.0,
+      sent / secs, delivered / secs, delivered_bytes / secs / 1e6,
+      hist_percentile(0.5) / 1e3, hist_percentile(0.99) / 1e3,
+      hist_percentile(0.999) / 1e3, hist_max / 1e3);
+    if (have_ps)
+      fprintf(f, ", \"cpu_user_s\": %.3f, \"cpu_sys_s\": %.3f, \"cpu_us_per_msg\": %.3f, "
+                 "\"rss_kb\": %ld, \"rss_peak_kb\": %ld",
+        cpu_user, cpu_sys, delivered ? (cpu_user + cpu_sys) * 1e6 / delivered : 0.0,
+        ps_end.rss_kb, ps_end.rss_peak_kb);
+    for (int c = 0; c < NUM_PERF; c++)
+      if (perf_per_msg[c] >= 0)
+        fprintf(f, ", \"%s_per_msg\": %.3f", perf_counters[c].name, perf_per_msg[c]);
+    fprintf(f, "}\n");
+    fclose(f);
+  }
+
+  if (table) {
+    printf("%-12s %10.0f %12.0f %10.2f %10.1f %10.1f %10.1f %10.1f",
+      label ? label : "-",
+      sent / secs, delivered / secs, delivered_bytes / secs / 1e6,
+      hist_percentile(0.5) / 1e3, hist_percentile(0.99) / 1e3,
+      hist_percentile(0.999) / 1e3, hist_max / 1e3);
+    if (have_ps)
+      printf(" %6.1f %8ld", 100 * (cpu_user + cpu_sys) / secs, ps_end.rss_peak_kb);
+    else if (use_perf)
+      printf(" %6s %8s", "-", "-");
+    if (use_perf) {
+      for (int c = 0; c < NUM_PERF; c++) {
+        if (perf_per_msg[c] >= 0)
+          printf(" %9.1f", perf_per_msg[c]);
+        else
+          printf(" %9s", "-");
+      }
+    }
+    printf("\n");
+    return 0;
+  }
+
+  printf("connections: %d of %d\n", nconnected, nconns);
+  printf("sent:        %llu msgs (%.0f/s, %.2f MB/s), %llu skipped (all connections busy)\n",
+    (unsigned long long) sent, sent / secs, sent_bytes / secs / 1e6, (unsigned long long) skipped);
+  printf("delivered:   %llu msgs (%.0f/s, %.2f MB/s), %.2f%% of expected\n",
+    (unsigned long long) delivered, delivered / secs, delivered_bytes / secs / 1e6,
+    expected ? 100.0 * delivered / expected : 0.0);
+  if (bad_lines)
+    printf("bad lines:   %llu\n", (unsigned long long) bad_lines);
+  printf("latency:     p50 %.1fus  p90 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+    hist_percentile(0.5) / 1e3, hist_percentile(0.9) / 1e3, hist_percentile(0.99) / 1e3,
+    hist_percentile(0.999) / 1e3, hist_max / 1e3);
+  if (have_ps)
+    printf("server:      cpu %.2fs user %.2fs sys (%.1f%%), %.2fus/msg, rss %ldkB (peak %ldkB)\n",
+      cpu_user, cpu_sys, 100 * (cpu_user + cpu_sys) / secs,
+      delivered ? (cpu_user + cpu_sys) * 1e6 / delivered : 0.0,
+      ps_end.rss_kb, ps_end.rss_peak_kb);
+  if (use_perf) {
+    printf("per message:");
+    int any = 0;
+    for (int c = 0; c < NUM_PERF; c++) {
+      if (perf_per_msg[c] >= 0) {
+        printf(" %s %.1f", perf_counters[c].name, perf_per_msg[c]);
+        any = 1;
+      }
+    }
+    if (perf_per_msg[0] > 0 && perf_per_msg[1] >= 0)
+      printf(" (ipc %.2f)", perf_per_msg[1] / perf_per_msg[0]);
+    printf("%s\n", any ? "" : " no perf counters available");
+  }
+
+  return 0;
+}
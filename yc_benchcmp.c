@@ -0,0 +1,279 @@
+/* yc_benchcmp - compare two sets of yc_bench results */
+
+/* Give this two files written by yc_bench -j (or bench.sh -o): a baseline,
+ * and a new run. Runs are matched up by backend, connection count, message
+ * size and rate, and then each interesting number is compared. Anything that
+ * got worse by more than the threshold is flagged, and if there were any, we
+ * exit with status 1, so this can be used to gate a change in a script.
+ *
+ * The files are one JSON object per line, and we wrote them ourselves, so we
+ * only need to understand a tiny bit of JSON: flat objects of strings and
+ * numbers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+/* most fields we'll keep from a single result */
+#define MAX_FIELDS (64)
+
+typedef struct {
+  char   name[48];
+  char   str[48];    /* if it was a string */
+  double num;        /* if it was a number */
+  int    is_str;
+} field_t;
+
+typedef struct {
+  field_t fields[MAX_FIELDS];
+  int     nfields;
+} result_t;
+
+typedef struct {
+  result_t *results;
+  int       nresults;
+} result_set_t;
+
+
+/* the numbers we compare, and which direction is better */
+static const struct {
+  const char *name;
+  int         higher_is_better;
+} metrics[] = {
+  { "delivered_per_sec",        1 },
+  { "delivery_ratio",           1 },
+  { "lat_p50_us",               0 },
+  { "lat_p99_us",               0 },
+  { "lat_p999_us",              0 },
+  { "cpu_us_per_msg",           0 },
+  { "rss_peak_kb",              0 },
+  { "cycles_per_msg",           0 },
+  { "instructions_per_msg",     0 },
+  { "cache_misses_per_msg",     0 },
+  { "context_switches_per_msg", 0 },
+  { NULL }
+};
+
+/* the fields that identify a run, so we can match baseline to new */
+static const char *key_fields[] = { "backend", "conns", "size_min", "size_max", "rate", NULL };
+
+
+static const field_t *result_get(const result_t *r, const char *name) {
+  for (int i = 0; i < r->nfields; i++)
+    if (strcmp(r->fields[i].name, name) == 0)
+      return &r->fields[i];
+  return NULL;
+}
+
+/* parse a JSON string into dst, returning a pointer just past it. we don't
+ * bother with escapes beyond skipping over them; we never write any */
+static const char *parse_string(const char *p, char *dst, size_t len) {
+  if (*p != '"')
+    return NULL;
+  p++;
+  size_t n = 0;
+  while (*p && *p != '"') {
+    if (*p == '\\' && p[1])
+      p++;
+    if (n < len-1)
+      dst[n++] = *p;
+    p++;
+  }
+  dst[n] = '\0';
+  return *p == '"' ? p+1 : NULL;
+}
+
+static const char *skip_ws(const char *p) {
+  while (isspace((unsigned char) *p))
+    p++;
+  return p;
+}
+
+/* parse a single line: {"name": value, ...} */
+static int parse_result(const char *p, result_t *r) {
+  r->nfields = 0;
+
+  p = skip_ws(p);
+  if (*p++ != '{')
+    return -1;
+
+  for (;;) {
+    p = skip_ws(p);
+    if (*p == '}')
+      return 0;
+
+    field_t dummy, *f = r->nfields < MAX_FIELDS ? &r->fields[r->nfields] : &dummy;
+    memset(f, 0, sizeof(*f));
+
+    if (!(p = parse_string(p, f->name, sizeof(f->name))))
+      return -1;
+    p = skip_ws(p);
+    if (*p++ != ':')
+      return -1;
+    p = skip_ws(p);
+
+    if (*p == '"') {
+      if (!(p = parse_string(p, f->str, sizeof(f->str))))
+        return -1;
+      f->is_str = 1;
+    }
+    else {
+      char *end;
+      f->num = strtod(p, &end);
+      if (end == p)
+        return -1;
+      p = end;
+    }
+
+    if (f != &dummy)
+      r->nfields++;
+
+    p = skip_ws(p);
+    if (*p == ',')
+      p++;
+    else if (*p != '}')
+      return -1;
+  }
+}
+
+static int load(const char *path, result_set_t *set) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+
+  set->results  = NULL;
+  set->nresults = 0;
+
+  char line[8192];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    if (*skip_ws(line) == '\0')
+      continue;
+
+    set->results = realloc(set->results, (set->nresults+1) * sizeof(result_t));
+    if (parse_result(line, &set->results[set->nresults]) < 0) {
+      fprintf(stderr, "%s:%d: couldn't parse result\n", path, lineno);
+      continue;
+    }
+    set->nresults++;
+  }
+
+  fclose(f);
+  return 0;
+}
+
+/* do two results describe the same kind of run? */
+static int same_run(const result_t *a, const result_t *b) {
+  for (const char **k = key_fields; *k; k++) {
+    const field_t *fa = result_get(a, *k), *fb = result_get(b, *k);
+    if (!fa || !fb || fa->is_str != fb->is_str)
+      return 0;
+    if (fa->is_str ? strcmp(fa->str, fb->str) != 0 : fa->num != fb->num)
+      return 0;
+  }
+  return 1;
+}
+
+static void describe_run(const result_t *r, char *buf, size_t len) {
+  const field_t *backend = result_get(r, "backend");
+  const field_t *conns   = result_get(r, "conns");
+  const field_t *smin    = result_get(r, "size_min");
+  const field_t *smax    = result_get(r, "size_max");
+  const field_t *rate    = result_get(r, "rate");
+  snprintf(buf, len, "%s, %.0f conns, %.0f msgs/s, %.0f-%.0f bytes",
+    backend ? backend->str : "?", conns ? conns->num : 0, rate ? rate->num : 0,
+    smin ? smin->num : 0, smax ? smax->num : 0);
+}
+
+
+static void usage(const char *prog) {
+  printf("usage: %s [-t threshold%%] [-q] <baseline.json> <new.json>\n"
+         "  -t pct   flag changes worse than this percentage (default 10)\n"
+         "  -q       only show regressions\n",
+         prog);
+}
+
+int main(int argc, char **argv) {
+  double threshold = 10;
+  int quiet = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:qh")) != -1) {
+    switch (opt) {
+      case 't': threshold = atof(optarg); break;
+      case 'q': quiet = 1; break;
+      case 'h': usage(argv[0]); exit(0);
+      default:  usage(argv[0]); exit(2);
+    }
+  }
+  if (argc - optind != 2) {
+    usage(argv[0]);
+    exit(2);
+  }
+
+  result_set_t base, cur;
+  if (load(argv[optind], &base) < 0 || load(argv[optind+1], &cur) < 0)
+    exit(2);
+
+  int regressions = 0, compared = 0;
+
+  for (int i = 0; i < cur.nresults; i++) {
+    const result_t *n = &cur.results[i];
+
+    /* find the matching baseline run. if there's more than one, the last
+     * one wins, since that's the most recent */
+    const result_t *b = NULL;
+    for (int j = 0; j < base.nresults; j++)
+      if (same_run(&base.results[j], n))
+        b = &base.results[j];
+
+    char desc[256];
+    describe_run(n, desc, sizeof(desc));
+
+    if (!b) {
+      if (!quiet)
+        printf("%s: no baseline\n\n", desc);
+      continue;
+    }
+    compared++;
+
+    int printed_header = 0;
+    for (int m = 0; metrics[m].name; m++) {
+      const field_t *fb = result_get(b, metrics[m].name);
+      const field_t *fn = result_get(n, metrics[m].name);
+      if (!fb || !fn || fb->is_str || fn->is_str)
+        continue;
+
+      /* percentage change, and whether that's bad. a change from zero is
+       * infinitely large, so only call it out if it went the wrong way */
+      double change = fb->num != 0 ? 100 * (fn->num - fb->num) / fb->num :
+                      fn->num != 0 ? (fn->num > 0 ? 100 : -100) : 0;
+      double worse = metrics[m].higher_is_better ? -change : change;
+      int regressed = worse > threshold;
+
+      if (quiet && !regressed)
+        continue;
+
+      if (!printed_header) {
+        printf("%s:\n", desc);
+        printed_header = 1;
+      }
+      printf("  %-26s %14.3f %14.3f %+8.1f%%%s\n",
+        metrics[m].name, fb->num, fn->num, change, regressed ? "  REGRESSION" : "");
+
+      regressions += regressed;
+    }
+    if (printed_header)
+      printf("\n");
+  }
+
+  printf("%d runs compared, %d regressions beyond %.1f%%\n", compared, regressions, threshold);
+
+  return regressions ? 1 : 0;
+}
@@ -0,0 +1,302 @@
+/* yc_cmd - slash commands for yoctochat servers */
+
+/* Commands are a word, then maybe some arguments, separated by spaces. We
+ * split off the word, look up its handler, and give it the rest. Replies go
+ * back to whoever sent the command, as notices (see yc_conn_notice()).
+ *
+ * A notice can disconnect them, if they've stopped reading and their
+ * output queue is full. The connection stays valid until the end of the
+ * tick, but it's been taken out of everything, so a handler that does more
+ * after a notice checks for YCC_CLOSING first.
+ *
+ * The lookup is a perfect hash: yc_cmdgen works out at build time how to
+ * hash every command in yc_cmd.def into its own slot in yc_cmd_table[], so
+ * finding one is a hash, one load and one compare. To add a command, add it
+ * to yc_cmd.def and write its yc_cmd_<name>() here.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "yc_cmd.h"
+#include "yc_cmdhash.h"
+#include "yc_room.h"
+#include "yc_nick.h"
+#include "yc_store.h"
+#include "yc_search.h"
+
+/* most messages /history will send */
+#define YC_CMD_HISTORY_MAX (1000)
+
+typedef void (*yc_cmd_fn_t)(yc_conn_t *c, const char *args, size_t len);
+
+typedef struct {
+  const char  *name;
+  size_t       len;
+  yc_cmd_fn_t  fn;
+} yc_cmd_ent_t;
+
+#include "yc_cmd_table.h"
+
+/* pull the next word off the front of [*args, *args+*len). returns its
+ * length, and moves args past it and any spaces that follow */
+static size_t yc_cmd_word(const char **args, size_t *len, const char **word) {
+  const char *p = *args, *end = *args + *len;
+  while (p < end && *p == ' ')
+    p++;
+  *word = p;
+  while (p < end && *p != ' ')
+    p++;
+  size_t wlen = p - *word;
+  while (p < end && *p == ' ')
+    p++;
+  *args = p;
+  *len  = end - p;
+  return wlen;
+}
+
+static int yc_cmd_valid_name(const char *name, size_t len) {
+  if (len == 0 || len > YC_NAME_MAX)
+    return 0;
+  for (size_t i = 0; i < len; i++)
+    if ((unsigned char) name[i] <= ' ')
+      return 0;
+  return 1;
+}
+
+
+static void yc_cmd_join(yc_conn_t *c, const char *args, size_t len) {
+  const char *name;
+  size_t nlen = yc_cmd_word(&args, &len, &name);
+  if (!yc_cmd_valid_name(name, nlen)) {
+    yc_conn_notice(c, "usage: /join <room> (up to %d characters, no spaces)", YC_NAME_MAX);
+    return;
+  }
+
+  yc_room_t *r = yc_room_join(c, name, nlen);
+  if (!r) {
+    yc_conn_notice(c, "you're in too many rooms; /part one first");
+    return;
+  }
+  yc_conn_notice(c, "now talking in %s", r->ycrm_name->ycn_str);
+}
+
+static void yc_cmd_part(yc_conn_t *c, const char *args, size_t len) {
+  const char *name;
+  size_t nlen = yc_cmd_word(&args, &len, &name);
+
+  yc_room_t *r = nlen ? yc_room_find(name, nlen) : c->ycc_room;
+  if (!r || !yc_room_is_member(c, r)) {
+    if (nlen)
+      yc_conn_notice(c, "you're not in %.*s", (int) nlen, name);
+    else
+      yc_conn_notice(c, "you're not in a room");
+    return;
+  }
+
+  /* the room might go away when we leave, so say so first */
+  yc_conn_notice(c, "left %s", r->ycrm_name->ycn_str);
+  if (c->ycc_flags & YCC_CLOSING)
+    return;
+  yc_room_part(c, r);
+
+  if (c->ycc_room)
+    yc_conn_notice(c, "now talking in %s", c->ycc_room->ycrm_name->ycn_str);
+  else
+    yc_conn_notice(c, "you're not in any rooms; /join one to talk");
+}
+
+
+static void yc_cmd_nick(yc_conn_t *c, const char *args, size_t len) {
+  const char *nick;
+  size_t nlen = yc_cmd_word(&args, &len, &nick);
+  if (!yc_cmd_valid_name(nick, nlen)) {
+    yc_conn_notice(c, "usage: /nick <name> (up to %d characters, no spaces)", YC_NAME_MAX);
+    return;
+  }
+
+  if (yc_nick_set(c, nick, nlen) < 0) {
+    yc_conn_notice(c, "%.*s is taken", (int) nlen, nick);
+    return;
+  }
+  yc_conn_notice(c, "you are now %s", c->ycc_nick->ycn_str);
+}
+
+static void yc_cmd_msg(yc_conn_t *c, const char *args, size_t len) {
+  const char *nick;
+  size_t nlen = yc_cmd_word(&args, &len, &nick);
+  if (!nlen || !len) {
+    yc_conn_notice(c, "usage: /msg <nick> <message>");
+    return;
+  }
+
+  yc_conn_t *to = yc_nick_find(nick, nlen);
+  if (!to) {
+    yc_conn_notice(c, "nobody called %.*s", (int) nlen, nick);
+    return;
+  }
+
+  /* private messages are marked with *stars* around the sender */
+  if (c->ycc_nick)
+    yc_conn_printf(to, "*%s* %.*s", c->ycc_nick->ycn_str, (int) len, args);
+  else
+    yc_conn_printf(to, "*[%d]* %.*s", c->ycc_fd, (int) len, args);
+}
+
+static void yc_cmd_who(yc_conn_t *c, const char *args, size_t len) {
+  const char *name;
+  size_t nlen = yc_cmd_word(&args, &len, &name);
+
+  yc_room_t *r = nlen ? yc_room_find(name, nlen) : c->ycc_room;
+  if (!r) {
+    if (nlen)
+      yc_conn_notice(c, "there's no room called %.*s", (int) nlen, name);
+    else
+      yc_conn_notice(c, "you're not in a room");
+    return;
+  }
+
+  yc_room_who(c, r);
+}
+
+static void yc_cmd_catchup(yc_conn_t *c, const char *args, size_t len) {
+  if (!yc_store_on) {
+    yc_conn_notice(c, "there's no message log");
+    return;
+  }
+
+  const char *word;
+  size_t wlen = yc_cmd_word(&args, &len, &word);
+  if (!wlen) {
+    yc_conn_notice(c, "latest message is %llu", (unsigned long long) yc_store_committed());
+    return;
+  }
+
+  uint64_t seq = 0;
+  for (size_t i = 0; i < wlen; i++) {
+    if (word[i] < '0' || word[i] > '9' || seq > (UINT64_MAX - 9) / 10) {
+      yc_conn_notice(c, "usage: /catchup [seq]");
+      return;
+    }
+    seq = seq * 10 + (word[i] - '0');
+  }
+
+  int64_t n = yc_store_catchup(c, seq);
+  if (n < 0)
+    yc_conn_notice(c, "can't catch up from %llu", (unsigned long long) seq);
+  else if (n == 0)
+    yc_conn_notice(c, "you're up to date");
+}
+
+static void yc_cmd_history(yc_conn_t *c, const char *args, size_t len) {
+  if (!yc_store_on) {
+    yc_conn_notice(c, "there's no message log");
+    return;
+  }
+
+  const char *when, *name;
+  size_t wlen = yc_cmd_word(&args, &len, &when);
+  size_t nlen = yc_cmd_word(&args, &len, &name);
+
+  int hh = 0, mm = 0, colon = -1;
+  for (size_t i = 0; i < wlen && colon != -2; i++) {
+    if (when[i] == ':' && colon < 0)
+      colon = i;
+    else if (when[i] >= '0' && when[i] <= '9') {
+      if (colon < 0)
+        hh = hh * 10 + (when[i] - '0');
+      else
+        mm = mm * 10 + (when[i] - '0');
+    }
+    else
+      colon = -2;
+  }
+  if (colon < 1 || colon > 2 || wlen - colon != 3 || hh > 23 || mm > 59) {
+    yc_conn_notice(c, "usage: /history <hh:mm> [room]");
+    return;
+  }
+
+  if (!nlen) {
+    if (!c->ycc_room) {
+      yc_conn_notice(c, "you're not in a room");
+      return;
+    }
+    name = c->ycc_room->ycrm_name->ycn_str;
+    nlen = c->ycc_room->ycrm_name->ycn_len;
+  }
+
+  /* that time today, local time. if it's not here yet, they mean
+   * yesterday */
+  time_t now = time(NULL);
+  struct tm tm;
+  localtime_r(&now, &tm);
+  tm.tm_hour  = hh;
+  tm.tm_min   = mm;
+  tm.tm_sec   = 0;
+  tm.tm_isdst = -1;
+  time_t since = mktime(&tm);
+  if (since > now) {
+    tm.tm_mday--;
+    tm.tm_isdst = -1;
+    since = mktime(&tm);
+  }
+
+  yc_conn_notice(c, "%.*s since %02d:%02d:", (int) nlen, name, hh, mm);
+  if (c->ycc_flags & YCC_CLOSING)
+    return;
+
+  int n = yc_store_history(c, yc_name_hash(name, nlen), (int64_t) since * 1000, YC_CMD_HISTORY_MAX);
+  if (n < 0)
+    yc_conn_notice(c, "can't read the log");
+  else if (n == 0)
+    yc_conn_notice(c, "nothing");
+  else if (n == YC_CMD_HISTORY_MAX)
+    yc_conn_notice(c, "that's the last %d; there may be more before them", n);
+  else
+    yc_conn_notice(c, "%d messages", n);
+}
+
+static void yc_cmd_search(yc_conn_t *c, const char *args, size_t len) {
+  if (!yc_search_on) {
+    yc_conn_notice(c, "searching is off");
+    return;
+  }
+  if (!c->ycc_room) {
+    yc_conn_notice(c, "you're not in a room");
+    return;
+  }
+
+  while (len && *args == ' ') {
+    args++;
+    len--;
+  }
+  yc_search_start(c, c->ycc_room->ycrm_name->ycn_hash, args, len);
+}
+
+/* the answer to a ping. hearing anything at all from them is enough (see
+ * yc_idle_* in yc_core.c), so there's nothing more to do */
+static void yc_cmd_pong(yc_conn_t *c, const char *args, size_t len) {
+}
+
+
+void yc_cmd_exec(yc_conn_t *c, const char *line, size_t len) {
+  /* telnet and friends send \r\n; don't let the \r become part of an
+   * argument */
+  if (len > 0 && line[len-1] == '\r')
+    len--;
+
+  const char *args = line+1;
+  size_t alen = len-1;
+  const char *cmd;
+  size_t clen = yc_cmd_word(&args, &alen, &cmd);
+
+  if (clen > 0) {
+    const yc_cmd_ent_t *e = &yc_cmd_table[yc_cmd_hash(cmd, clen, YC_CMD_SEED, YC_CMD_BITS)];
+    if (e->len == clen && memcmp(e->name, cmd, clen) == 0) {
+      e->fn(c, args, alen);
+      return;
+    }
+  }
+
+  yc_conn_notice(c, "unknown command /%.*s", (int) clen, cmd);
+}
@@ -0,0 +1,33 @@
+/* yc_cmd - slash commands for yoctochat servers */
+
+/* A line that starts with '/' isn't chat, it's a command for the server:
+ *
+ *   /join <room>    join a room (making it if need be) and talk there
+ *   /part [room]    leave a room (the current one if not given)
+ *   /nick <name>    set your nickname
+ *   /msg <nick> <message>
+ *                   send a private message
+ *   /who [room]     list who's in a room (the current one if not given)
+ *   /catchup [seq]  send every message after seq from the log (see
+ *                   yc_store.h). without seq, say what the latest is
+ *   /history <hh:mm> [room]
+ *                   send a room's messages since then (today, or
+ *                   yesterday if that's still to come) from the log
+ *   /search <words> find recent messages in the current room with all of
+ *                   those words in them (see yc_search.h)
+ *   /pong           answer a "ping" notice. does nothing, but it's
+ *                   something, which is all a ping wants
+ */
+
+#ifndef YC_CMD_H
+#define YC_CMD_H
+
+#include <stddef.h>
+
+#include "yc_core.h"
+
+/* run a command. line is the whole line, starting with the '/', without
+ * the newline */
+void yc_cmd_exec(yc_conn_t *c, const char *line, size_t len);
+
+#endif
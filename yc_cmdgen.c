@@ -0,0 +1,119 @@
+/* yc_cmdgen - generate the command dispatch table */
+
+/* Run at build time. Reads the list of commands (yc_cmd.def), and finds a
+ * seed for yc_cmd_hash() that puts each one in a different slot of a small
+ * table. Then writes that table out as C, for yc_cmd.c to include.
+ *
+ * At runtime, finding a command is then: hash the word, look at that one
+ * slot, and check it's really the same word. No chain of strcmp()s, and it
+ * takes the same time whichever command it is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "yc_cmdhash.h"
+
+#define MAX_CMDS (64)
+#define MAX_NAME (32)
+
+static char names[MAX_CMDS][MAX_NAME];
+static int  ncmds;
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <commands.def>\n", argv[0]);
+    exit(2);
+  }
+
+  FILE *f = fopen(argv[1], "r");
+  if (!f) {
+    perror(argv[1]);
+    exit(1);
+  }
+
+  char line[256];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+
+    char *p = line;
+    while (isspace((unsigned char) *p))
+      p++;
+    if (*p == '#' || *p == '\0')
+      continue;
+
+    size_t len = 0;
+    while (p[len] && (isalnum((unsigned char) p[len]) || p[len] == '_'))
+      len++;
+    if (len == 0 || len >= MAX_NAME || (p[len] && !isspace((unsigned char) p[len]))) {
+      fprintf(stderr, "%s:%d: bad command name\n", argv[1], lineno);
+      exit(1);
+    }
+    if (ncmds == MAX_CMDS) {
+      fprintf(stderr, "%s:%d: too many commands\n", argv[1], lineno);
+      exit(1);
+    }
+    memcpy(names[ncmds++], p, len);
+  }
+  fclose(f);
+
+  /* the hash can only tell commands apart by first byte, last byte and
+   * length. if two have all three the same, no seed will help */
+  for (int i = 0; i < ncmds; i++) {
+    for (int j = i+1; j < ncmds; j++) {
+      if (yc_cmd_key(names[i], strlen(names[i])) == yc_cmd_key(names[j], strlen(names[j]))) {
+        fprintf(stderr, "%s: '%s' and '%s' look the same to yc_cmd_hash(); it needs improving\n",
+          argv[1], names[i], names[j]);
+        exit(1);
+      }
+    }
+  }
+
+  /* start with a table at least twice as big as the number of commands, so
+   * seeds are easy to find, and double it if we can't find one */
+  int bits = 1;
+  while ((1 << bits) < ncmds*2)
+    bits++;
+
+  uint32_t seed = 0;
+  int slot[MAX_CMDS];
+  static char used[1 << 16];
+  for (; bits <= 16; bits++) {
+    /* odd multipliers only; an even one throws away a bit */
+    for (uint32_t s = 0x9e3779b1; s != 0x9e3779b1 + 2000000 && !seed; s += 2) {
+      memset(used, 0, 1 << bits);
+      int i;
+      for (i = 0; i < ncmds; i++) {
+        slot[i] = yc_cmd_hash(names[i], strlen(names[i]), s, bits);
+        if (used[slot[i]])
+          break;
+        used[slot[i]] = 1;
+      }
+      if (i == ncmds)
+        seed = s;
+    }
+    if (seed)
+      break;
+  }
+  if (!seed) {
+    fprintf(stderr, "%s: couldn't find a perfect hash\n", argv[1]);
+    exit(1);
+  }
+
+  printf("/* generated by yc_cmdgen from %s. don't edit */\n\n", argv[1]);
+  printf("#define YC_CMD_SEED (0x%08xu)\n", seed);
+  printf("#define YC_CMD_BITS (%d)\n\n", bits);
+
+  for (int i = 0; i < ncmds; i++)
+    printf("static void yc_cmd_%s(yc_conn_t *c, const char *args, size_t len);\n", names[i]);
+
+  printf("\nstatic const yc_cmd_ent_t yc_cmd_table[1 << YC_CMD_BITS] = {\n");
+  for (int i = 0; i < ncmds; i++)
+    printf("  [%d] = { \"%s\", %zu, yc_cmd_%s },\n", slot[i], names[i], strlen(names[i]), names[i]);
+  printf("};\n");
+
+  return 0;
+}
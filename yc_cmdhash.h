@@ -0,0 +1,27 @@
+/* yc_cmdhash - the hash function behind command dispatch */
+
+/* Shared between yc_cmdgen, which picks a seed that makes this hash perfect
+ * (no two commands land in the same slot) for the commands we have, and
+ * yc_cmd.c, which uses it to go straight from a command word to its slot.
+ *
+ * It only looks at the first and last bytes and the length, which is
+ * enough to tell our commands apart and costs the same for any length of
+ * word. The generator checks that's still true whenever a command is added.
+ */
+
+#ifndef YC_CMDHASH_H
+#define YC_CMDHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+static inline uint32_t yc_cmd_key(const char *s, size_t len) {
+  return (uint32_t) (uint8_t) s[0] | (uint32_t) (uint8_t) s[len-1] << 8 | (uint32_t) len << 16;
+}
+
+/* multiply by the seed and keep the top bits. len must be at least 1 */
+static inline uint32_t yc_cmd_hash(const char *s, size_t len, uint32_t seed, int bits) {
+  return (yc_cmd_key(s, len) * seed) >> (32 - bits);
+}
+
+#endif
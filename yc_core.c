@@ -0,0 +1,2084 @@
+/* yc_core - the shared parts of every yoctochat server */
+
+/* See yc_core.h for the overview. Everything in here used to be copied into
+ * each server; the comments that explained it there have come along too. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "yc_core.h"
+#include "yc_log.h"
+#include "yc_trace.h"
+#include "yc_scan.h"
+#include "yc_room.h"
+#include "yc_cmd.h"
+#include "yc_nick.h"
+#include "yc_presence.h"
+#include "yc_store.h"
+#include "yc_search.h"
+#include "yc_timer.h"
+
+yc_stats_t  yc_stats;
+yc_conn_t **yc_conns;
+int         yc_max_fds;
+
+
+/* what to put in front of each message to say who it's from */
+enum {
+  YC_PREFIX_NONE,
+  YC_PREFIX_FD,
+  YC_PREFIX_NICK,
+};
+
+/* what to do with a connection that isn't keeping up */
+enum {
+  YC_OQ_DISCONNECT,
+  YC_OQ_DROP,
+  YC_OQ_DIGEST,
+};
+
+/* configuration. these can be changed from the commandline with -o */
+static struct {
+  /* hard cap on connection table size; 0 means "as many as we can" */
+  int    max_conns;
+
+  /* if a connection has more than this many bytes (not counting what's
+   * sent from files) or messages queued for output, it's not keeping up,
+   * and the policy (one of YC_OQ_*) says what happens. for digests, how
+   * often to see if they're ready for one */
+  size_t oq_max;
+  int    oq_msgs;
+  int    oq_policy;
+  int    oq_digest;
+
+  /* most unsent bytes to let the kernel hold for a connection (0 leaves it
+   * to the kernel). the rest waits in the output queue */
+  size_t lowat;
+
+  /* if more than this many bytes of someone's messages are waiting to go
+   * out to everyone, stop reading from them until it's down to half (0 for
+   * no limit) */
+  size_t flow_max;
+
+  /* how many messages, and how many bytes, each client can send per
+   * second (0 for no limit), and how many milliseconds' worth they can
+   * save up for a burst */
+  int    rate_msgs;
+  size_t rate_bytes;
+  int    rate_burst;
+
+  /* ping a client we haven't heard from in this many milliseconds, and
+   * disconnect one we haven't heard from in this many (0 for never) */
+  int    ping;
+  int    idle;
+
+  /* longest line we'll accept. anything longer is thrown away */
+  size_t max_line;
+
+  /* sender prefix; one of YC_PREFIX_* */
+  int    prefix;
+
+  /* how many lines the log ring can hold before it starts dropping them */
+  int    log_ring;
+
+  /* if set, record every connect, read, write and close in a binary trace
+   * file here, with room for this many events per thread */
+  const char *trace_path;
+  size_t      trace_size;
+
+  /* join and quit notices are gathered up for this many milliseconds (0 for
+   * no notices), and each summary lists this many names of each */
+  int    presence;
+  int    presence_max;
+
+  /* how many messages each room remembers, to send to people who join */
+  int    history;
+
+  /* if set, log every message to disk here (see yc_store.h) */
+  const char *store_path;
+  size_t      store_segment;
+  int         store_commit;
+  size_t      store_bytes;
+  int         store_strict;
+  int         store_compress;
+
+  /* how many recent messages /search looks through (see yc_search.h) */
+  int    search;
+} yc_config = {
+  .max_conns  = 0,
+  .oq_max     = 1024*1024,
+  .oq_msgs    = 0,
+  .oq_policy  = YC_OQ_DISCONNECT,
+  .oq_digest  = 1000,
+  .lowat      = 16384,
+  .flow_max   = 4*1024*1024,
+  .rate_msgs  = 0,
+  .rate_bytes = 0,
+  .rate_burst = 1000,
+  .ping       = 60000,
+  .idle       = 0,
+  .max_line   = 16384,
+  .prefix     = YC_PREFIX_NONE,
+  .log_ring   = 8192,
+  .trace_path = NULL,
+  .trace_size = 1024*1024,
+  .presence   = 50,
+  .presence_max = 32,
+  .history    = 20,
+  .store_path    = NULL,
+  .store_segment = 64*1024*1024,
+  .store_commit  = 10,
+  .store_bytes   = 1024*1024,
+  .store_strict  = 0,
+  .store_compress = 4,
+  .search     = 10000,
+};
+
+
+/* commandline options. each one is -o name=value */
+
+static int yc_opt_int(void *dst, const char *val) {
+  char *end;
+  long n = strtol(val, &end, 10);
+  if (*val == '\0' || *end != '\0' || n < 0)
+    return -1;
+  *(int *) dst = (int) n;
+  return 0;
+}
+
+/* like yc_opt_int, but allows a k/m/g suffix */
+static int yc_opt_size(void *dst, const char *val) {
+  char *end;
+  unsigned long long n = strtoull(val, &end, 10);
+  if (*val == '\0' || *val == '-')
+    return -1;
+  switch (*end) {
+    case 'k': case 'K': n <<= 10; end++; break;
+    case 'm': case 'M': n <<= 20; end++; break;
+    case 'g': case 'G': n <<= 30; end++; break;
+  }
+  if (*end != '\0')
+    return -1;
+  *(size_t *) dst = (size_t) n;
+  return 0;
+}
+
+static int yc_opt_str(void *dst, const char *val) {
+  if (*val == '\0')
+    return -1;
+  *(const char **) dst = val;
+  return 0;
+}
+
+static int yc_opt_prefix(void *dst, const char *val) {
+  if (strcmp(val, "none") == 0)
+    *(int *) dst = YC_PREFIX_NONE;
+  else if (strcmp(val, "fd") == 0)
+    *(int *) dst = YC_PREFIX_FD;
+  else if (strcmp(val, "nick") == 0)
+    *(int *) dst = YC_PREFIX_NICK;
+  else
+    return -1;
+  return 0;
+}
+
+static int yc_opt_storesync(void *dst, const char *val) {
+  if (strcmp(val, "group") == 0)
+    *(int *) dst = 0;
+  else if (strcmp(val, "strict") == 0)
+    *(int *) dst = 1;
+  else
+    return -1;
+  return 0;
+}
+
+static int yc_opt_oqpolicy(void *dst, const char *val) {
+  if (strcmp(val, "disconnect") == 0)
+    *(int *) dst = YC_OQ_DISCONNECT;
+  else if (strcmp(val, "drop") == 0)
+    *(int *) dst = YC_OQ_DROP;
+  else if (strcmp(val, "digest") == 0)
+    *(int *) dst = YC_OQ_DIGEST;
+  else
+    return -1;
+  return 0;
+}
+
+static int yc_opt_loglevel(void *dst, const char *val) {
+  return yc_log_parse_level(val, (yc_log_level_t *) dst);
+}
+
+typedef struct {
+  const char *yco_name;
+  const char *yco_help;
+  int       (*yco_set)(void *dst, const char *val);
+  void       *yco_dst;
+} yc_option_t;
+
+static const yc_option_t yc_options[] = {
+  { "maxconns", "maximum number of connections (default: as many as the fd limit allows)",
+    yc_opt_int,  &yc_config.max_conns },
+  { "oqmax",    "a client with more than this many bytes waiting to be sent isn't keeping up (default: 1m)",
+    yc_opt_size, &yc_config.oq_max },
+  { "oqmsgs",   "or more than this many messages, 0 for no limit (default: 0)",
+    yc_opt_int,  &yc_config.oq_msgs },
+  { "oqpolicy", "what happens to a client that isn't keeping up: disconnect, drop (its oldest "
+                "messages) or digest (stop sending, and say what it missed later) (default: disconnect)",
+    yc_opt_oqpolicy, &yc_config.oq_policy },
+  { "oqdigest", "how often to see if a client is ready for its digest, in ms (default: 1000)",
+    yc_opt_int,  &yc_config.oq_digest },
+  { "lowat",    "most unsent bytes to leave with the kernel for a client, 0 for no limit (default: 16k)",
+    yc_opt_size, &yc_config.lowat },
+  { "flowmax",  "stop reading from a client when more than this many bytes of what it sent are "
+                "waiting to go out to everyone, 0 for no limit (default: 4m)",
+    yc_opt_size, &yc_config.flow_max },
+  { "ratemsgs", "most messages a client may send per second, 0 for no limit (default: 0)",
+    yc_opt_int,  &yc_config.rate_msgs },
+  { "ratebytes", "most bytes a client may send per second, 0 for no limit (default: 0)",
+    yc_opt_size, &yc_config.rate_bytes },
+  { "rateburst", "how many ms of those a client can save up and send at once (default: 1000)",
+    yc_opt_int,  &yc_config.rate_burst },
+  { "ping",     "ping a client that's been quiet for this many ms, 0 for never (default: 60000)",
+    yc_opt_int,  &yc_config.ping },
+  { "idle",     "disconnect a client that's been quiet for this many ms, 0 for never (default: 0)",
+    yc_opt_int,  &yc_config.idle },
+  { "maxline",  "longest line a client may send; longer ones are dropped (default: 16k)",
+    yc_opt_size, &yc_config.max_line },
+  { "prefix",   "put this in front of each message to say who sent it: none, fd or nick (default: none)",
+    yc_opt_prefix, &yc_config.prefix },
+  { "log",      "what to log: off, error, connect, message or debug (default: connect)",
+    yc_opt_loglevel, &yc_log_level },
+  { "logring",  "number of log lines that can be waiting to be written (default: 8192)",
+    yc_opt_int,  &yc_config.log_ring },
+  { "trace",    "record a binary trace of every connection event to this file (default: off)",
+    yc_opt_str,  &yc_config.trace_path },
+  { "tracesize", "number of events kept in the trace, per thread (default: 1m)",
+    yc_opt_size, &yc_config.trace_size },
+  { "presence", "gather join and quit notices for this many ms, 0 for none (default: 50)",
+    yc_opt_int,  &yc_config.presence },
+  { "presencemax", "most names listed in each join or quit notice (default: 32)",
+    yc_opt_int,  &yc_config.presence_max },
+  { "history",  "number of messages each room remembers for people who join (default: 20)",
+    yc_opt_int,  &yc_config.history },
+  { "store",    "log every message to segment files in this directory (default: off)",
+    yc_opt_str,  &yc_config.store_path },
+  { "storesegment", "start a new log segment when one gets this big (default: 64m)",
+    yc_opt_size, &yc_config.store_segment },
+  { "storecommit", "sync the log at least this often, in ms (default: 10)",
+    yc_opt_int,  &yc_config.store_commit },
+  { "storebytes", "or when this much has been logged since the last sync (default: 1m)",
+    yc_opt_size, &yc_config.store_bytes },
+  { "storesync", "group: send messages right away and sync in the background; "
+                 "strict: don't send them until they're synced (default: group)",
+    yc_opt_storesync, &yc_config.store_strict },
+  { "storecompress", "compress log segments older than the newest this many, 0 for never (default: 4)",
+    yc_opt_int,  &yc_config.store_compress },
+  { "search",   "number of recent messages /search looks through, 0 for none (default: 10000)",
+    yc_opt_int,  &yc_config.search },
+  { NULL }
+};
+
+static void yc_usage(const char *prog, int full) {
+  printf("usage: %s [-o name=value ...] <port>\n", prog);
+  if (!full)
+    return;
+  printf("options:\n");
+  for (const yc_option_t *o = yc_options; o->yco_name; o++)
+    printf("  %-12s %s\n", o->yco_name, o->yco_help);
+}
+
+static void yc_parse_option(const char *prog, char *arg) {
+  char *eq = strchr(arg, '=');
+  if (!eq) {
+    printf("option '%s' should be name=value\n", arg);
+    exit(1);
+  }
+  *eq = '\0';
+  for (const yc_option_t *o = yc_options; o->yco_name; o++) {
+    if (strcmp(o->yco_name, arg) != 0)
+      continue;
+    if (o->yco_set(o->yco_dst, eq+1) < 0) {
+      printf("'%s' not a valid value for option '%s'\n", eq+1, arg);
+      exit(1);
+    }
+    return;
+  }
+  printf("unknown option '%s'\n", arg);
+  yc_usage(prog, 1);
+  exit(1);
+}
+
+
+/* how much each connection has waiting when it's flushed, as a histogram
+ * with a bucket per power of two bytes (the first is for nothing at all),
+ * and the most messages any of them has had */
+#define YC_OQ_BUCKETS (40)
+static uint64_t yc_oq_hist[YC_OQ_BUCKETS];
+static uint64_t yc_oq_nsamples;
+static size_t   yc_oq_bytes_max;
+static unsigned yc_oq_msgs_max;
+
+static void yc_oq_sample(yc_conn_t *c) {
+  size_t bytes = c->ycc_oq_bytes;
+  int bucket = bytes ? 64 - __builtin_clzll(bytes) : 0;
+  if (bucket >= YC_OQ_BUCKETS)
+    bucket = YC_OQ_BUCKETS-1;
+  yc_oq_hist[bucket]++;
+  yc_oq_nsamples++;
+  if (bytes > yc_oq_bytes_max)
+    yc_oq_bytes_max = bytes;
+  if (c->ycc_oq_msgs > yc_oq_msgs_max)
+    yc_oq_msgs_max = c->ycc_oq_msgs;
+}
+
+/* the upper bound of the bucket the given fraction of samples are in or
+ * under */
+static uint64_t yc_oq_pct(double frac) {
+  uint64_t want = (uint64_t) (yc_oq_nsamples * frac + 0.5), seen = 0;
+  for (int i = 0; i < YC_OQ_BUCKETS; i++) {
+    seen += yc_oq_hist[i];
+    if (seen >= want)
+      return i ? 1ull << i : 0;
+  }
+  return 0;
+}
+
+/* set by the SIGUSR1 handler; checked once per loop */
+static volatile sig_atomic_t yc_stats_wanted;
+
+static void yc_sigusr1(int sig) {
+  yc_stats_wanted = 1;
+}
+
+static void yc_stats_dump(void) {
+  printf("stats: accepts=%llu closes=%llu reads=%llu bytes_in=%llu msgs_in=%llu "
+         "msgs_out=%llu writes=%llu bytes_out=%llu overlong=%llu log_dropped=%llu "
+         "pings=%llu idle_closes=%llu\n",
+    (unsigned long long) yc_stats.ycs_accepts,
+    (unsigned long long) yc_stats.ycs_closes,
+    (unsigned long long) yc_stats.ycs_reads,
+    (unsigned long long) yc_stats.ycs_bytes_in,
+    (unsigned long long) yc_stats.ycs_msgs_in,
+    (unsigned long long) yc_stats.ycs_msgs_out,
+    (unsigned long long) yc_stats.ycs_writes,
+    (unsigned long long) yc_stats.ycs_bytes_out,
+    (unsigned long long) yc_stats.ycs_overlong,
+    (unsigned long long) yc_log_dropped(),
+    (unsigned long long) yc_stats.ycs_pings,
+    (unsigned long long) yc_stats.ycs_idle_closes);
+  printf("oq: depth_p50<=%llu depth_p99<=%llu depth_max=%zu msgs_max=%u "
+         "dropped=%llu missed=%llu digests=%llu disconnects=%llu blocked=%llu paused=%llu throttled=%llu\n",
+    (unsigned long long) yc_oq_pct(0.50),
+    (unsigned long long) yc_oq_pct(0.99),
+    yc_oq_bytes_max, yc_oq_msgs_max,
+    (unsigned long long) yc_stats.ycs_oq_dropped,
+    (unsigned long long) yc_stats.ycs_oq_missed,
+    (unsigned long long) yc_stats.ycs_oq_digests,
+    (unsigned long long) yc_stats.ycs_oq_full,
+    (unsigned long long) yc_stats.ycs_oq_blocked,
+    (unsigned long long) yc_stats.ycs_flow_paused,
+    (unsigned long long) yc_stats.ycs_rate_throttled);
+  fflush(stdout);
+
+  if (yc_store_on)
+    yc_store_stats_dump();
+  if (yc_search_on)
+    yc_search_stats_dump();
+}
+
+
+/* the dense list of active connections. the connection table is indexed by
+ * fd, which is great for looking someone up but terrible for "send this to
+ * everyone": you'd have to walk the whole table, most of which is empty. so
+ * we also keep every active connection packed into the front of this array.
+ * removal swaps the last entry into the hole, so it's O(1) and the array
+ * never has gaps */
+static yc_conn_t **yc_active;
+static int         yc_nactive;
+
+static void yc_active_add(yc_conn_t *c) {
+  c->ycc_active = yc_nactive;
+  yc_active[yc_nactive++] = c;
+}
+
+static void yc_active_remove(yc_conn_t *c) {
+  int i = c->ycc_active;
+  yc_conn_t *last = yc_active[--yc_nactive];
+  yc_active[i] = last;
+  last->ycc_active = i;
+  c->ycc_active = -1;
+}
+
+
+/* the flush list: connections that had output queued during this iteration.
+ * yc_core_tick() walks it and hands each one to the backend. queueing several
+ * messages for a connection and then sending them all in one writev() is much
+ * cheaper than one write() per message */
+static int *yc_dirty;
+static int  yc_ndirty;
+static int  yc_dirty_cap;
+
+void yc_conn_dirty_slow(yc_conn_t *c) {
+  /* a connection can only be on the list once, but an fd can be closed and
+   * reused in the same iteration and so appear twice. so the list has to be
+   * able to grow, though it very rarely will */
+  if (yc_ndirty == yc_dirty_cap) {
+    yc_dirty_cap = yc_dirty_cap ? yc_dirty_cap * 2 : 256;
+    yc_dirty = realloc(yc_dirty, yc_dirty_cap * sizeof(int));
+    if (!yc_dirty) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  c->ycc_flags |= YCC_DIRTY;
+  yc_dirty[yc_ndirty++] = c->ycc_fd;
+}
+
+
+/* the sooner of two timeouts, where -1 is never */
+static int yc_timeout_min(int a, int b) {
+  if (a < 0)
+    return b;
+  if (b < 0)
+    return a;
+  return a < b ? a : b;
+}
+
+/* monotonic time in milliseconds. the clock is only read the first time
+ * it's asked for on each trip around the loop, so things like the rate
+ * limits can look at it on every read for nothing. it's forgotten when the
+ * backend is about to wait (see yc_core_timeout()) */
+static uint64_t yc_now;
+static int      yc_now_valid;
+
+static uint64_t yc_now_ms(void) {
+  if (!yc_now_valid) {
+    yc_now = yc_trace_now() / 1000000;
+    yc_now_valid = 1;
+  }
+  return yc_now;
+}
+
+/* we stop reading from a connection when flow control or the rate limits
+ * say so, and start again once neither of them does */
+static void yc_conn_pause_update(yc_conn_t *c) {
+  int paused = !!(c->ycc_flags & (YCC_FLOWSTOP|YCC_THROTTLED));
+  if (paused == !!(c->ycc_flags & YCC_PAUSED))
+    return;
+  c->ycc_flags ^= YCC_PAUSED;
+  yc_backend_pause(c, paused);
+}
+
+
+/* connections waiting for a digest, by fd. like the flush list, an entry can
+ * be out of date, so each one is checked when it comes up */
+static int     *yc_digest;
+static int      yc_ndigest, yc_digest_cap;
+static uint64_t yc_digest_due;      /* next look at them (monotonic ms) */
+
+static void yc_digest_add(yc_conn_t *c) {
+  if (yc_ndigest == yc_digest_cap) {
+    yc_digest_cap = yc_digest_cap ? yc_digest_cap * 2 : 64;
+    yc_digest = realloc(yc_digest, yc_digest_cap * sizeof(int));
+    if (!yc_digest) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  if (!yc_ndigest)
+    yc_digest_due = yc_now_ms() + yc_config.oq_digest;
+  yc_digest[yc_ndigest++] = c->ycc_fd;
+}
+
+/* send a digest to everyone who's caught up with at least half of what they
+ * had waiting, and keep the rest for next time */
+static void yc_digest_tick(void) {
+  uint64_t now = yc_now_ms();
+  if (now < yc_digest_due)
+    return;
+  yc_digest_due = now + yc_config.oq_digest;
+
+  int n = 0;
+  for (int i = 0; i < yc_ndigest; i++) {
+    yc_conn_t *c = yc_conn_get(yc_digest[i]);
+    if (!c || (c->ycc_flags & (YCC_DIGEST|YCC_CLOSING)) != YCC_DIGEST)
+      continue;
+    if (c->ycc_oq_bytes - c->ycc_oq_fbytes > yc_config.oq_max / 2 ||
+        (yc_config.oq_msgs && c->ycc_oq_msgs > (unsigned) yc_config.oq_msgs / 2)) {
+      yc_digest[n++] = yc_digest[i];
+      continue;
+    }
+
+    c->ycc_flags &= ~YCC_DIGEST;
+    if (yc_store_on)
+      yc_conn_notice(c, "you weren't keeping up, so you missed some messages; /catchup %llu to get them",
+        (unsigned long long) c->ycc_oq_since);
+    else
+      yc_conn_notice(c, "you weren't keeping up, so you missed some messages");
+    c->ycc_oq_lost = 0;
+    yc_stats.ycs_oq_digests++;
+  }
+  yc_ndigest = n;
+}
+
+static int yc_digest_timeout(void) {
+  uint64_t now = yc_now_ms();
+  return now >= yc_digest_due ? 0 : (int) (yc_digest_due - now);
+}
+
+
+/* flow control. someone sending faster than the people they're sending to
+ * can take it fills up all of their output queues, and reading everything
+ * they send just means more memory and more work for nothing. so every byte
+ * queued from a buffer counts against the connection it came from, until
+ * it's sent (or dropped), and when that's more than flow_max, we stop
+ * reading from them. then their socket buffer fills up, and TCP tells them
+ * to slow down. once it's down to half, we start again.
+ *
+ * it's checked after everything's been flushed, so a burst that's sent
+ * right away never counts. what's left is what's really backed up.
+ *
+ * a listener that's stopped reading altogether can hold a sender's bytes
+ * for as long as it takes to fill its queue, and the sender can't fill it
+ * while they're paused. so nobody's paused for more than
+ * YC_FLOW_PAUSE_MAX ms at a time: then they get another read, which moves
+ * things along (and pauses them again, if they're still over) */
+#define YC_FLOW_PAUSE_MAX (1000)
+
+/* connections over the limit, or paused, by fd. like the others, an entry
+ * can be out of date */
+static int *yc_flow;
+static int  yc_nflow, yc_flow_cap;
+
+/* the sender of a buffer's messages, if we're counting and they're still
+ * here */
+static inline yc_conn_t *yc_flow_sender(const yc_buf_t *b) {
+  if (!yc_config.flow_max || b->ycb_from < 0)
+    return NULL;
+  yc_conn_t *s = yc_conn_get(b->ycb_from);
+  return s && s->ycc_gen == b->ycb_gen ? s : NULL;
+}
+
+static void yc_flow_add(yc_buf_t *b, size_t n) {
+  yc_conn_t *s = yc_flow_sender(b);
+  if (!s)
+    return;
+  s->ycc_flow += n;
+  if (s->ycc_flow <= yc_config.flow_max || (s->ycc_flags & YCC_FLOW))
+    return;
+
+  if (yc_nflow == yc_flow_cap) {
+    yc_flow_cap = yc_flow_cap ? yc_flow_cap * 2 : 64;
+    yc_flow = realloc(yc_flow, yc_flow_cap * sizeof(int));
+    if (!yc_flow) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  s->ycc_flags |= YCC_FLOW;
+  yc_flow[yc_nflow++] = s->ycc_fd;
+}
+
+static void yc_flow_sub(yc_buf_t *b, size_t n) {
+  yc_conn_t *s = yc_flow_sender(b);
+  if (s)
+    s->ycc_flow -= n;
+}
+
+/* mark a buffer as holding a connection's messages */
+static yc_buf_t *yc_buf_from(yc_buf_t *b, yc_conn_t *c) {
+  b->ycb_from = c->ycc_fd;
+  b->ycb_gen  = c->ycc_gen;
+  return b;
+}
+
+/* pause anyone who's still over after the flush, and start anyone who's
+ * paused again if they've come down, or have waited long enough */
+static void yc_flow_tick(void) {
+  uint64_t now = yc_now_ms();
+
+  int n = 0;
+  for (int i = 0; i < yc_nflow; i++) {
+    yc_conn_t *c = yc_conn_get(yc_flow[i]);
+    if (!c || (c->ycc_flags & (YCC_FLOW|YCC_CLOSING)) != YCC_FLOW)
+      continue;
+
+    if (!(c->ycc_flags & YCC_FLOWSTOP)) {
+      if (c->ycc_flow > yc_config.flow_max) {
+        yc_log(YC_LOG_DEBUG, "[%d] %zu bytes of theirs waiting, pausing", c->ycc_fd, c->ycc_flow);
+        c->ycc_flags |= YCC_FLOWSTOP;
+        c->ycc_flow_paused = now;
+        yc_stats.ycs_flow_paused++;
+        yc_conn_pause_update(c);
+        yc_flow[n++] = yc_flow[i];
+      }
+      else
+        c->ycc_flags &= ~YCC_FLOW;
+      continue;
+    }
+
+    if (c->ycc_flow > yc_config.flow_max / 2 && now - c->ycc_flow_paused < YC_FLOW_PAUSE_MAX) {
+      yc_flow[n++] = yc_flow[i];
+      continue;
+    }
+
+    c->ycc_flags &= ~(YCC_FLOW|YCC_FLOWSTOP);
+    yc_conn_pause_update(c);
+  }
+  yc_nflow = n;
+}
+
+/* the soonest anyone's pause runs out */
+static int yc_flow_timeout(void) {
+  uint64_t now = yc_now_ms();
+  int timeout = -1;
+  for (int i = 0; i < yc_nflow; i++) {
+    yc_conn_t *c = yc_conn_get(yc_flow[i]);
+    if (!c || (c->ycc_flags & (YCC_FLOWSTOP|YCC_CLOSING)) != YCC_FLOWSTOP)
+      continue;
+    uint64_t waited = now - c->ycc_flow_paused;
+    int left = waited < YC_FLOW_PAUSE_MAX ? (int) (YC_FLOW_PAUSE_MAX - waited) : 0;
+    timeout = yc_timeout_min(timeout, left);
+  }
+  return timeout;
+}
+
+
+/* rate limits. each connection has two token buckets, one for messages and
+ * one for bytes. each one fills up at the configured rate, to hold at most
+ * rateburst ms worth, and everything they send takes tokens out. it's all
+ * worked out when they send something, from the time we already have for
+ * this trip around the loop, so a bucket costs nothing while it's idle.
+ *
+ * what's read is read, so a bucket can go into debt. then we stop reading
+ * from them, and set a timer for when it's paid off. until then, whatever
+ * they send waits in their socket, and TCP slows them down for us.
+ *
+ * tokens are kept in thousandths, so a bucket gains exactly rate of them
+ * each millisecond, and everything stays in integers */
+
+/* messages (and commands) in the read being processed */
+static int yc_rate_nmsgs;
+
+/* refill a bucket for elapsed ms, take n out, and say how many ms until it's
+ * out of debt */
+static uint64_t yc_rate_take(int64_t *tokens, uint64_t rate, uint64_t elapsed, uint64_t n) {
+  int64_t cap = (int64_t) (rate * yc_config.rate_burst);
+  if (elapsed > (uint64_t) yc_config.rate_burst)
+    elapsed = yc_config.rate_burst;
+  *tokens += (int64_t) (elapsed * rate);
+  if (*tokens > cap)
+    *tokens = cap;
+  *tokens -= (int64_t) (n * 1000);
+  return *tokens < 0 ? (uint64_t) (-*tokens + rate - 1) / rate : 0;
+}
+
+/* they've paid off their debt; start reading from them again */
+static void yc_rate_wake(yc_timer_t *t) {
+  yc_conn_t *c = (yc_conn_t *) ((char *) t - offsetof(yc_conn_t, ycc_rate_timer));
+  c->ycc_flags &= ~YCC_THROTTLED;
+  yc_conn_pause_update(c);
+}
+
+/* start them off with full buckets */
+static void yc_rate_start(yc_conn_t *c) {
+  c->ycc_rate_msgs  = (int64_t) yc_config.rate_msgs * yc_config.rate_burst;
+  c->ycc_rate_bytes = (int64_t) yc_config.rate_bytes * yc_config.rate_burst;
+  c->ycc_rate_last  = yc_now_ms();
+}
+
+/* charge them for what they just sent, and if that's more than they had,
+ * stop reading until it's paid for */
+static void yc_rate_charge(yc_conn_t *c, int nmsgs, size_t nbytes) {
+  uint64_t now = yc_now_ms();
+  uint64_t elapsed = now - c->ycc_rate_last;
+  c->ycc_rate_last = now;
+
+  uint64_t wait = 0;
+  if (yc_config.rate_msgs) {
+    uint64_t w = yc_rate_take(&c->ycc_rate_msgs, yc_config.rate_msgs, elapsed, nmsgs);
+    if (w > wait)
+      wait = w;
+  }
+  if (yc_config.rate_bytes) {
+    uint64_t w = yc_rate_take(&c->ycc_rate_bytes, yc_config.rate_bytes, elapsed, nbytes);
+    if (w > wait)
+      wait = w;
+  }
+  if (!wait)
+    return;
+
+  if (!(c->ycc_flags & YCC_THROTTLED)) {
+    yc_log(YC_LOG_DEBUG, "[%d] over their rate limit, waiting %llu ms", c->ycc_fd, (unsigned long long) wait);
+    c->ycc_flags |= YCC_THROTTLED;
+    yc_stats.ycs_rate_throttled++;
+    yc_conn_pause_update(c);
+  }
+  yc_timer_set(&c->ycc_rate_timer, now + wait, yc_rate_wake);
+}
+
+
+/* heartbeats. a peer that's gone away without a word (pulled cable, dead
+ * NAT entry) looks exactly like one that's just quiet, until we try to
+ * send it something. so anyone who's been quiet for a while gets a ping,
+ * and if TCP can't deliver it, we'll find out. answering is optional; a
+ * live client's TCP acks it either way. if they'd rather not be cut off
+ * by idle, they can /pong, or say anything else.
+ *
+ * every connection has a timer, set for the next time it needs looking at.
+ * reads don't move it, they just note the time, and it works out where it
+ * should have been when it goes off. so a busy connection costs nothing
+ * here, and a quiet one costs one timer every ping interval */
+
+static void yc_idle_check(yc_timer_t *t);
+
+/* set the timer for the next ping, or the disconnect, whichever's first */
+static void yc_idle_arm(yc_conn_t *c) {
+  uint64_t next = UINT64_MAX;
+  if (yc_config.ping) {
+    uint64_t last = c->ycc_pinged > c->ycc_heard ? c->ycc_pinged : c->ycc_heard;
+    next = last + yc_config.ping;
+  }
+  if (yc_config.idle && c->ycc_heard + yc_config.idle < next)
+    next = c->ycc_heard + yc_config.idle;
+  if (next != UINT64_MAX)
+    yc_timer_set(&c->ycc_idle_timer, next, yc_idle_check);
+}
+
+static void yc_idle_check(yc_timer_t *t) {
+  yc_conn_t *c = (yc_conn_t *) ((char *) t - offsetof(yc_conn_t, ycc_idle_timer));
+  uint64_t now = yc_now_ms();
+
+  /* if we've stopped reading from them, we can't hear them. that's not
+   * their fault */
+  if (c->ycc_flags & YCC_PAUSED)
+    c->ycc_heard = now;
+
+  if (yc_config.idle && now - c->ycc_heard >= (uint64_t) yc_config.idle) {
+    yc_log(YC_LOG_CONNECT, "[%d] nothing from them for %d ms, disconnecting", c->ycc_fd, yc_config.idle);
+    yc_stats.ycs_idle_closes++;
+    yc_conn_close(c);
+    return;
+  }
+
+  if (yc_config.ping) {
+    uint64_t last = c->ycc_pinged > c->ycc_heard ? c->ycc_pinged : c->ycc_heard;
+    if (now - last >= (uint64_t) yc_config.ping) {
+      yc_stats.ycs_pings++;
+      yc_conn_notice(c, "ping");
+
+      /* a ping to someone who isn't reading can be what fills their
+       * output queue, and then they're gone */
+      if (c->ycc_flags & YCC_CLOSING)
+        return;
+      c->ycc_pinged = now;
+    }
+  }
+
+  yc_idle_arm(c);
+}
+
+
+/* the reap list: connections that have been freed, but whose memory hasn't
+ * been let go of yet. a connection can be closed from deep inside
+ * something that's still holding it (a notice that finds its output queue
+ * full, say), and that something needs to be able to see YCC_CLOSING
+ * afterwards rather than freed memory. so yc_conn_free() takes it out of
+ * the table, and the real free waits here until the end of the tick, when
+ * nobody's holding anything */
+static yc_conn_t **yc_reap;
+static int         yc_nreap, yc_reap_cap;
+
+static void yc_conn_release(yc_conn_t *c);
+
+static void yc_reap_all(void) {
+  for (int i = 0; i < yc_nreap; i++)
+    yc_conn_release(yc_reap[i]);
+  yc_nreap = 0;
+}
+
+
+int yc_core_init(int argc, char **argv, int max_fds) {
+  int opt;
+  while ((opt = getopt(argc, argv, "o:h")) != -1) {
+    switch (opt) {
+      case 'o':
+        yc_parse_option(argv[0], optarg);
+        break;
+      case 'h':
+        yc_usage(argv[0], 1);
+        exit(0);
+      default:
+        yc_usage(argv[0], 0);
+        exit(1);
+    }
+  }
+
+  if (optind >= argc) {
+    yc_usage(argv[0], 0);
+    exit(1);
+  }
+
+  int port = atoi(argv[optind]);
+  if (port <= 0) {
+    printf("'%s' not a valid port number\n", argv[optind]);
+    exit(1);
+  }
+
+  /* the input buffer starts at YC_IBUF_SIZE and grows to max_line, so it
+   * can't be any smaller than that */
+  if (yc_config.max_line < YC_IBUF_SIZE)
+    yc_config.max_line = YC_IBUF_SIZE;
+
+  yc_scan_init();
+  yc_room_init(yc_config.history);
+  yc_timer_init(yc_now_ms());
+
+  /* a client that disconnects while we're writing to it would otherwise kill
+   * us with SIGPIPE. we'd much rather get EPIPE from write() and deal with it
+   * like any other error */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* kill -USR1 to see what we've been up to */
+  struct sigaction sa = { .sa_handler = yc_sigusr1 };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  /* figure out how many connections we can have. every connection is a file
+   * descriptor, so the process fd limit is the real ceiling. raise it as far
+   * as we're allowed, then clamp to whatever the backend and the config can
+   * handle */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    if (rl.rlim_cur < rl.rlim_max) {
+      rl.rlim_cur = rl.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &rl);
+      getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    yc_max_fds = rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > (1<<24) ? (1<<24) : (int) rl.rlim_cur;
+  }
+  else
+    yc_max_fds = 1024;
+  if (max_fds > 0 && yc_max_fds > max_fds)
+    yc_max_fds = max_fds;
+  if (yc_config.max_conns > 0 && yc_max_fds > yc_config.max_conns)
+    yc_max_fds = yc_config.max_conns;
+
+  /* create storage for our connections. the table is indexed by fd, and
+   * holds a pointer to the connection object if that fd is connected right
+   * now */
+  yc_conns  = calloc(yc_max_fds, sizeof(yc_conn_t *));
+  yc_active = calloc(yc_max_fds, sizeof(yc_conn_t *));
+  if (!yc_conns || !yc_active) {
+    perror("calloc");
+    exit(1);
+  }
+
+  /* create the server socket */
+  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (server_fd < 0) {
+    perror("socket");
+    exit(1);
+  }
+
+  /* arrange for the listening address to be reusable. This makes TCP
+   * marginally "less safe" (for a whole bunch of obscure reasons) but allows
+   * us to kill and restart the program with ease */
+  int onoff = 1;
+  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &onoff, sizeof(onoff)) < 0) {
+    perror("setsockopt");
+    exit(1);
+  }
+
+  /* set up the address structure for binding, which is *:<port> */
+  struct sockaddr_in sin = {
+    .sin_family = AF_INET,
+    .sin_port   = htons(port),
+    .sin_addr   = {
+      .s_addr = htonl(INADDR_ANY)
+    }
+  };
+
+  /* bind the server socket to the wanted address */
+  if (bind(server_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
+    perror("bind");
+    exit(1);
+  }
+
+  /* and open it for connections! the backlog is how many connections the
+   * kernel will hold for us before we accept() them; a big one helps when
+   * lots of clients arrive at once */
+  if (listen(server_fd, SOMAXCONN) < 0) {
+    perror("listen");
+    exit(1);
+  }
+
+  printf("listening on port %d\n", port);
+  fflush(stdout);
+
+  /* from here on, everything we say goes through the log ring */
+  yc_log_init(yc_config.log_ring);
+
+  if (yc_config.trace_path)
+    yc_trace_open(yc_config.trace_path, yc_config.trace_size);
+
+  yc_presence_init(yc_config.presence, yc_config.presence_max);
+  yc_search_init(yc_config.search);
+
+  if (yc_config.store_path)
+    yc_store_open(yc_config.store_path, yc_config.store_segment,
+      yc_config.store_commit, yc_config.store_bytes, yc_config.store_strict,
+      yc_config.store_compress);
+
+  return server_fd;
+}
+
+void yc_core_tick(void) {
+  /* anything whose time has come */
+  yc_timer_run(yc_now_ms());
+
+  /* join and quit notices, if it's time. before the flush, so they go out
+   * with everything else */
+  yc_presence_tick();
+
+  /* start writing the message log, if it's time. in strict mode this
+   * waits until it's synced, so nothing goes out before it's safe */
+  if (yc_store_on)
+    yc_store_tick();
+
+  /* a bit more of any searches going on */
+  if (yc_search_on)
+    yc_search_tick();
+
+  /* digests for anyone who's ready for theirs */
+  if (yc_ndigest)
+    yc_digest_tick();
+
+  /* send everything that got queued up. the list can grow while we're
+   * walking it: a write that empties a queue which dropped messages sends a
+   * notice about it, and that marks the connection dirty again. so yc_ndirty
+   * is read afresh every time around, and new entries get their turn (and
+   * yc_dirty may be moved by the realloc, so don't hold on to a pointer into
+   * it) */
+  for (int i = 0; i < yc_ndirty; i++) {
+    yc_conn_t *c = yc_conn_get(yc_dirty[i]);
+
+    /* closed since it was queued, or already flushed */
+    if (!c || !(c->ycc_flags & YCC_DIRTY))
+      continue;
+
+    c->ycc_flags &= ~YCC_DIRTY;
+    if (!(c->ycc_flags & YCC_CLOSING)) {
+      yc_oq_sample(c);
+      yc_backend_flush(c);
+    }
+  }
+  yc_ndirty = 0;
+
+  /* now that it's all gone out (or not), see who's sent more than their
+   * listeners can take */
+  if (yc_nflow)
+    yc_flow_tick();
+
+  if (yc_stats_wanted) {
+    yc_stats_wanted = 0;
+    yc_stats_dump();
+  }
+
+  /* last of all, now nothing's holding on to them */
+  if (yc_nreap)
+    yc_reap_all();
+}
+
+int yc_core_timeout(void) {
+  int timeout = yc_presence_timeout();
+  if (yc_store_on)
+    timeout = yc_timeout_min(timeout, yc_store_timeout());
+  if (yc_search_on)
+    timeout = yc_timeout_min(timeout, yc_search_timeout());
+  if (yc_ndigest)
+    timeout = yc_timeout_min(timeout, yc_digest_timeout());
+  if (yc_nflow)
+    timeout = yc_timeout_min(timeout, yc_flow_timeout());
+  timeout = yc_timeout_min(timeout, yc_timer_timeout(yc_now_ms()));
+
+  /* the backend is about to wait, so whatever time it is now won't be by
+   * the time it's done */
+  yc_now_valid = 0;
+
+  return timeout;
+}
+
+int yc_set_nonblock(int fd) {
+  int onoff = 1;
+  return ioctl(fd, FIONBIO, &onoff);
+}
+
+
+yc_buf_t *yc_buf_new(size_t len) {
+  yc_buf_t *b = malloc(sizeof(yc_buf_t) + len);
+  if (!b) {
+    perror("malloc");
+    exit(1);
+  }
+  b->ycb_refcnt = 1;
+  b->ycb_fd     = -1;
+  b->ycb_from   = -1;
+  b->ycb_len    = len;
+  return b;
+}
+
+yc_buf_t *yc_buf_file(int fd, size_t len) {
+  yc_buf_t *b = yc_buf_new(0);
+  b->ycb_fd  = fd;
+  b->ycb_len = len;
+  return b;
+}
+
+void yc_buf_free(yc_buf_t *b) {
+  if (b->ycb_fd >= 0)
+    close(b->ycb_fd);
+  free(b);
+}
+
+
+/* the last ycc_gen handed out */
+static uint32_t yc_conn_gen;
+
+yc_conn_t *yc_conn_open(int fd, const struct sockaddr_in *sin) {
+  if (fd >= yc_max_fds) {
+    yc_log(YC_LOG_ERROR, "[%d] too many connections, dropping", fd);
+    close(fd);
+    return NULL;
+  }
+
+  /* hello */
+  yc_log(YC_LOG_CONNECT, "[%d] connect from %s:%d", fd, inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+
+  /* remember our new connection. in a real server, you'd maybe send them a
+   * greeting, begin authentication, etc */
+  yc_conn_t *c = calloc(1, sizeof(yc_conn_t));
+  char *ibuf = malloc(YC_IBUF_SIZE);
+  if (!c || !ibuf) {
+    perror("malloc");
+    exit(1);
+  }
+  c->ycc_fd   = fd;
+  c->ycc_gen  = ++yc_conn_gen;
+  c->ycc_addr = *sin;
+  c->ycc_ibuf = ibuf;
+  c->ycc_icap = YC_IBUF_SIZE;
+  yc_rate_start(c);
+  c->ycc_heard = yc_now_ms();
+  yc_idle_arm(c);
+
+  /* turn off Nagle's algorithm. it holds back small writes until the
+   * previous one is acknowledged, which combined with the client's delayed
+   * ACKs can stall a chat message for 40ms or more. we already gather up
+   * everything we have for a connection into one writev() per loop, so
+   * there's nothing for Nagle to usefully do */
+  int onoff = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &onoff, sizeof(onoff));
+
+#ifdef TCP_NOTSENT_LOWAT
+  /* don't let the kernel take more than a little of what hasn't been sent
+   * yet. otherwise a client that's fallen behind has megabytes of stale
+   * chat sitting in its socket buffer, where we can't drop it or put
+   * anything in front of it, and it counts for nothing against oqmax. with
+   * this, writes stop (and the socket stops being writable) once that much
+   * is waiting, and the rest stays in the output queue */
+  if (yc_config.lowat > 0) {
+    int lowat = yc_config.lowat > INT_MAX ? INT_MAX : (int) yc_config.lowat;
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+  }
+#endif
+
+  yc_conns[fd] = c;
+  yc_active_add(c);
+
+  /* everyone starts off in the lobby */
+  yc_room_join(c, YC_ROOM_LOBBY, strlen(YC_ROOM_LOBBY));
+  yc_presence_join(c);
+
+  yc_stats.ycs_accepts++;
+
+  if (yc_trace_on) {
+    c->ycc_topen = yc_trace_now();
+    yc_trace_at(c->ycc_topen, YC_TRACE_CONNECT, fd, 0, 0);
+  }
+
+  return c;
+}
+
+yc_conn_t *yc_conn_accept(int server_fd) {
+  /* create storage for their address */
+  struct sockaddr_in sin;
+  socklen_t sinlen = sizeof(sin);
+
+  /* let them in! */
+  int fd = accept(server_fd, (struct sockaddr *) &sin, &sinlen);
+  if (fd < 0) {
+    /* EAGAIN just means there's nobody else waiting */
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      yc_log(YC_LOG_ERROR, "accept: %s", strerror(errno));
+    return NULL;
+  }
+
+  /* make them non-blocking. this is necessary, because a disconnect will
+   * cause a descriptor to become readable, but reading will block
+   * forever (because they're disconnected. non-blocking will cause
+   * read() to return 0 on a disconnected descriptor, so we can take the
+   * right action. it also means a write() to a slow client will return
+   * EAGAIN rather than holding everyone else up */
+  if (yc_set_nonblock(fd) < 0) {
+    yc_log(YC_LOG_ERROR, "ioctl(%d): %s", fd, strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  return yc_conn_open(fd, &sin);
+}
+
+void yc_conn_close(yc_conn_t *c) {
+  if (c->ycc_flags & YCC_CLOSING)
+    return;
+  c->ycc_flags |= YCC_CLOSING;
+
+  /* take them out of the active list and all their rooms, so nobody sends
+   * them anything else */
+  yc_active_remove(c);
+  yc_room_part_all(c);
+  yc_presence_quit(c);
+  yc_nick_release(c);
+  if (yc_search_on)
+    yc_search_cancel(c);
+  yc_timer_cancel(&c->ycc_rate_timer);
+  yc_timer_cancel(&c->ycc_idle_timer);
+
+  yc_stats.ycs_closes++;
+
+  if (yc_trace_on) {
+    uint64_t now = yc_trace_now();
+    yc_trace_at(now, YC_TRACE_CLOSE, c->ycc_fd, c->ycc_oq_bytes, now - c->ycc_topen);
+  }
+
+  yc_backend_close(c);
+}
+
+void yc_conn_free(yc_conn_t *c) {
+  /* the fd's gone, and might be reused straight away */
+  if (yc_conns[c->ycc_fd] == c)
+    yc_conns[c->ycc_fd] = NULL;
+
+  if (yc_nreap == yc_reap_cap) {
+    yc_reap_cap = yc_reap_cap ? yc_reap_cap * 2 : 64;
+    yc_reap = realloc(yc_reap, yc_reap_cap * sizeof(yc_conn_t *));
+    if (!yc_reap) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  yc_reap[yc_nreap++] = c;
+}
+
+static void yc_conn_release(yc_conn_t *c) {
+  /* yc_conn_close() stopped these, but something that was still running
+   * when it was closed might have started one again */
+  yc_timer_cancel(&c->ycc_rate_timer);
+  yc_timer_cancel(&c->ycc_idle_timer);
+
+  /* drop anything still waiting to go out */
+  for (unsigned i = 0; i < c->ycc_oq_len; i++) {
+    yc_qent_t *q = &c->ycc_oq[(c->ycc_oq_head + i) & (c->ycc_oq_cap-1)];
+    yc_flow_sub(q->ycq_buf, q->ycq_end - q->ycq_off);
+    yc_buf_unref(q->ycq_buf);
+  }
+  free(c->ycc_oq);
+
+  free(c->ycc_ibuf);
+
+  free(c);
+}
+
+
+struct iovec yc_conn_rbuf(yc_conn_t *c) {
+  /* no room left, so there's a partial line in here that's filled the
+   * buffer. make it bigger. yc_conn_received() makes sure it never gets
+   * full at max_line, so this always leaves some space */
+  if (c->ycc_ilen == c->ycc_icap) {
+    size_t cap = c->ycc_icap * 2;
+    if (cap > yc_config.max_line)
+      cap = yc_config.max_line;
+    char *ibuf = realloc(c->ycc_ibuf, cap);
+    if (!ibuf) {
+      perror("realloc");
+      exit(1);
+    }
+    c->ycc_ibuf = ibuf;
+    c->ycc_icap = cap;
+  }
+
+  return (struct iovec) {
+    .iov_base = c->ycc_ibuf + c->ycc_ilen,
+    .iov_len  = c->ycc_icap - c->ycc_ilen,
+  };
+}
+
+int yc_conn_read(yc_conn_t *c) {
+  int fd = c->ycc_fd;
+
+  yc_log(YC_LOG_DEBUG, "[%d] activity", fd);
+
+  struct iovec iov = yc_conn_rbuf(c);
+  ssize_t nread = read(fd, iov.iov_base, iov.iov_len);
+
+  /* see how much we read */
+  if (nread < 0) {
+    /* nothing there after all. this can happen if the readiness notification
+     * was stale; just go around again */
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return YC_IO_DONE;
+
+    /* less then zero is some error. disconnect them */
+    yc_log(YC_LOG_ERROR, "read(%d): %s", fd, strerror(errno));
+    yc_conn_close(c);
+    return YC_IO_CLOSED;
+  }
+
+  /* zero byes read */
+  if (nread == 0) {
+    /* so they gracefully disconnected and we should forget them */
+    yc_log(YC_LOG_CONNECT, "[%d] closed", fd);
+    yc_conn_close(c);
+    return YC_IO_CLOSED;
+  }
+
+  return yc_conn_received(c, nread);
+}
+
+/* fan-out. whatever arrived from a connection is copied once into a shared
+ * buffer, and described as a list of messages within it. then for each
+ * protocol that someone is using, we build a list of parts to send: a part
+ * is a slice of a shared buffer, so it might be the whole lot, or one
+ * message, or a header we've made up. every recipient of the same protocol
+ * gets the same parts, so what each one costs is a few queue entries
+ * pointing at bytes that were only written once */
+
+/* one message in a shared input buffer. for text, the payload is the line
+ * without its newline, which is at ycm_off+ycm_len. for binary, ycm_start
+ * is where the frame header starts */
+typedef struct {
+  size_t  ycm_start;
+  size_t  ycm_off;
+  size_t  ycm_len;
+  uint8_t ycm_type;
+} yc_msg_t;
+
+/* the messages from the current read, and the parts being sent for each
+ * protocol. they're reused every time, and grow as needed */
+static yc_msg_t  *yc_msgs;
+static int        yc_nmsgs, yc_msgs_cap;
+static yc_qent_t *yc_parts[YC_PROTO_NUM];
+static int        yc_nparts[YC_PROTO_NUM], yc_parts_cap[YC_PROTO_NUM];
+
+static void yc_msg_add(size_t start, size_t off, size_t len, uint8_t type) {
+  if (yc_nmsgs == yc_msgs_cap) {
+    yc_msgs_cap = yc_msgs_cap ? yc_msgs_cap * 2 : 64;
+    yc_msgs = realloc(yc_msgs, yc_msgs_cap * sizeof(yc_msg_t));
+    if (!yc_msgs) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  yc_msgs[yc_nmsgs++] = (yc_msg_t) {
+    .ycm_start = start, .ycm_off = off, .ycm_len = len, .ycm_type = type,
+  };
+}
+
+static void yc_part_add(int proto, yc_buf_t *b, size_t off, size_t end) {
+  if (off == end)
+    return;
+
+  /* right after the last part of the same buffer? then just make that one
+   * bigger */
+  if (yc_nparts[proto] > 0) {
+    yc_qent_t *last = &yc_parts[proto][yc_nparts[proto]-1];
+    if (last->ycq_buf == b && last->ycq_end == off) {
+      last->ycq_end = end;
+      return;
+    }
+  }
+
+  if (yc_nparts[proto] == yc_parts_cap[proto]) {
+    yc_parts_cap[proto] = yc_parts_cap[proto] ? yc_parts_cap[proto] * 2 : 64;
+    yc_parts[proto] = realloc(yc_parts[proto], yc_parts_cap[proto] * sizeof(yc_qent_t));
+    if (!yc_parts[proto]) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  yc_parts[proto][yc_nparts[proto]++] = (yc_qent_t) {
+    .ycq_buf = b, .ycq_off = off, .ycq_end = end,
+  };
+}
+
+/* send the parts to everyone in the room except the sender, in whichever
+ * protocol they speak. we walk the member list backwards, because
+ * yc_conn_sendv() might disconnect someone, which takes them out of the
+ * room by swapping the last member into their slot. going backwards, that
+ * member has already been done */
+static void yc_broadcast(yc_conn_t *from, yc_room_t *room) {
+  for (int i = room->ycrm_nmembers-1; i >= 0; i--) {
+    yc_conn_t *dest = room->ycrm_members[i].ycrm_conn;
+    int proto = dest->ycc_proto;
+    if (dest != from && yc_nparts[proto])
+      yc_conn_sendv(dest, yc_parts[proto], yc_nparts[proto]);
+  }
+}
+
+
+/* binary frame headers */
+
+size_t yc_frame_hdr_put(char *p, size_t len, uint8_t type) {
+  size_t n = 0;
+  while (len >= 0x80) {
+    p[n++] = (char) (len | 0x80);
+    len >>= 7;
+  }
+  p[n++] = (char) len;
+  p[n++] = (char) type;
+  return n;
+}
+
+/* read a frame header from [p, end). returns the header size, 0 if the
+ * header isn't all there yet, or -1 if it's nonsense */
+static int yc_frame_hdr_get(const char *p, const char *end, size_t *len, uint8_t *type) {
+  size_t v = 0;
+  for (int n = 0; n < YC_FRAME_HDR_MAX-1; n++) {
+    if (p + n >= end)
+      return 0;
+    uint8_t c = p[n];
+    v |= (size_t) (c & 0x7f) << (7*n);
+    if (!(c & 0x80)) {
+      if (p + n+1 >= end)
+        return 0;
+      *len  = v;
+      *type = p[n+1];
+      return n+2;
+    }
+  }
+  return -1;
+}
+
+
+/* the sender prefix, if we're adding one, eg "[5] " or "<alice> " */
+static size_t yc_prefix_format(yc_conn_t *c, char *buf, size_t len) {
+  switch (yc_config.prefix) {
+    case YC_PREFIX_NICK:
+      if (c->ycc_nick)
+        return snprintf(buf, len, "<%s> ", c->ycc_nick->ycn_str);
+      /* no nickname, so their number will have to do. fall through */
+    case YC_PREFIX_FD:
+      return snprintf(buf, len, "[%d] ", c->ycc_fd);
+    default:
+      return 0;
+  }
+}
+
+/* send the messages in yc_msgs[], which are in src, to everyone else in the
+ * sender's room. src is all of what the messages came in, in the sender's
+ * protocol */
+static void yc_fanout(yc_conn_t *from, yc_buf_t *src) {
+  yc_room_t *room = from->ycc_room;
+  if (!room) {
+    yc_nmsgs = 0;
+    yc_conn_notice(from, "you're not in a room; /join one to talk");
+    return;
+  }
+
+  char prefix[64];
+  size_t plen = yc_prefix_format(from, prefix, sizeof(prefix));
+
+  /* any buffers we make along the way; we drop our references at the end */
+  yc_buf_t *pbuf = NULL, *tbuf = NULL, *hbuf = NULL;
+
+  /* text clients. the room's history, the message log and the search window
+   * are kept as text too, so it's needed for those even if there are none */
+  if (room->ycrm_nproto[YC_PROTO_TEXT] || yc_config.history > 0 || yc_store_on || yc_search_on) {
+    /* the prefix is the same every time, so it only needs to exist once */
+    if (plen) {
+      pbuf = yc_buf_from(yc_buf_new(plen), from);
+      memcpy(pbuf->ycb_data, prefix, plen);
+    }
+
+    yc_buf_t *text = src;
+    if (from->ycc_proto == YC_PROTO_BINARY) {
+      /* text frames have to be turned into lines. a newline in the middle
+       * of one would look like two messages, so those become spaces. the
+       * messages are pointed at the copy, ready for the parts below */
+      size_t len = 0;
+      for (int i = 0; i < yc_nmsgs; i++)
+        if (yc_msgs[i].ycm_type == YC_FRAME_TEXT)
+          len += yc_msgs[i].ycm_len + 1;
+      text = tbuf = yc_buf_from(yc_buf_new(len), from);
+    }
+
+    size_t toff = 0;
+    for (int i = 0; i < yc_nmsgs; i++) {
+      yc_msg_t *m = &yc_msgs[i];
+      if (m->ycm_type != YC_FRAME_TEXT)
+        continue;
+
+      size_t off = m->ycm_off;
+      if (tbuf) {
+        char *out = tbuf->ycb_data + toff;
+        memcpy(out, src->ycb_data + m->ycm_off, m->ycm_len);
+        for (char *nl = out; (nl = (char *) yc_scan_nl(nl, out + m->ycm_len)); )
+          *nl = ' ';
+        out[m->ycm_len] = '\n';
+        off = toff;
+        toff += m->ycm_len + 1;
+      }
+
+      if (pbuf)
+        yc_part_add(YC_PROTO_TEXT, pbuf, 0, plen);
+      yc_part_add(YC_PROTO_TEXT, text, off, off + m->ycm_len + 1);
+
+      yc_room_history_add(room, pbuf, text, off, m->ycm_len);
+      if (yc_store_on)
+        yc_store_append(pbuf, text->ycb_data + off, m->ycm_len + 1, room->ycrm_name->ycn_hash);
+      if (yc_search_on)
+        yc_search_add(room->ycrm_name->ycn_hash, pbuf, text->ycb_data + off, m->ycm_len);
+    }
+  }
+
+  /* binary clients */
+  if (room->ycrm_nproto[YC_PROTO_BINARY]) {
+    if (from->ycc_proto == YC_PROTO_BINARY && !plen) {
+      /* frames from a binary client, nothing added. they go on exactly as
+       * they came */
+      yc_part_add(YC_PROTO_BINARY, src, 0, src->ycb_len);
+    }
+    else {
+      /* every text message needs a frame header, with the prefix at the
+       * start of the payload. the headers are all different (they have the
+       * length in them), but they can all live in one buffer. the payload
+       * comes straight from the source */
+      hbuf = yc_buf_from(yc_buf_new(yc_nmsgs * (YC_FRAME_HDR_MAX + plen)), from);
+      size_t hoff = 0;
+      for (int i = 0; i < yc_nmsgs; i++) {
+        yc_msg_t *m = &yc_msgs[i];
+        if (m->ycm_type != YC_FRAME_TEXT) {
+          yc_part_add(YC_PROTO_BINARY, src, m->ycm_start, m->ycm_off + m->ycm_len);
+          continue;
+        }
+        size_t h = hoff;
+        hoff += yc_frame_hdr_put(hbuf->ycb_data + hoff, plen + m->ycm_len, YC_FRAME_TEXT);
+        memcpy(hbuf->ycb_data + hoff, prefix, plen);
+        hoff += plen;
+        yc_part_add(YC_PROTO_BINARY, hbuf, h, hoff);
+        yc_part_add(YC_PROTO_BINARY, src, m->ycm_off, m->ycm_off + m->ycm_len);
+      }
+    }
+  }
+
+  yc_broadcast(from, room);
+
+  for (int p = 0; p < YC_PROTO_NUM; p++)
+    yc_nparts[p] = 0;
+  yc_nmsgs = 0;
+
+  if (pbuf)
+    yc_buf_unref(pbuf);
+  if (tbuf)
+    yc_buf_unref(tbuf);
+  if (hbuf)
+    yc_buf_unref(hbuf);
+}
+
+
+/* send the messages collected so far. they're all in [start, end) */
+static void yc_flush_msgs(yc_conn_t *c, const char *start, const char *end) {
+  if (!yc_nmsgs)
+    return;
+
+  yc_stats.ycs_msgs_in += yc_nmsgs;
+
+  /* this is the only copy of what they sent */
+  yc_buf_t *b = yc_buf_from(yc_buf_new(end - start), c);
+  memcpy(b->ycb_data, start, end - start);
+  yc_fanout(c, b);
+  yc_buf_unref(b);
+}
+
+/* text input. pick out all the complete lines from [line, end); scan is
+ * where to start looking for newlines (everything before it has already
+ * been checked). returns the start of whatever partial line is left, or
+ * NULL if the connection was closed */
+static char *yc_text_received(yc_conn_t *c, char *line, const char *scan, char *end) {
+  /* if they went over the limit last time, we're still throwing away the
+   * rest of that line */
+  if (c->ycc_flags & YCC_SKIP) {
+    const char *nl = yc_scan_nl(scan, end);
+    if (!nl)
+      return end;
+    c->ycc_flags &= ~YCC_SKIP;
+    line = (char *) nl + 1;
+    scan = line;
+  }
+
+  /* they're all from the same sender and all going to the same place, so
+   * rather than a buffer for each one, they go out together in one.
+   * everyone still sees whole lines, in order, but a burst of lines costs
+   * about the same to fan out as a single one. a command might change where
+   * they go though, so everything before it is sent first */
+  char *lines = line;
+  const char *nl;
+  while ((nl = yc_scan_nl(scan, end))) {
+    /* one byte tells chat from commands. chat is by far the common case,
+     * so tell the compiler, and it'll keep that path straight */
+    yc_rate_nmsgs++;
+    if (__builtin_expect(*line == '/', 0)) {
+      yc_flush_msgs(c, lines, line);
+      if (c->ycc_flags & YCC_CLOSING)
+        return NULL;
+      yc_log(YC_LOG_MESSAGE, "[%d] command: %.*s", c->ycc_fd, (int) (nl - line), line);
+      yc_cmd_exec(c, line, nl - line);
+      if (c->ycc_flags & YCC_CLOSING)
+        return NULL;
+      lines = (char *) nl + 1;
+    }
+    else {
+      yc_log(YC_LOG_MESSAGE, "[%d] read: %.*s", c->ycc_fd, (int) (nl - line), line);
+      yc_msg_add(line - lines, line - lines, nl - line, YC_FRAME_TEXT);
+    }
+    line = (char *) nl + 1;
+    scan = line;
+  }
+  yc_flush_msgs(c, lines, line);
+
+  /* if what's left has filled the buffer at its biggest, it's too long.
+   * drop it, and the rest of it as it arrives */
+  if (end - line == yc_config.max_line) {
+    yc_log(YC_LOG_ERROR, "[%d] line longer than %zu bytes, dropping it", c->ycc_fd, yc_config.max_line);
+    yc_stats.ycs_overlong++;
+    c->ycc_flags |= YCC_SKIP;
+    return end;
+  }
+
+  return line;
+}
+
+/* binary input. pick out all the complete frames from [frame, end). returns
+ * the start of whatever partial frame is left, or NULL if the connection
+ * was closed */
+static char *yc_binary_received(yc_conn_t *c, char *frame, char *end) {
+  /* like lines, all the frames go out together. all we need to know is
+   * where each one is */
+  char *frames = frame;
+  for (;;) {
+    size_t len;
+    uint8_t type;
+    int hdr = yc_frame_hdr_get(frame, end, &len, &type);
+    if (hdr == 0)
+      break;
+    if (hdr < 0 || hdr + len > yc_config.max_line) {
+      /* there's no newline to skip to, so once the framing goes wrong we
+       * can't find our way back. all we can do is hang up */
+      yc_log(YC_LOG_ERROR, "[%d] bad or oversized frame, disconnecting", c->ycc_fd);
+      yc_stats.ycs_overlong++;
+      yc_nmsgs = 0;
+      yc_conn_close(c);
+      return NULL;
+    }
+    if (end - frame < hdr + len)
+      break;
+
+    char *payload = frame + hdr;
+    yc_rate_nmsgs++;
+    if (__builtin_expect(type == YC_FRAME_TEXT && len > 0 && *payload == '/', 0)) {
+      yc_flush_msgs(c, frames, frame);
+      if (c->ycc_flags & YCC_CLOSING)
+        return NULL;
+      yc_log(YC_LOG_MESSAGE, "[%d] command: %.*s", c->ycc_fd, (int) len, payload);
+      yc_cmd_exec(c, payload, len);
+      if (c->ycc_flags & YCC_CLOSING)
+        return NULL;
+      frames = payload + len;
+    }
+    else {
+      if (type == YC_FRAME_TEXT)
+        yc_log(YC_LOG_MESSAGE, "[%d] read: %.*s", c->ycc_fd, (int) len, payload);
+      else
+        yc_log(YC_LOG_DEBUG, "[%d] frame type %u, %zu bytes", c->ycc_fd, type, len);
+      yc_msg_add(frame - frames, payload - frames, len, type);
+    }
+
+    frame = payload + len;
+  }
+  yc_flush_msgs(c, frames, frame);
+
+  return frame;
+}
+
+int yc_conn_received(yc_conn_t *c, size_t nread) {
+  uint64_t tstart = yc_trace_on ? yc_trace_now() : 0;
+
+  yc_stats.ycs_reads++;
+  yc_stats.ycs_bytes_in += nread;
+
+  /* they're still there. the idle timer will see this when it goes off */
+  c->ycc_heard = yc_now_ms();
+
+  char *buf = c->ycc_ibuf;
+  char *end = buf + c->ycc_ilen + nread;
+
+  /* everything before the new data was checked last time, so we only need
+   * to look at what just arrived */
+  char *scan = buf + c->ycc_ilen;
+  char *start = buf;
+
+  /* the very first byte says which protocol they want */
+  if (!(c->ycc_flags & YCC_HELLO)) {
+    c->ycc_flags |= YCC_HELLO;
+    if (*buf == YC_PROTO_HELLO_BINARY) {
+      yc_room_proto_changed(c, c->ycc_proto, YC_PROTO_BINARY);
+      c->ycc_proto = YC_PROTO_BINARY;
+      start = scan = buf+1;
+      yc_log(YC_LOG_CONNECT, "[%d] using binary protocol", c->ycc_fd);
+    }
+
+    /* the history they missed. if it's more than they can take, they're
+     * gone already */
+    yc_room_hello(c);
+    if (c->ycc_flags & YCC_CLOSING)
+      return YC_IO_CLOSED;
+  }
+
+  yc_rate_nmsgs = 0;
+  char *left = c->ycc_proto == YC_PROTO_BINARY ?
+    yc_binary_received(c, start, end) :
+    yc_text_received(c, start, scan, end);
+  if (!left)
+    return YC_IO_CLOSED;
+
+  if (yc_config.rate_msgs || yc_config.rate_bytes)
+    yc_rate_charge(c, yc_rate_nmsgs, nread);
+
+  /* keep whatever's left, the start of a line (or frame) we haven't seen
+   * the end of, at the front of the buffer for next time */
+  c->ycc_ilen = end - left;
+  if (c->ycc_ilen > 0 && left > buf)
+    memmove(buf, left, c->ycc_ilen);
+
+  /* if a long line made the buffer grow, shrink it back once it's empty, so
+   * one big message doesn't cost memory for the rest of the connection */
+  if (c->ycc_ilen == 0 && c->ycc_icap > YC_IBUF_SIZE) {
+    char *ibuf = realloc(c->ycc_ibuf, YC_IBUF_SIZE);
+    if (ibuf) {
+      c->ycc_ibuf = ibuf;
+      c->ycc_icap = YC_IBUF_SIZE;
+    }
+  }
+
+  if (yc_trace_on) {
+    uint64_t now = yc_trace_now();
+    yc_trace_at(now, YC_TRACE_READ, c->ycc_fd, nread, now - tstart);
+  }
+
+  return (c->ycc_flags & YCC_CLOSING) ? YC_IO_CLOSED : YC_IO_DONE;
+}
+
+
+void yc_conn_send(yc_conn_t *c, yc_buf_t *b) {
+  yc_qent_t part = { .ycq_buf = b, .ycq_off = 0, .ycq_end = b->ycb_len };
+  yc_conn_sendv(c, &part, 1);
+}
+
+size_t yc_conn_oq_room(yc_conn_t *c) {
+  size_t used = c->ycc_oq_bytes - c->ycc_oq_fbytes;
+  return used < yc_config.oq_max ? yc_config.oq_max - used : 0;
+}
+
+static inline yc_qent_t *yc_conn_oq_at(yc_conn_t *c, unsigned i) {
+  return &c->ycc_oq[(c->ycc_oq_head + i) & (c->ycc_oq_cap-1)];
+}
+
+/* would another message, with mem bytes in memory, put them over? what's
+ * waiting in files doesn't count, since it's not using any */
+static int yc_conn_oq_over(yc_conn_t *c, size_t mem) {
+  return (c->ycc_oq_bytes - c->ycc_oq_fbytes) + mem > yc_config.oq_max ||
+         (yc_config.oq_msgs && c->ycc_oq_msgs + 1 > (unsigned) yc_config.oq_msgs);
+}
+
+/* make room for a message with mem bytes in memory by dropping the oldest
+ * whole messages. the first one might be partly sent already, and the
+ * backend might be writing from the ones after it, so those are left be.
+ * returns 0, having dropped nothing, if that wouldn't make enough room */
+static int yc_conn_drop_oldest(yc_conn_t *c, size_t mem) {
+  unsigned from = 0;
+  for (unsigned i = 0; i < c->ycc_oq_len; i++) {
+    if (yc_conn_oq_at(c, i)->ycq_last && (from = i+1) >= c->ycc_oq_busy)
+      break;
+  }
+
+  size_t   qmem = c->ycc_oq_bytes - c->ycc_oq_fbytes;
+  size_t   dmem = 0, dfile = 0;
+  unsigned dmsgs = 0, to = from;
+  while (qmem - dmem + mem > yc_config.oq_max ||
+         (yc_config.oq_msgs && c->ycc_oq_msgs - dmsgs + 1 > (unsigned) yc_config.oq_msgs)) {
+    if (to == c->ycc_oq_len)
+      return 0;
+    yc_qent_t *q;
+    do {
+      q = yc_conn_oq_at(c, to++);
+      if (q->ycq_buf->ycb_fd >= 0)
+        dfile += q->ycq_end - q->ycq_off;
+      else
+        dmem  += q->ycq_end - q->ycq_off;
+    } while (!q->ycq_last);
+    dmsgs++;
+  }
+
+  /* let go of them, and close the gap */
+  for (unsigned i = from; i < to; i++) {
+    yc_qent_t *q = yc_conn_oq_at(c, i);
+    yc_flow_sub(q->ycq_buf, q->ycq_end - q->ycq_off);
+    yc_buf_unref(q->ycq_buf);
+  }
+  for (unsigned i = to; i < c->ycc_oq_len; i++)
+    *yc_conn_oq_at(c, i - (to - from)) = *yc_conn_oq_at(c, i);
+  c->ycc_oq_len    -= to - from;
+  c->ycc_oq_bytes  -= dmem + dfile;
+  c->ycc_oq_fbytes -= dfile;
+  c->ycc_oq_msgs   -= dmsgs;
+
+  c->ycc_oq_lost += dmsgs;
+  yc_stats.ycs_oq_dropped += dmsgs;
+  return 1;
+}
+
+/* a connection isn't keeping up: it's got too much waiting to take another
+ * message with mem bytes in memory. do what the policy says. returns 1 if
+ * there's room for it now */
+static int yc_conn_slow(yc_conn_t *c, size_t mem) {
+  switch (yc_config.oq_policy) {
+    case YC_OQ_DROP:
+      if (yc_conn_drop_oldest(c, mem))
+        return 1;
+      c->ycc_oq_lost++;
+      yc_stats.ycs_oq_dropped++;
+      return 0;
+
+    /* nothing else is queued for them until they get their digest. anything
+     * after what's committed to the log might be what they missed */
+    case YC_OQ_DIGEST:
+      c->ycc_flags   |= YCC_DIGEST;
+      c->ycc_oq_lost  = 1;
+      c->ycc_oq_since = yc_store_on ? yc_store_committed() : 0;
+      yc_stats.ycs_oq_missed++;
+      yc_digest_add(c);
+      return 0;
+  }
+
+  /* we'd just use more and more memory on them, so let them go */
+  yc_log(YC_LOG_ERROR, "[%d] output queue full, disconnecting", c->ycc_fd);
+  yc_trace(YC_TRACE_OQFULL, c->ycc_fd, c->ycc_oq_bytes, 0);
+  yc_stats.ycs_oq_full++;
+  yc_conn_close(c);
+  return 0;
+}
+
+void yc_conn_sendv(yc_conn_t *c, const yc_qent_t *parts, int nparts) {
+  if (c->ycc_flags & YCC_CLOSING)
+    return;
+
+  /* they're getting a digest instead */
+  if (c->ycc_flags & YCC_DIGEST) {
+    c->ycc_oq_lost++;
+    yc_stats.ycs_oq_missed++;
+    return;
+  }
+
+  size_t len = 0, flen = 0;
+  for (int i = 0; i < nparts; i++) {
+    len += parts[i].ycq_end - parts[i].ycq_off;
+    if (parts[i].ycq_buf->ycb_fd >= 0)
+      flen += parts[i].ycq_end - parts[i].ycq_off;
+  }
+
+  /* if they've got too much waiting already, they're not keeping up */
+  if (yc_conn_oq_over(c, len - flen) && !yc_conn_slow(c, len - flen))
+    return;
+
+  /* grow the ring if there's not enough room. it's always a power of two,
+   * so we can wrap with a mask instead of a divide */
+  if (c->ycc_oq_len + nparts > c->ycc_oq_cap) {
+    unsigned cap = c->ycc_oq_cap ? c->ycc_oq_cap : 8;
+    while (cap < c->ycc_oq_len + nparts)
+      cap *= 2;
+    yc_qent_t *oq = malloc(cap * sizeof(yc_qent_t));
+    if (!oq) {
+      perror("malloc");
+      exit(1);
+    }
+    for (unsigned i = 0; i < c->ycc_oq_len; i++)
+      oq[i] = c->ycc_oq[(c->ycc_oq_head + i) & (c->ycc_oq_cap-1)];
+    free(c->ycc_oq);
+    c->ycc_oq      = oq;
+    c->ycc_oq_cap  = cap;
+    c->ycc_oq_head = 0;
+  }
+
+  if (yc_trace_on && c->ycc_oq_len == 0)
+    c->ycc_tqueued = yc_trace_now();
+
+  for (int i = 0; i < nparts; i++) {
+    yc_qent_t *q = yc_conn_oq_at(c, c->ycc_oq_len);
+    *q = parts[i];
+    q->ycq_last = i == nparts-1;
+    yc_buf_ref(q->ycq_buf);
+    yc_flow_add(q->ycq_buf, q->ycq_end - q->ycq_off);
+    c->ycc_oq_len++;
+  }
+  c->ycc_oq_bytes  += len;
+  c->ycc_oq_fbytes += flen;
+  c->ycc_oq_msgs++;
+
+  yc_stats.ycs_msgs_out++;
+
+  yc_conn_dirty(c);
+}
+
+/* format a single message for one connection, and send it */
+static void yc_conn_vprintf(yc_conn_t *c, const char *mark, const char *fmt, va_list ap) {
+  va_list aq;
+  va_copy(aq, ap);
+  int len = vsnprintf(NULL, 0, fmt, aq);
+  va_end(aq);
+  if (len < 0)
+    return;
+
+  size_t mlen = strlen(mark);
+  yc_buf_t *b = yc_buf_new(YC_FRAME_HDR_MAX + mlen + len + 1);
+  char *out = b->ycb_data;
+  if (c->ycc_proto == YC_PROTO_BINARY)
+    out += yc_frame_hdr_put(out, mlen + len, YC_FRAME_TEXT);
+  memcpy(out, mark, mlen);
+  out += mlen;
+
+  /* room for vsnprintf()'s \0, which the newline (or nothing) replaces */
+  vsnprintf(out, len+1, fmt, ap);
+
+  /* a newline in the middle would make it look like two lines, so those
+   * become spaces */
+  if (c->ycc_proto == YC_PROTO_TEXT) {
+    for (char *nl = out; (nl = (char *) yc_scan_nl(nl, out + len)); )
+      *nl = ' ';
+    out[len++] = '\n';
+  }
+  out += len;
+  b->ycb_len = out - b->ycb_data;
+
+  yc_conn_send(c, b);
+  yc_buf_unref(b);
+}
+
+/* going backwards for the same reason as yc_broadcast() */
+void yc_conn_send_all(yc_buf_t *line) {
+  yc_buf_t *hdr = NULL;
+  for (int i = yc_nactive-1; i >= 0; i--) {
+    yc_conn_t *c = yc_active[i];
+
+    /* they haven't said which protocol they want yet. they've only just
+     * arrived, so there's nothing they'd have wanted to hear anyway */
+    if (!(c->ycc_flags & YCC_HELLO))
+      continue;
+
+    if (c->ycc_proto == YC_PROTO_TEXT) {
+      yc_conn_send(c, line);
+      continue;
+    }
+
+    /* binary clients get a frame header, then the line without its newline */
+    if (!hdr) {
+      hdr = yc_buf_new(YC_FRAME_HDR_MAX);
+      hdr->ycb_len = yc_frame_hdr_put(hdr->ycb_data, line->ycb_len - 1, YC_FRAME_TEXT);
+    }
+    yc_qent_t parts[2] = {
+      { .ycq_buf = hdr,  .ycq_off = 0, .ycq_end = hdr->ycb_len },
+      { .ycq_buf = line, .ycq_off = 0, .ycq_end = line->ycb_len - 1 },
+    };
+    yc_conn_sendv(c, parts, 2);
+  }
+  if (hdr)
+    yc_buf_unref(hdr);
+}
+
+void yc_conn_printf(yc_conn_t *c, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  yc_conn_vprintf(c, "", fmt, ap);
+  va_end(ap);
+}
+
+void yc_conn_notice(yc_conn_t *c, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  yc_conn_vprintf(c, "* ", fmt, ap);
+  va_end(ap);
+}
+
+int yc_conn_wbuf(yc_conn_t *c, struct iovec *iov, int max) {
+  int n = 0;
+  for (unsigned i = 0; i < c->ycc_oq_len && n < max; i++) {
+    yc_qent_t *q = &c->ycc_oq[(c->ycc_oq_head + i) & (c->ycc_oq_cap-1)];
+    if (q->ycq_buf->ycb_fd >= 0)
+      break;
+    iov[n].iov_base = q->ycq_buf->ycb_data + q->ycq_off;
+    iov[n].iov_len  = q->ycq_end - q->ycq_off;
+    n++;
+  }
+  c->ycc_oq_busy = n;
+  return n;
+}
+
+void yc_conn_sent(yc_conn_t *c, size_t nwritten) {
+  yc_stats.ycs_writes++;
+  yc_stats.ycs_bytes_out += nwritten;
+
+  /* the queue time is for the oldest thing sent. if some is left over, the
+   * clock starts again for it, which undercounts a little but saves keeping
+   * a timestamp on every queue entry */
+  if (yc_trace_on) {
+    uint64_t now = yc_trace_now();
+    yc_trace_at(now, YC_TRACE_WRITE, c->ycc_fd, nwritten, now - c->ycc_tqueued);
+    c->ycc_tqueued = now;
+  }
+
+  c->ycc_oq_bytes -= nwritten;
+
+  /* pop everything that went out completely, and note how far we got into
+   * the one that didn't */
+  while (nwritten > 0) {
+    yc_qent_t *q = &c->ycc_oq[c->ycc_oq_head];
+    size_t left = q->ycq_end - q->ycq_off;
+    if (nwritten < left) {
+      q->ycq_off += nwritten;
+      if (q->ycq_buf->ycb_fd >= 0)
+        c->ycc_oq_fbytes -= nwritten;
+      yc_flow_sub(q->ycq_buf, nwritten);
+      break;
+    }
+    nwritten -= left;
+    yc_flow_sub(q->ycq_buf, left);
+    if (q->ycq_buf->ycb_fd >= 0)
+      c->ycc_oq_fbytes -= left;
+    if (q->ycq_last)
+      c->ycc_oq_msgs--;
+    yc_buf_unref(q->ycq_buf);
+    c->ycc_oq_head = (c->ycc_oq_head + 1) & (c->ycc_oq_cap-1);
+    c->ycc_oq_len--;
+  }
+  c->ycc_oq_busy = 0;
+
+  /* if some of their messages were dropped, tell them once they've caught
+   * up. (with a digest, that's what the digest is for) */
+  if (!c->ycc_oq_len && c->ycc_oq_lost && !(c->ycc_flags & YCC_DIGEST)) {
+    c->ycc_oq_lost = 0;
+    yc_conn_notice(c, "you weren't keeping up, so some messages to you were dropped");
+  }
+}
+
+int yc_conn_wfile(yc_conn_t *c, int *fd, off_t *off, size_t *len) {
+  if (!c->ycc_oq_len)
+    return 0;
+  yc_qent_t *q = &c->ycc_oq[c->ycc_oq_head];
+  if (q->ycq_buf->ycb_fd < 0)
+    return 0;
+  *fd  = q->ycq_buf->ycb_fd;
+  *off = q->ycq_off;
+  *len = q->ycq_end - q->ycq_off;
+  c->ycc_oq_busy = 1;
+  return 1;
+}
+
+/* send some of a file range. sendfile() has the kernel copy straight from
+ * the page cache to the socket. elsewhere, it's done the long way round. if
+ * the file's shorter than we thought, something's badly wrong, so that's an
+ * error */
+static ssize_t yc_conn_sendfile(yc_conn_t *c, int fd, off_t off, size_t len) {
+#ifdef __linux__
+  ssize_t n = sendfile(c->ycc_fd, fd, &off, len);
+#else
+  char buf[16384];
+  ssize_t n = pread(fd, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+  if (n > 0)
+    n = write(c->ycc_fd, buf, n);
+#endif
+  if (n == 0) {
+    errno = EIO;
+    return -1;
+  }
+  return n;
+}
+
+int yc_conn_write(yc_conn_t *c) {
+  while (c->ycc_oq_len > 0) {
+    struct iovec iov[YC_IOV_MAX];
+    int fd;
+    off_t off;
+    size_t len;
+
+    ssize_t nwritten;
+    if (yc_conn_wfile(c, &fd, &off, &len))
+      nwritten = yc_conn_sendfile(c, fd, off, len);
+    else
+      nwritten = writev(c->ycc_fd, iov, yc_conn_wbuf(c, iov, YC_IOV_MAX));
+    if (nwritten < 0) {
+      if (errno == EINTR)
+        continue;
+
+      /* socket buffer is full; the backend will let us know when there's
+       * room again. nothing's being written from the queue till then */
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        c->ycc_oq_busy = 0;
+        yc_stats.ycs_oq_blocked++;
+        return YC_IO_AGAIN;
+      }
+
+      /* disconnect if it fails; they might have legitimately gone away without telling us */
+      yc_log(YC_LOG_ERROR, "write(%d): %s", c->ycc_fd, strerror(errno));
+      yc_conn_close(c);
+      return YC_IO_CLOSED;
+    }
+
+    yc_conn_sent(c, nwritten);
+  }
+
+  return YC_IO_DONE;
+}
+
+void yc_conn_writable(yc_conn_t *c) {
+  /* in strict mode, anything queued since the last tick might not be on disk
+   * yet. the tick syncs it, then flushes everything that's dirty */
+  if (yc_store_on && yc_config.store_strict)
+    yc_conn_dirty(c);
+  else
+    yc_backend_flush(c);
+}
@@ -0,0 +1,411 @@
+/* yc_core - the shared parts of every yoctochat server */
+
+/* Every yoctochat server used to carry its own copy of the socket setup, the
+ * connection table and the fan-out loop. That's lovely when you're reading
+ * one file to learn one IO technique, but it means every improvement had to
+ * be made five times. So the boring-but-important parts live here now, and
+ * each yc_*.c file is left with the one thing it exists to demonstrate: how
+ * to find out that something happened on a descriptor.
+ *
+ * The split works like this:
+ *
+ *   - the core owns connections, their input buffers and output queues, and
+ *     decides what to do with the bytes that come in (today: send them to
+ *     everyone else)
+ *
+ *   - the backend owns the event loop. It tells the core when a connection
+ *     arrives, when data arrived, and when a connection can be written to
+ *
+ *   - the core calls back into the backend through a small set of
+ *     yc_backend_*() functions (declared at the bottom of this file). Each
+ *     server defines them, and the linker wires them up. There are no
+ *     function pointers, so the compiler and CPU see plain direct calls on
+ *     the hot path.
+ */
+
+#ifndef YC_CORE_H
+#define YC_CORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "yc_timer.h"
+
+/* max number of buffers we'll hand to a single writev(). the real limit
+ * (IOV_MAX) is usually 1024, but there's not much to gain from going that
+ * big and it makes the on-stack iovec arrays large */
+#define YC_IOV_MAX (64)
+
+/* starting size of each connection's input buffer. it grows (up to the
+ * maxline option) if a line doesn't fit */
+#define YC_IBUF_SIZE (1024)
+
+
+/* wire protocols. a client picks one with the very first byte it sends: a
+ * zero byte means binary frames, anything else is the start of the first
+ * line of text. until then, a connection is sent text.
+ *
+ * text is lines ending in '\n'.
+ *
+ * binary is a series of frames, each:
+ *
+ *   length   varint (7 bits per byte, low bits first, top bit set on all
+ *            but the last byte): the size of the payload
+ *   type     one byte
+ *   payload  length bytes
+ *
+ * frames of type YC_FRAME_TEXT are chat messages, and are turned into lines
+ * for text clients (and lines into frames for binary clients). any other
+ * type is passed on untouched, to binary clients only. a frame (header and
+ * all) has the same size limit as a line of text.
+ *
+ * the server sends one frame type of its own: YC_FRAME_LOG, a run of lines
+ * from the message log (see /catchup in yc_cmd.h), exactly as a text client
+ * would get them. those can be any size */
+#define YC_PROTO_TEXT   (0)
+#define YC_PROTO_BINARY (1)
+#define YC_PROTO_NUM    (2)
+
+#define YC_PROTO_HELLO_BINARY (0x00)
+
+#define YC_FRAME_TEXT    (0)
+#define YC_FRAME_LOG     (1)
+#define YC_FRAME_HDR_MAX (6)    /* 5 bytes of varint, plus type */
+
+
+/* a refcounted chunk of bytes. a message that is sent to a thousand
+ * connections is stored once, and each output queue holds a reference to it.
+ * the last one out frees it.
+ *
+ * the bytes can also be in a file instead, if ycb_fd isn't -1. then the
+ * buffer has no data of its own, and output queue entries are ranges of the
+ * file. they're sent with sendfile() (or the like), so they never pass
+ * through our memory at all.
+ *
+ * a buffer made for someone's messages remembers who they were, so that
+ * everything queued from it counts against them (see yc_flow_* in
+ * yc_core.c) */
+typedef struct {
+  int      ycb_refcnt;
+  int      ycb_fd;
+  int      ycb_from;    /* connection whose message this is, or -1 */
+  uint32_t ycb_gen;     /* (and its ycc_gen, in case the fd's been reused) */
+  size_t   ycb_len;
+  char     ycb_data[];
+} yc_buf_t;
+
+/* one entry in an output queue: part of a buffer, [ycq_off, ycq_end). as
+ * it's sent, ycq_off moves along. an entry doesn't have to cover the whole
+ * buffer, so several connections can share one buffer and each send a
+ * different part of it. a message can be several entries; the queue marks
+ * its last one, so a whole message can be dropped */
+typedef struct {
+  yc_buf_t *ycq_buf;
+  size_t    ycq_off;
+  size_t    ycq_end;
+  int       ycq_last;
+} yc_qent_t;
+
+/* connection flags */
+#define YCC_DIRTY   (1<<0)  /* has unsent output, and is on the flush list */
+#define YCC_CLOSING (1<<1)  /* on the way out; don't send it anything else */
+#define YCC_SKIP    (1<<2)  /* sent an overlong line; ignore input until the next newline */
+#define YCC_HELLO   (1<<3)  /* first byte seen, protocol decided */
+#define YCC_DIGEST  (1<<4)  /* fell behind; nothing's queued until they get a digest */
+#define YCC_FLOW      (1<<5)  /* sent more than everyone's taken; on the flow list */
+#define YCC_FLOWSTOP  (1<<6)  /* so flow control has paused them */
+#define YCC_THROTTLED (1<<7)  /* over their rate limit; paused until a timer says */
+#define YCC_PAUSED    (1<<8)  /* paused for either reason; we're not reading from them */
+
+struct yc_room;
+struct yc_membership;
+struct yc_name;
+
+/* a connection. the core keeps one of these for every connected client,
+ * indexed by file descriptor */
+typedef struct {
+  int                ycc_fd;
+  unsigned           ycc_flags;
+
+  /* different for every connection there's ever been, so something that
+   * outlives a connection can tell it from the next one on the same fd */
+  uint32_t           ycc_gen;
+
+  /* YC_PROTO_TEXT or YC_PROTO_BINARY */
+  int                ycc_proto;
+
+  /* where they connected from */
+  struct sockaddr_in ycc_addr;
+
+  /* position in the dense list of active connections; see yc_core.c */
+  int                ycc_active;
+
+  /* the room their lines go to, and all the rooms they're in. see
+   * yc_room.h */
+  struct yc_room       *ycc_room;
+  struct yc_membership *ycc_rooms;
+  int                   ycc_nrooms;
+  int                   ycc_rooms_cap;
+
+  /* their nickname, or NULL if they haven't picked one. see yc_nick.h */
+  struct yc_name       *ycc_nick;
+
+  /* input buffer. the backend reads into the free space at the end of it
+   * (see yc_conn_rbuf()) and then tells us how much arrived. between reads
+   * it holds the start of a line whose end hasn't arrived yet */
+  char              *ycc_ibuf;
+  size_t             ycc_ilen;
+  size_t             ycc_icap;
+
+  /* output queue. a ring of buffer references, oldest first */
+  yc_qent_t         *ycc_oq;
+  unsigned           ycc_oq_head;
+  unsigned           ycc_oq_len;
+  unsigned           ycc_oq_cap;
+  size_t             ycc_oq_bytes;
+  size_t             ycc_oq_fbytes;   /* how much of that is in files */
+  unsigned           ycc_oq_msgs;
+
+  /* entries at the front the backend is writing from. nothing from there
+   * on is dropped */
+  unsigned           ycc_oq_busy;
+
+  /* messages they didn't get because they weren't keeping up, that they
+   * haven't been told about yet. for a digest, where to /catchup from */
+  uint64_t           ycc_oq_lost;
+  uint64_t           ycc_oq_since;
+
+  /* bytes of their messages waiting in everyone's output queues, and when
+   * we stopped reading from them because of it (monotonic ms) */
+  size_t             ycc_flow;
+  uint64_t           ycc_flow_paused;
+
+  /* rate limit token buckets, in thousandths of a message or byte, when
+   * they were last topped up (monotonic ms), and the timer that wakes them
+   * when they're throttled */
+  int64_t            ycc_rate_msgs;
+  int64_t            ycc_rate_bytes;
+  uint64_t           ycc_rate_last;
+  yc_timer_t         ycc_rate_timer;
+
+  /* when we last heard from them, and last pinged them (monotonic ms), and
+   * the timer that checks on them */
+  uint64_t           ycc_heard;
+  uint64_t           ycc_pinged;
+  yc_timer_t         ycc_idle_timer;
+
+  /* when they connected, and when the oldest output still queued was
+   * queued. only kept up to date while tracing (see yc_trace.h) */
+  uint64_t           ycc_topen;
+  uint64_t           ycc_tqueued;
+
+  /* backend-private state. the core never looks at these */
+  unsigned           ycc_bflags;
+  void              *ycc_bdata;
+} yc_conn_t;
+
+/* counters for everything interesting. dumped to stdout on SIGUSR1 */
+typedef struct {
+  uint64_t ycs_accepts;
+  uint64_t ycs_closes;
+  uint64_t ycs_reads;
+  uint64_t ycs_bytes_in;
+  uint64_t ycs_msgs_in;
+  uint64_t ycs_msgs_out;
+  uint64_t ycs_writes;
+  uint64_t ycs_bytes_out;
+  uint64_t ycs_overlong;
+  uint64_t ycs_oq_dropped;      /* messages dropped for slow connections */
+  uint64_t ycs_oq_missed;       /* or left for a digest */
+  uint64_t ycs_oq_digests;
+  uint64_t ycs_oq_full;         /* slow connections disconnected */
+  uint64_t ycs_oq_blocked;      /* times a socket was full and writing waited */
+  uint64_t ycs_flow_paused;     /* times we stopped reading from a sender */
+  uint64_t ycs_rate_throttled;  /* times someone went over their rate limit */
+  uint64_t ycs_pings;
+  uint64_t ycs_idle_closes;     /* disconnected for saying nothing */
+} yc_stats_t;
+
+extern yc_stats_t yc_stats;
+
+
+/* connection table, indexed by fd. use yc_conn_get() rather than poking at
+ * this directly */
+extern yc_conn_t **yc_conns;
+extern int         yc_max_fds;
+
+/* result codes for the IO helpers */
+#define YC_IO_DONE   (0)    /* did everything there was to do */
+#define YC_IO_AGAIN  (1)    /* would block; try again when it's ready */
+#define YC_IO_CLOSED (-1)   /* connection was closed; don't touch it again */
+
+
+/* parse the commandline, set up the connection table and open the listening
+ * socket. max_fds is the highest file descriptor the backend can cope with
+ * (eg FD_SETSIZE for select()), or 0 if it doesn't care. returns the server
+ * socket; exits the program if anything goes wrong */
+int yc_core_init(int argc, char **argv, int max_fds);
+
+/* call once per trip around the event loop, after handling events. sends
+ * anything that was queued for output during this iteration */
+void yc_core_tick(void);
+
+/* how long the backend can wait for events before yc_core_tick() has
+ * something to do on its own, in milliseconds, or -1 for as long as it
+ * likes. ask every time around the loop */
+int yc_core_timeout(void);
+
+/* make a descriptor non-blocking */
+int yc_set_nonblock(int fd);
+
+/* accept a new connection on a non-blocking server socket. returns the new
+ * connection, or NULL if there's nobody waiting (or accept failed) */
+yc_conn_t *yc_conn_accept(int server_fd);
+
+/* take ownership of a descriptor the backend accepted itself */
+yc_conn_t *yc_conn_open(int fd, const struct sockaddr_in *sin);
+
+/* read from a connection and process what arrived. returns YC_IO_CLOSED if
+ * the connection went away */
+int yc_conn_read(yc_conn_t *c);
+
+/* where to put incoming data, for backends that do their own reading */
+struct iovec yc_conn_rbuf(yc_conn_t *c);
+
+/* tell the core that nread bytes arrived in the space given by
+ * yc_conn_rbuf(). returns YC_IO_CLOSED if processing closed the connection */
+int yc_conn_received(yc_conn_t *c, size_t nread);
+
+/* write as much of the output queue as the socket will take. returns
+ * YC_IO_DONE when the queue is empty, YC_IO_AGAIN if there's more to go, or
+ * YC_IO_CLOSED if the write failed and the connection was closed */
+int yc_conn_write(yc_conn_t *c);
+
+/* fill an iovec array from the front of the output queue, for backends that
+ * do their own writing. stops at a file range. returns the number of iovecs
+ * used */
+int yc_conn_wbuf(yc_conn_t *c, struct iovec *iov, int max);
+
+/* if the front of the output queue is a file range, say where it is and
+ * return 1, for backends that do their own writing */
+int yc_conn_wfile(yc_conn_t *c, int *fd, off_t *off, size_t *len);
+
+/* tell the core that nwritten bytes from the front of the output queue were
+ * sent */
+void yc_conn_sent(yc_conn_t *c, size_t nwritten);
+
+/* the connection can take more output: it's writable again, or a write
+ * finished and there's more queued. backends call this rather than
+ * yc_backend_flush(), because with strict store syncing nothing that's been
+ * queued can go out until yc_core_tick() has synced the log. then it only
+ * marks the connection, and the tick flushes it once that's done */
+void yc_conn_writable(yc_conn_t *c);
+
+/* queue a buffer for sending. takes a new reference */
+void yc_conn_send(yc_conn_t *c, yc_buf_t *b);
+
+/* queue several buffer parts for sending, as one message. takes a new
+ * reference on each one */
+void yc_conn_sendv(yc_conn_t *c, const yc_qent_t *parts, int nparts);
+
+/* how many more bytes in memory can be queued for a connection before it
+ * counts as not keeping up (what's queued from files doesn't count) */
+size_t yc_conn_oq_room(yc_conn_t *c);
+
+/* send a line (ending in '\n') to every connection, as a frame for binary
+ * ones. connections that haven't sent their first byte yet are skipped,
+ * since we don't know which of those they want. takes new references */
+void yc_conn_send_all(yc_buf_t *line);
+
+/* send a message to one connection, in whatever protocol it speaks */
+void yc_conn_printf(yc_conn_t *c, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+/* same, but it's from the server, so it's marked as such. for text, it's a
+ * line starting with "* " */
+void yc_conn_notice(yc_conn_t *c, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+/* disconnect. the connection is removed from everything, then handed to
+ * yc_backend_close() to be torn down */
+void yc_conn_close(yc_conn_t *c);
+
+/* release everything the core holds for the connection. the backend calls
+ * this from (or after) yc_backend_close(), once it's sure there's nothing
+ * in flight that refers to the connection. it's gone from the connection
+ * table straight away, but the memory is kept until the end of
+ * yc_core_tick(), so whatever closed it can still look at it (and see
+ * YCC_CLOSING) on its way out */
+void yc_conn_free(yc_conn_t *c);
+
+/* allocate a buffer with room for len bytes. refcount starts at 1 */
+yc_buf_t *yc_buf_new(size_t len);
+
+/* make a buffer for the first len bytes of a file. takes the descriptor,
+ * and closes it when the buffer is freed */
+yc_buf_t *yc_buf_file(int fd, size_t len);
+
+/* write a binary frame header for a payload of len bytes into p, which must
+ * have room for YC_FRAME_HDR_MAX bytes. returns how many it used */
+size_t yc_frame_hdr_put(char *p, size_t len, uint8_t type);
+
+
+/* internal; used by the inline helpers below */
+void yc_buf_free(yc_buf_t *b);
+void yc_conn_dirty_slow(yc_conn_t *c);
+
+
+static inline yc_conn_t *yc_conn_get(int fd) {
+  return (fd >= 0 && fd < yc_max_fds) ? yc_conns[fd] : NULL;
+}
+
+static inline yc_buf_t *yc_buf_ref(yc_buf_t *b) {
+  b->ycb_refcnt++;
+  return b;
+}
+
+static inline void yc_buf_unref(yc_buf_t *b) {
+  if (--b->ycb_refcnt == 0)
+    yc_buf_free(b);
+}
+
+/* mark a connection as having output to send at the end of this iteration */
+static inline void yc_conn_dirty(yc_conn_t *c) {
+  if (!(c->ycc_flags & YCC_DIRTY))
+    yc_conn_dirty_slow(c);
+}
+
+
+/* the backend interface. every server defines these */
+
+/* the connection has output queued. readiness-based backends will usually
+ * just call yc_conn_write() and, if it returns YC_IO_AGAIN, ask to be told
+ * when the connection is writable. if it returns YC_IO_CLOSED, the write
+ * failed and the connection is gone; don't touch it again, and look it up
+ * by fd before doing anything else with that descriptor. completion-based
+ * backends will start a write if there isn't one already in flight. this is
+ * only for the core to call; backends use yc_conn_writable() */
+void yc_backend_flush(yc_conn_t *c);
+
+/* the connection is closing. stop watching it, close the descriptor, and
+ * call yc_conn_free() when it's safe to do so */
+void yc_backend_close(yc_conn_t *c);
+
+/* a batch of the message log (see yc_store.h) is ready to be written at
+ * ycsb_off in ycsb_fd, then synced. call yc_store_done() when that's done.
+ * backends that can't do file IO asynchronously hand it to
+ * yc_store_thread_write() */
+struct yc_store_batch;
+void yc_backend_store_write(struct yc_store_batch *b);
+
+/* stop (paused is 1) or start again (0) reading from the connection, because
+ * too much of what it's sent is still waiting to go out, or it's sending
+ * faster than its rate limit. the flag
+ * YCC_PAUSED is already set (or cleared) when this is called. while it's
+ * paused, don't call yc_conn_read() for it, or ask for more of its input */
+void yc_backend_pause(yc_conn_t *c, int paused);
+
+#endif
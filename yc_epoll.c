@@ -12,86 +12,100 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
 #include <sys/epoll.h>
-#include <sys/ioctl.h>
 #include <errno.h>
 
-/* max number of connections. in a real program you probably wouldn't do this,
- * and instead use a more dynamic structure for tracking connections */
-#define NUM_CONNS (128)
+#include "yc_core.h"
+#include "yc_log.h"
+#include "yc_store.h"
 
 /* max events per call to epoll_wait(). more of them just means fewer calls to
- * epoll_wait() in a busy server, but too many would be a waste of memory. our
- * server is tiny so there's no point having many. */
-#define NUM_EVENTS (16)
+ * epoll_wait() in a busy server, but too many would be a waste of memory */
+#define NUM_EVENTS (64)
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("usage: %s <port>\n", argv[0]);
-    exit(1);
-  }
+/* backend flag: we've asked epoll to tell us when this connection is
+ * writable */
+#define YCE_WANT_WRITE (1<<0)
 
-  int port = atoi(argv[1]);
-  if (port <= 0) {
-    printf("'%s' not a valid port number\n", argv[1]);
-    exit(1);
-  }
+/* the epoll context */
+static int epoll;
 
-  /* create the server socket */
-  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
-    perror("socket");
-    exit(1);
-  }
 
-  /* arrange for the listening address to be reusable. This makes TCP
-   * marginally "less safe" (for a whole bunch of obscure reasons) but allows
-   * us to kill and restart the program with ease */
-  int onoff = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &onoff, sizeof(onoff)) < 0) {
-    perror("setsockopt");
-    exit(1);
+/* tell epoll what we want to hear about for a connection: input, unless
+ * the core has paused it, and output if we're waiting to write */
+static void yc_epoll_update(yc_conn_t *c) {
+  struct epoll_event ev = {
+    .events  = ((c->ycc_flags & YCC_PAUSED) ? 0 : EPOLLIN) |
+               ((c->ycc_bflags & YCE_WANT_WRITE) ? EPOLLOUT : 0),
+    .data.fd = c->ycc_fd,
+  };
+  if (epoll_ctl(epoll, EPOLL_CTL_MOD, c->ycc_fd, &ev) < 0) {
+    yc_log(YC_LOG_ERROR, "epoll_ctl(%d): %s", c->ycc_fd, strerror(errno));
+    yc_conn_close(c);
   }
+}
 
-  /* set up the address structure for binding, which is *:<port> */
-  struct sockaddr_in sin = {
-    .sin_family = AF_INET,
-    .sin_port   = htons(port),
-    .sin_addr   = {
-      .s_addr = htonl(INADDR_ANY)
-    }
-  };
+/* called by the core when a connection has output queued. we try to send it
+ * right away; if the socket can't take it all, we ask epoll to tell us when
+ * there's room for more, and stop asking once it's all gone. that way we're
+ * not woken up over and over for a socket that's always writable */
+void yc_backend_flush(yc_conn_t *c) {
+  int want = yc_conn_write(c);
+  if (want == YC_IO_CLOSED)
+    return;
+
+  int wanted = !!(c->ycc_bflags & YCE_WANT_WRITE);
+  if ((want == YC_IO_AGAIN) == wanted)
+    return;
+
+  c->ycc_bflags ^= YCE_WANT_WRITE;
+  yc_epoll_update(c);
+}
 
-  /* bind the server socket to the wanted address */
-  if (bind(server_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
-    perror("bind");
-    exit(1);
-  }
+/* called by the core to stop or start reading from a connection. without
+ * EPOLLIN, epoll won't tell us there's anything to read, so it stays in the
+ * socket */
+void yc_backend_pause(yc_conn_t *c, int paused) {
+  (void) paused;
+  yc_epoll_update(c);
+}
+
+/* called by the core when a connection is going away */
+void yc_backend_close(yc_conn_t *c) {
+  /* must deregister before close, for obscure reasons around epoll's
+   * implementation (see notes above) */
+  epoll_ctl(epoll, EPOLL_CTL_DEL, c->ycc_fd, NULL);
+  close(c->ycc_fd);
+  yc_conn_free(c);
+}
 
-  /* and open it for connections! */
-  if (listen(server_fd, 10) < 0) {
-    perror("listen");
+/* called by the core with a batch of the message log to write. epoll can't
+ * tell us when a file is ready (files are always "ready", and then block),
+ * so the store's writer thread does it */
+void yc_backend_store_write(struct yc_store_batch *b) {
+  yc_store_thread_write(b);
+}
+
+
+int main(int argc, char **argv) {
+  /* the core handles the commandline and sets up the listening socket for
+   * us */
+  int server_fd = yc_core_init(argc, argv, 0);
+
+  /* make the server socket non-blocking too, so we can accept everyone
+   * that's waiting each time it becomes readable, and know when to stop */
+  if (yc_set_nonblock(server_fd) < 0) {
+    perror("ioctl");
     exit(1);
   }
 
-  printf("listening on port %d\n", port);
-
   /* create the epoll context */
-  int epoll = epoll_create1(0);
+  epoll = epoll_create1(0);
   if (epoll < 0) {
     perror("epoll_create1");
     exit(1);
   }
 
-  /* create storage for our active connections. in a real server, this would be
-   * some mapping from file descriptor -> connection object. here the only
-   * thing we're interested is if the descriptor is connected at all, so a bool
-   * (int) is enough: if conns[fd] is true, then fd is connected right now */
-  int conns[NUM_CONNS];
-  memset(&conns, 0, sizeof(conns));
-
   /* make room for incoming events */
   struct epoll_event events[NUM_EVENTS];
 
@@ -107,117 +121,71 @@ int main(int argc, char **argv) {
   }
 
   /* main loop. ask epoll_wait() to tell us if anything interesting happened, or block */
-  int nevents;
-  while ((nevents = epoll_wait(epoll, events, NUM_EVENTS, -1)) >= 0) {
-    /* in theory, nothing could have happened. that should be impossible the
-     * way we've set this up but its not an error so might as well quietly
-     * handle it */
-    if (!nevents)
-      continue;
+  for (;;) {
+    int nevents = epoll_wait(epoll, events, NUM_EVENTS, yc_core_timeout());
+    if (nevents < 0) {
+      /* a signal arrived; nothing's wrong */
+      if (errno == EINTR)
+        continue;
+      break;
+    }
 
     for (int n = 0; n < nevents; n++) {
       int fd = events[n].data.fd;
 
       if (fd == server_fd) {
-        /* create storage for their address */
-        struct sockaddr_in sin;
-        socklen_t sinlen = sizeof(sin);
-
-        /* let them in! */
-        int new_fd = accept(server_fd, (struct sockaddr *) &sin, &sinlen);
-        if (new_fd < 0) {
-          perror("accept");
-        }
-        else {
-          /* hello */
-          printf("[%d] connect from %s:%d\n", new_fd, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-
-          /* make them non-blocking. this is necessary, because a disconnect will
-          * cause a descriptor to become readable, but reading will block
-          * forever (because they're disconnected. non-blocking will cause
-          * read() to return 0 on a disconnected descriptor, so we can take the
-          * right action */
-          int onoff = 1;
-          if (ioctl(new_fd, FIONBIO, &onoff) < 0) {
-            printf("fcntl(%d): %s\n", new_fd, strerror(errno));
-            close(new_fd);
-            continue;
-          }
-
+        /* someone connected. let them all in; the core will set them up for
+         * us */
+        yc_conn_t *c;
+        while ((c = yc_conn_accept(server_fd))) {
           /* register the connection with epoll so we can be told when
-           * something interesting happens to it. again, its safe to reuse the
-           * first element of the events list; even if we're currently
-           * processing the first event, we're already done with it */
-          events[0].events = EPOLLIN;
-          events[0].data.fd = new_fd;
-          if (epoll_ctl(epoll, EPOLL_CTL_ADD, new_fd, &events[0]) < 0) {
-            printf("epoll_ctl(%d): %s\n", new_fd, strerror(errno));
-            close(new_fd);
-            continue;
+           * something interesting happens to it. its safe to use a local
+           * here; epoll copies what it needs */
+          struct epoll_event ev = {
+            .events  = EPOLLIN,
+            .data.fd = c->ycc_fd,
+          };
+          if (epoll_ctl(epoll, EPOLL_CTL_ADD, c->ycc_fd, &ev) < 0) {
+            yc_log(YC_LOG_ERROR, "epoll_ctl(%d): %s", c->ycc_fd, strerror(errno));
+            yc_conn_close(c);
           }
-
-          /* remember our new connection. in a real server, you'd create a
-          * connection or user object of some sort, maybe send them a greeting,
-          * begin authentication, etc */
-          conns[new_fd] = 1;
         }
+        continue;
       }
 
-      else {
-        /* yes! */
-        printf("[%d] activity\n", fd);
-
-        /* create a buffer to read into */
-        char buf[1024];
-        int nread = read(fd, buf, sizeof(buf));
-
-        /* see how much we read */
-        if (nread < 0) {
-          /* less then zero is some error. disconnect them */
-          fprintf(stderr, "read(%d): %s\n", fd, strerror(errno));
-          epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
-          close(fd);
-          conns[fd] = 0;
-        }
-
-        else if (nread > 0) {
-          /* we got some stuff from them! */
-          printf("[%d] read: %.*s\n", fd, nread, buf);
-
-          /* loop over all our connections, and send stuff onto them! */
-          for (int dest_fd = 0; dest_fd < NUM_CONNS; dest_fd++) {
-
-            /* take active connections, but not ourselves */
-            if (conns[dest_fd] && dest_fd != fd) {
-
-              /* write to them */
-              if (write(dest_fd, buf, nread) < 0) {
-                /* disconnect if it fails; they might have legitimately gone away without telling us */
-                fprintf(stderr, "write(%d): %s\n", dest_fd, strerror(errno));
-                epoll_ctl(epoll, EPOLL_CTL_DEL, dest_fd, NULL);
-                close(dest_fd);
-                conns[dest_fd] = 0;
-              }
-            }
-          }
-        }
-
-        /* zero byes read */
-        else {
-          /* so they gracefully disconnected and we should forget them */
-          printf("[%d] closed\n", fd);
-          /* must deregister before close, for obscure reasons around epoll's
-           * implementation (see notes above) */
-          epoll_ctl(epoll, EPOLL_CTL_DEL, fd, NULL);
-          close(fd);
-          conns[fd] = 0;
-        }
+      /* something happened on a connection. it might have been closed by an
+       * earlier event in this batch though, so check */
+      yc_conn_t *c = yc_conn_get(fd);
+      if (!c)
+        continue;
+
+      /* can they take more output? send it */
+      if (events[n].events & EPOLLOUT)
+        yc_conn_writable(c);
+
+      if (!(c = yc_conn_get(fd)))
+        continue;
+
+      /* a hangup or an error still comes while they're paused, and we can't
+       * read to find out which. they're gone either way, so let them go. and
+       * if they were paused earlier in this batch, their data can wait */
+      if (c->ycc_flags & YCC_PAUSED) {
+        if (events[n].events & (EPOLLHUP | EPOLLERR))
+          yc_conn_close(c);
       }
+
+      /* data (or a hangup, or an error, which read() will tell us about).
+       * the core will read it and decide what to do with it */
+      else if (events[n].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        yc_conn_read(c);
     }
+
+    /* send anything that was queued up while we were processing */
+    yc_core_tick();
   }
 
   /* epoll_wait failed. in a real server you might actually need to handle
-   * non-error cases like EINTR, but it complicates this example so we won't
+   * more non-error cases, but it complicates this example so we won't
    * bother */
   perror("epoll_wait");
   exit(1);
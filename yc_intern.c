@@ -0,0 +1,120 @@
+/* yc_intern - interned names for yoctochat servers */
+
+/* The table is open addressing with linear probing: an array of pointers,
+ * and a name lives in the first free slot at or after its hash. Lookups
+ * walk forward from there until they find it or hit an empty slot. We keep
+ * it at most half full so those walks stay short.
+ *
+ * Removing a name can't just empty its slot, because that would cut the
+ * walk short for anything that had to step past it. Instead we pull later
+ * entries back into the gap, if that's closer to where they want to be
+ * ("backward shift deletion"). That way there are no tombstones, and the
+ * table never needs cleaning up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yc_intern.h"
+
+static yc_name_t **yc_names;
+static size_t      yc_names_cap;
+static size_t      yc_names_len;
+
+/* FNV-1a. names are short, so something simple does fine */
+uint32_t yc_name_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t) s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static size_t yc_name_slot(uint32_t hash, const char *s, size_t len) {
+  size_t mask = yc_names_cap - 1;
+  for (size_t i = hash & mask; ; i = (i+1) & mask) {
+    yc_name_t *n = yc_names[i];
+    if (!n || (n->ycn_hash == hash && n->ycn_len == len && memcmp(n->ycn_str, s, len) == 0))
+      return i;
+  }
+}
+
+static void yc_names_grow(void) {
+  size_t ocap = yc_names_cap;
+  yc_name_t **onames = yc_names;
+
+  yc_names_cap = ocap ? ocap * 2 : 64;
+  yc_names = calloc(yc_names_cap, sizeof(yc_name_t *));
+  if (!yc_names) {
+    perror("calloc");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < ocap; i++) {
+    yc_name_t *n = onames[i];
+    if (n)
+      yc_names[yc_name_slot(n->ycn_hash, n->ycn_str, n->ycn_len)] = n;
+  }
+  free(onames);
+}
+
+yc_name_t *yc_name_find(const char *s, size_t len) {
+  if (!yc_names_len)
+    return NULL;
+  return yc_names[yc_name_slot(yc_name_hash(s, len), s, len)];
+}
+
+yc_name_t *yc_name_intern(const char *s, size_t len) {
+  if ((yc_names_len+1) * 2 > yc_names_cap)
+    yc_names_grow();
+
+  uint32_t hash = yc_name_hash(s, len);
+  size_t slot = yc_name_slot(hash, s, len);
+
+  yc_name_t *n = yc_names[slot];
+  if (n) {
+    n->ycn_refcnt++;
+    return n;
+  }
+
+  n = malloc(sizeof(yc_name_t) + len + 1);
+  if (!n) {
+    perror("malloc");
+    exit(1);
+  }
+  n->ycn_hash   = hash;
+  n->ycn_refcnt = 1;
+  n->ycn_len    = len;
+  memcpy(n->ycn_str, s, len);
+  n->ycn_str[len] = '\0';
+
+  yc_names[slot] = n;
+  yc_names_len++;
+
+  return n;
+}
+
+void yc_name_unref(yc_name_t *n) {
+  if (--n->ycn_refcnt > 0)
+    return;
+
+  size_t mask = yc_names_cap - 1;
+  size_t hole = yc_name_slot(n->ycn_hash, n->ycn_str, n->ycn_len);
+  yc_names[hole] = NULL;
+  yc_names_len--;
+  free(n);
+
+  /* walk the run after the hole. anything that wants to be at or before
+   * the hole (allowing for wrapping around the end) can move back into it,
+   * and leaves a new hole behind */
+  for (size_t i = (hole+1) & mask; yc_names[i]; i = (i+1) & mask) {
+    size_t want = yc_names[i]->ycn_hash & mask;
+    if (((i - want) & mask) >= ((i - hole) & mask)) {
+      yc_names[hole] = yc_names[i];
+      yc_names[i] = NULL;
+      hole = i;
+    }
+  }
+}
@@ -0,0 +1,42 @@
+/* yc_intern - interned names for yoctochat servers */
+
+/* Room names (and later, nicknames) get looked up a lot, and compared even
+ * more. Interning means there's only ever one copy of each distinct name,
+ * so once you've got one, comparing it to another is comparing pointers,
+ * and its hash has already been worked out.
+ *
+ * Names are refcounted. Whoever interns a name gets a reference, and the
+ * name goes away when the last one is dropped.
+ */
+
+#ifndef YC_INTERN_H
+#define YC_INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* longest name we'll intern */
+#define YC_NAME_MAX (32)
+
+typedef struct yc_name {
+  uint32_t ycn_hash;
+  uint32_t ycn_refcnt;
+  size_t   ycn_len;
+  char     ycn_str[];   /* nul-terminated, for convenience */
+} yc_name_t;
+
+/* hash some bytes the same way names are hashed */
+uint32_t yc_name_hash(const char *s, size_t len);
+
+/* find the interned copy of a name, if there is one. doesn't take a
+ * reference */
+yc_name_t *yc_name_find(const char *s, size_t len);
+
+/* get the interned copy of a name, making it if necessary. takes a
+ * reference */
+yc_name_t *yc_name_intern(const char *s, size_t len);
+
+/* drop a reference */
+void yc_name_unref(yc_name_t *n);
+
+#endif
@@ -1,87 +1,109 @@
 /* yc_kqueue - a yoctochat server using a BSD kqueue IO loop */
 
-#include <arpa/inet.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <netinet/in.h>
 #include <sys/event.h>
-#include <sys/ioctl.h>
-#include <sys/socket.h>
 #include <unistd.h>
 
-/* max number of connections. in a real program you probably wouldn't do this,
- * and instead use a more dynamic structure for tracking connections */
-#define NUM_CONNS (128)
-int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("usage: %s <port>\n", argv[0]);
-        exit(1);
-    }
-
-    int port = atoi(argv[1]);
-    if (port <= 0) {
-        printf("'%s' not a valid port number\n", argv[1]);
-        exit(1);
+#include "yc_core.h"
+#include "yc_log.h"
+#include "yc_store.h"
+
+/* max events per call to kevent(). more of them just means fewer calls in a
+ * busy server, but too many would be a waste of memory */
+#define NUM_EVENTS (64)
+
+/* backend flag: we've asked kqueue to tell us when this connection is
+ * writable */
+#define YCK_WANT_WRITE (1<<0)
+
+// The kqueue. Global so the backend functions the core calls can get at it.
+static int kq;
+
+/* called by the core when a connection has output queued. we try to send it
+ * right away; if the socket can't take it all, we add a write filter so
+ * kqueue will tell us when there's room for more, and remove it once it's
+ * all gone */
+void yc_backend_flush(yc_conn_t *c) {
+    int want = yc_conn_write(c);
+    if (want == YC_IO_CLOSED)
+        return;
+
+    int wanted = !!(c->ycc_bflags & YCK_WANT_WRITE);
+    if ((want == YC_IO_AGAIN) == wanted)
+        return;
+
+    struct kevent change_event;
+    EV_SET(&change_event, c->ycc_fd, EVFILT_WRITE,
+           want == YC_IO_AGAIN ? EV_ADD | EV_ENABLE : EV_DELETE, 0, 0, NULL);
+    if (kevent(kq, &change_event, 1, NULL, 0, NULL) < 0) {
+        yc_log(YC_LOG_ERROR, "kevent(%d): %s", c->ycc_fd, strerror(errno));
+        yc_conn_close(c);
+        return;
     }
+    c->ycc_bflags ^= YCK_WANT_WRITE;
+}
 
-    /* create the server socket */
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        perror("socket");
-        exit(1);
+// Called by the core to stop or start reading from a connection. Disabling
+// the read filter keeps it in the kqueue, but quiet, until it's enabled
+// again.
+void yc_backend_pause(yc_conn_t *c, int paused) {
+    struct kevent change_event;
+    EV_SET(&change_event, c->ycc_fd, EVFILT_READ, paused ? EV_DISABLE : EV_ENABLE, 0, 0, NULL);
+    if (kevent(kq, &change_event, 1, NULL, 0, NULL) < 0) {
+        yc_log(YC_LOG_ERROR, "kevent(%d): %s", c->ycc_fd, strerror(errno));
+        yc_conn_close(c);
     }
+}
 
-    /* arrange for the listening address to be reusable. This makes TCP
-   * marginally "less safe" (for a whole bunch of obscure reasons) but allows
-   * us to kill and restart the program with ease */
-    int onoff = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &onoff, sizeof(onoff)) < 0) {
-        perror("setsockopt");
-        exit(1);
-    }
+/* called by the core when a connection is going away. closing the file
+ * descriptor removes its events from the kqueue automatically */
+void yc_backend_close(yc_conn_t *c) {
+    close(c->ycc_fd);
+    yc_conn_free(c);
+}
 
-    /* set up the address structure for binding, which is *:<port> */
-    struct sockaddr_in sin = {
-            .sin_family = AF_INET,
-            .sin_port = htons(port),
-            .sin_addr = {
-                    .s_addr = htonl(INADDR_ANY)}};
+// Called by the core with a batch of the message log to write. kqueue can
+// tell us about files, but only that they're there, not that a write to one
+// won't block, so the store's writer thread does it.
+void yc_backend_store_write(struct yc_store_batch *b) {
+    yc_store_thread_write(b);
+}
 
-    /* bind the server socket to the wanted address */
-    if (bind(server_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
-        perror("bind");
+int main(int argc, char **argv) {
+    /* the core handles the commandline and sets up the listening socket for
+     * us */
+    int server_fd = yc_core_init(argc, argv, 0);
+
+    /* make the server socket non-blocking too, so we can accept everyone
+     * that's waiting each time it becomes readable, and know when to stop */
+    if (yc_set_nonblock(server_fd) < 0) {
+        perror("ioctl");
         exit(1);
     }
 
-    /* and open it for connections! */
-    if (listen(server_fd, 10) < 0) {
-        perror("listen");
+    // Prepare the kqueue.
+    kq = kqueue();
+    if (kq < 0) {
+        perror("kqueue");
         exit(1);
     }
 
-    printf("listening on port %d\n", port);
-
-    int conns[NUM_CONNS];
-    memset(&conns, 0, sizeof(conns));
-    // Prepare the kqueue.
-    int kq = kqueue();
-
-
     int new_events;
 
-    struct kevent change_event[4], event[4];
+    struct kevent change_event, event[NUM_EVENTS];
 
     // Create event 'filter', these are the events we want to monitor.
     // Here we want to monitor: socket_listen_fd, for the events: EVFILT_READ
     // (when there is data to be read on the socket), and perform the following
     // actions on this kevent: EV_ADD and EV_ENABLE (add the event to the kqueue
     // and enable it).
-    EV_SET(change_event, server_fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
+    EV_SET(&change_event, server_fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, 0);
 
     // Register kevent with the kqueue.
-    if (kevent(kq, change_event, 1, NULL, 0, NULL) == -1) {
+    if (kevent(kq, &change_event, 1, NULL, 0, NULL) == -1) {
         perror("kevent");
         exit(1);
     }
@@ -89,90 +111,69 @@ int main(int argc, char **argv) {
     for (;;) {
         // Check for new events, but do not register new events with
         // the kqueue. Hence the 2nd and 3rd arguments are NULL, 0.
-        // Only handle 1 new event per iteration in the loop; 5th
-        // argument is 1.
-        new_events = kevent(kq, NULL, 0, event, 1, NULL);
+        // Handle up to NUM_EVENTS new events per iteration in the loop.
+        // Don't wait past when the core next has something to do.
+        struct timespec ts, *tsp = NULL;
+        int timeout = yc_core_timeout();
+        if (timeout >= 0) {
+            ts.tv_sec  = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            tsp = &ts;
+        }
+        new_events = kevent(kq, NULL, 0, event, NUM_EVENTS, tsp);
         if (new_events == -1) {
-            perror("kevent");
-            exit(1);
+            // A signal arrived; nothing's wrong.
+            if (errno == EINTR)
+                continue;
+            break;
         }
 
         for (int i = 0; i < new_events; i++) {
             int event_fd = event[i].ident;
 
-            // When the client disconnects an EOF is sent. By closing the file
-            // descriptor the event is automatically removed from the kqueue.
-            if (event[i].flags & EV_EOF) {
-                printf("[%d] closed\n", event_fd);
-                close(event_fd);
-                conns[event_fd] = 0;
-            }
             // If the new event's file descriptor is the same as the listening
             // socket's file descriptor, we are sure that a new client wants
-            // to connect to our socket.
-            else if (event_fd == server_fd) {
-
-                socklen_t sinlen = sizeof(sin);
-                // Incoming socket connection on the listening socket.
-                // Create a new socket for the actual connection to client.
-                int new_fd = accept(event_fd, (struct sockaddr *) &sin, &sinlen);
-                if (new_fd < 0) {
-                    perror("accept");
-                } else {
-                    printf("[%d] connect from %s:%d\n", new_fd, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
+            // to connect to our socket. Let them all in; the core will set
+            // them up for us.
+            if (event_fd == server_fd) {
+                yc_conn_t *c;
+                while ((c = yc_conn_accept(server_fd))) {
                     // Put this new socket connection also as a 'filter' event
                     // to watch in kqueue, so we can now watch for events on this
                     // new socket.
-                    EV_SET(change_event, new_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
-                    if (kevent(kq, change_event, 1, NULL, 0, NULL) < 0) {
-                        perror("kevent error");
+                    EV_SET(&change_event, c->ycc_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+                    if (kevent(kq, &change_event, 1, NULL, 0, NULL) < 0) {
+                        yc_log(YC_LOG_ERROR, "kevent(%d): %s", c->ycc_fd, strerror(errno));
+                        yc_conn_close(c);
                     }
-                    /* remember our new connection. in a real server, you'd create a
-                     * connection or user object of some sort, maybe send them a greeting,
-                     * begin authentication, etc */
-                    conns[new_fd] = 1;
                 }
+                continue;
             }
 
-            else if (event[i].filter & EVFILT_READ) {
-                printf("[%d] activity\n", event_fd);
-                // Read bytes from socket
-                char buf[1024];
-                size_t nread = recv(event_fd, buf, sizeof(buf), 0);
-                printf("read %zu bytes\n", nread);
-                /* see how much we read */
-                if (nread < 0) {
-                    /* less then zero is some error. disconnect them */
-                    fprintf(stderr, "read(%d): %s\n", event_fd, strerror(errno));
-                    close(event_fd);
-                    conns[event_fd] = 0;
-                } else if (nread > 0) {
-                    /* we got some stuff from them! */
-                    printf("[%d] read: %.*s\n", event_fd, (int) nread, buf);
-
-                    /* loop over all our connections, and send stuff onto them! */
-                    for (int dest_fd = 0; dest_fd < NUM_CONNS; dest_fd++) {
-
-                        /* take active connections, but not ourselves */
-                        if (conns[dest_fd] && dest_fd != event_fd) {
-
-                            /* write to them */
-                            if (write(dest_fd, buf, nread) < 0) {
-                                /* disconnect if it fails; they might have legitimately gone away without telling us */
-                                fprintf(stderr, "write(%d): %s\n", dest_fd, strerror(errno));
-                                close(dest_fd);
-                                conns[dest_fd] = 0;
-                            }
-                        }
-                    }
-                }
-            }
+            // Something happened on a connection. It might have been closed
+            // by an earlier event in this batch though, so check.
+            yc_conn_t *c = yc_conn_get(event_fd);
+            if (!c)
+                continue;
+
+            // Room to write; send whatever's waiting.
+            if (event[i].filter == EVFILT_WRITE)
+                yc_conn_writable(c);
+
+            // Data to read. When the client disconnects an EOF is flagged
+            // too, but there may still be data ahead of it, so we just read;
+            // the core will see the zero-length read and clean up.
+            else if (event[i].filter == EVFILT_READ)
+                yc_conn_read(c);
         }
+
+        /* send anything that was queued up while we were processing */
+        yc_core_tick();
     }
 
     /* kqueue failed. in a real server you might actually need to handle
-   * non-error cases like EINTR, but it complicates this example so we won't
-   * bother */
+     * more non-error cases, but it complicates this example so we won't
+     * bother */
     perror("kevent");
     exit(1);
 }
@@ -0,0 +1,261 @@
+/* yc_log - asynchronous logging for yoctochat servers */
+
+/* The ring is a bounded multi-producer, single-consumer queue of fixed-size
+ * slots, after Dmitry Vyukov's well-known design. Each slot carries a
+ * sequence number that says whose turn it is:
+ *
+ *   - a producer claims the slot at position pos when its sequence is pos,
+ *     by moving the shared head along with a compare-and-swap. it fills the
+ *     slot, then sets the sequence to pos+1 to say "ready"
+ *
+ *   - the consumer waits for the slot at its tail to have sequence tail+1,
+ *     takes the line out, and sets the sequence to tail+nslots, which is
+ *     what a producer will be looking for next time round
+ *
+ * Nobody ever takes a lock, and a producer never waits: if the slot it wants
+ * is still waiting to be written out, the ring is full and the line is
+ * dropped. Today only the event loop thread logs, but other threads can too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+
+#include "yc_log.h"
+
+/* longest line we'll log; longer ones are cut short */
+#define YC_LOG_LINE (256)
+
+/* how much the writer thread gathers up before it writes */
+#define YC_LOG_BATCH (16384)
+
+yc_log_level_t yc_log_level = YC_LOG_CONNECT;
+
+typedef struct {
+  _Atomic size_t ycl_seq;
+  uint16_t       ycl_len;
+  uint8_t        ycl_level;
+  char           ycl_text[YC_LOG_LINE];
+} yc_log_slot_t;
+
+static yc_log_slot_t *yc_log_ring;
+static size_t         yc_log_mask;
+
+/* producers move the head, the consumer moves the tail. they're on separate
+ * cache lines so they don't fight */
+static _Alignas(64) _Atomic size_t yc_log_head;
+static _Alignas(64) size_t         yc_log_tail;
+
+static _Atomic uint64_t yc_log_ndropped;
+
+/* the writer thread sleeps on this when the ring is empty. producers only
+ * post to it if it's actually asleep, so a busy server doesn't make a system
+ * call per line */
+static sem_t          yc_log_wake;
+static _Atomic int    yc_log_sleeping;
+static _Atomic int    yc_log_stopping;
+static pthread_t      yc_log_thread;
+static int            yc_log_running;
+
+
+static const char *yc_log_level_names[] = {
+  [YC_LOG_OFF]     = "off",
+  [YC_LOG_ERROR]   = "error",
+  [YC_LOG_CONNECT] = "connect",
+  [YC_LOG_MESSAGE] = "message",
+  [YC_LOG_DEBUG]   = "debug",
+};
+
+int yc_log_parse_level(const char *name, yc_log_level_t *level) {
+  for (int i = YC_LOG_OFF; i <= YC_LOG_DEBUG; i++) {
+    if (strcmp(name, yc_log_level_names[i]) == 0) {
+      *level = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+uint64_t yc_log_dropped(void) {
+  return atomic_load_explicit(&yc_log_ndropped, memory_order_relaxed);
+}
+
+
+void yc_log_write(yc_log_level_t level, const char *fmt, ...) {
+  /* logging before the ring is set up (or without one at all) goes straight
+   * out the old-fashioned way */
+  if (!yc_log_ring) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(level == YC_LOG_ERROR ? stderr : stdout, fmt, ap);
+    va_end(ap);
+    fputc('\n', level == YC_LOG_ERROR ? stderr : stdout);
+    return;
+  }
+
+  /* claim a slot */
+  size_t pos = atomic_load_explicit(&yc_log_head, memory_order_relaxed);
+  yc_log_slot_t *slot;
+  for (;;) {
+    slot = &yc_log_ring[pos & yc_log_mask];
+    size_t seq = atomic_load_explicit(&slot->ycl_seq, memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0) {
+      /* it's free; try to take it. if someone else beat us to it, pos is
+       * updated to the new head and we go around again */
+      if (atomic_compare_exchange_weak_explicit(&yc_log_head, &pos, pos+1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0) {
+      /* the writer hasn't got to it yet, so we're full */
+      atomic_fetch_add_explicit(&yc_log_ndropped, 1, memory_order_relaxed);
+      return;
+    }
+    else
+      pos = atomic_load_explicit(&yc_log_head, memory_order_relaxed);
+  }
+
+  /* fill it in. leave room for the newline */
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(slot->ycl_text, YC_LOG_LINE-1, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    len = 0;
+  if (len > YC_LOG_LINE-2)
+    len = YC_LOG_LINE-2;
+  slot->ycl_text[len++] = '\n';
+  slot->ycl_len   = len;
+  slot->ycl_level = level;
+
+  /* and publish it */
+  atomic_store_explicit(&slot->ycl_seq, pos+1, memory_order_release);
+
+  /* the line has to be visible before we look to see if the writer is
+   * asleep, or we can both miss each other. the writer does the same the
+   * other way round */
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&yc_log_sleeping))
+    sem_post(&yc_log_wake);
+}
+
+
+/* write a whole buffer, riding out short writes and signals */
+static void yc_log_out(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
+/* take everything that's ready off the ring and write it. returns the
+ * number of lines written */
+static int yc_log_drain(void) {
+  static char out[YC_LOG_BATCH], err[YC_LOG_BATCH];
+  size_t outlen = 0, errlen = 0;
+  int n = 0;
+
+  for (;;) {
+    yc_log_slot_t *slot = &yc_log_ring[yc_log_tail & yc_log_mask];
+    size_t seq = atomic_load_explicit(&slot->ycl_seq, memory_order_acquire);
+    if (seq != yc_log_tail+1)
+      break;
+
+    /* errors go to stderr, everything else to stdout, just like before */
+    char  *buf = slot->ycl_level == YC_LOG_ERROR ? err : out;
+    size_t *blen = slot->ycl_level == YC_LOG_ERROR ? &errlen : &outlen;
+    if (*blen + slot->ycl_len > YC_LOG_BATCH) {
+      yc_log_out(buf == err ? 2 : 1, buf, *blen);
+      *blen = 0;
+    }
+    memcpy(buf + *blen, slot->ycl_text, slot->ycl_len);
+    *blen += slot->ycl_len;
+
+    /* hand the slot back to the producers */
+    atomic_store_explicit(&slot->ycl_seq, yc_log_tail + yc_log_mask+1, memory_order_release);
+    yc_log_tail++;
+    n++;
+  }
+
+  if (outlen)
+    yc_log_out(1, out, outlen);
+  if (errlen)
+    yc_log_out(2, err, errlen);
+
+  return n;
+}
+
+static void *yc_log_run(void *arg) {
+  for (;;) {
+    if (yc_log_drain())
+      continue;
+
+    if (atomic_load(&yc_log_stopping))
+      break;
+
+    /* nothing to do. say we're going to sleep, then look again, in case a
+     * line arrived just before we said so and its producer didn't see us
+     * sleeping. then sleep until woken */
+    atomic_store(&yc_log_sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!yc_log_drain() && !atomic_load(&yc_log_stopping))
+      while (sem_wait(&yc_log_wake) < 0 && errno == EINTR)
+        ;
+    atomic_store(&yc_log_sleeping, 0);
+  }
+
+  return NULL;
+}
+
+/* on the way out, let the writer finish what's in the ring */
+static void yc_log_shutdown(void) {
+  if (!yc_log_running)
+    return;
+  atomic_store(&yc_log_stopping, 1);
+  sem_post(&yc_log_wake);
+  pthread_join(yc_log_thread, NULL);
+  yc_log_running = 0;
+}
+
+void yc_log_init(unsigned nslots) {
+  if (yc_log_level == YC_LOG_OFF)
+    return;
+
+  /* round up to a power of two, so we can wrap with a mask */
+  size_t n = 16;
+  while (n < nslots)
+    n <<= 1;
+
+  yc_log_ring = malloc(n * sizeof(yc_log_slot_t));
+  if (!yc_log_ring) {
+    perror("malloc");
+    exit(1);
+  }
+  for (size_t i = 0; i < n; i++)
+    atomic_init(&yc_log_ring[i].ycl_seq, i);
+  yc_log_mask = n-1;
+
+  sem_init(&yc_log_wake, 0, 0);
+
+  int err = pthread_create(&yc_log_thread, NULL, yc_log_run, NULL);
+  if (err) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(err));
+    exit(1);
+  }
+  yc_log_running = 1;
+
+  atexit(yc_log_shutdown);
+}
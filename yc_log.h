@@ -0,0 +1,53 @@
+/* yc_log - asynchronous logging for yoctochat servers */
+
+/* Printing every message as it goes through the server is lovely when you're
+ * learning, but printf() to a terminal (or a pipe that someone isn't reading
+ * fast enough) is a blocking write, and it happens right in the middle of the
+ * event loop. One slow terminal and everyone's messages stall.
+ *
+ * So instead, log lines are formatted into a ring buffer in memory, and a
+ * background thread takes them out and writes them. The event loop never
+ * waits on it: if the ring is full, the line is dropped and counted.
+ *
+ * Every log line has a level, and lines above the configured level are
+ * skipped before any formatting happens, so turning the level down makes
+ * logging on the message path free.
+ */
+
+#ifndef YC_LOG_H
+#define YC_LOG_H
+
+#include <stdint.h>
+
+typedef enum {
+  YC_LOG_OFF,       /* nothing at all */
+  YC_LOG_ERROR,     /* things that went wrong */
+  YC_LOG_CONNECT,   /* connects and disconnects (the default) */
+  YC_LOG_MESSAGE,   /* every message */
+  YC_LOG_DEBUG,     /* every event */
+} yc_log_level_t;
+
+/* the current level. anything above it isn't logged */
+extern yc_log_level_t yc_log_level;
+
+/* number of lines thrown away because the ring was full */
+uint64_t yc_log_dropped(void);
+
+/* parse a level name ("off", "error", "connect", "message", "debug") */
+int yc_log_parse_level(const char *name, yc_log_level_t *level);
+
+/* set up the ring (with room for nslots lines) and start the writer thread */
+void yc_log_init(unsigned nslots);
+
+/* format and queue a log line. use yc_log() instead, so the level check
+ * happens before the arguments are even evaluated */
+void yc_log_write(yc_log_level_t level, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+#define yc_log(level, ...)              \
+  do {                                  \
+    if ((level) <= yc_log_level)        \
+      yc_log_write(level, __VA_ARGS__); \
+  } while (0)
+
+#endif
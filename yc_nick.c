@@ -0,0 +1,214 @@
+/* yc_nick - nicknames for yoctochat servers */
+
+/* See yc_nick.h for the idea. Details:
+ *
+ *   - the hash is split in two. the top bits (h1) pick the group to start
+ *     in, and the bottom 7 bits (h2) go in the control byte. a full entry's
+ *     control byte is h2, which is 0-127, so the top bit is clear. empty and
+ *     deleted are negative, so they never match
+ *
+ *   - if the group we start in has no match and no empty entry, we go on to
+ *     another one: 1 group along, then 2 more, then 3 more, and so on. with
+ *     a power-of-two number of groups, that visits every group
+ *
+ *   - removing an entry marks it deleted rather than empty, since a lookup
+ *     for something further along might have to step past it. deleted
+ *     entries are cleaned out whenever the table is rebuilt
+ *
+ *   - the table is rebuilt (bigger, if it's the live entries filling it up)
+ *     when it's 7/8 full, counting deleted entries
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yc_nick.h"
+#include "yc_room.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define YC_NICK_GROUP (16)
+
+#define YC_NICK_EMPTY   ((int8_t) -128)
+#define YC_NICK_DELETED ((int8_t) -2)
+
+typedef struct {
+  yc_name_t *ycne_name;
+  yc_conn_t *ycne_conn;
+} yc_nick_ent_t;
+
+static int8_t        *yc_nick_ctrl;
+static yc_nick_ent_t *yc_nick_ents;
+static size_t         yc_nick_ngroups;
+static size_t         yc_nick_used;       /* live entries */
+static size_t         yc_nick_deleted;    /* deleted entries */
+
+
+/* the intern table's hash is fine for spreading names over buckets, but the
+ * bits at the top and bottom need to be good too, since that's what we use.
+ * this is the finaliser from MurmurHash3, which makes sure of it */
+static uint32_t yc_nick_mix(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+/* which entries in a group have this control byte? one bit per entry */
+static inline unsigned yc_nick_match(const int8_t *ctrl, int8_t want) {
+#if defined(__SSE2__)
+  __m128i g = _mm_load_si128((const __m128i *) ctrl);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(want)));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < YC_NICK_GROUP; i++)
+    if (ctrl[i] == want)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
+
+/* which entries are free (empty or deleted)? they're the only negative
+ * control bytes, so it's just their top bits */
+static inline unsigned yc_nick_match_free(const int8_t *ctrl) {
+#if defined(__SSE2__)
+  return _mm_movemask_epi8(_mm_load_si128((const __m128i *) ctrl));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < YC_NICK_GROUP; i++)
+    if (ctrl[i] < 0)
+      mask |= 1u << i;
+  return mask;
+#endif
+}
+
+/* find the entry for a name. returns its index, or -1 */
+static ssize_t yc_nick_lookup(uint32_t hash, const char *nick, size_t len) {
+  if (!yc_nick_ngroups)
+    return -1;
+
+  uint32_t h = yc_nick_mix(hash);
+  int8_t h2 = h & 0x7f;
+  size_t gmask = yc_nick_ngroups - 1;
+
+  for (size_t g = (h >> 7) & gmask, step = 1; ; g = (g + step++) & gmask) {
+    const int8_t *ctrl = &yc_nick_ctrl[g * YC_NICK_GROUP];
+
+    for (unsigned m = yc_nick_match(ctrl, h2); m; m &= m-1) {
+      size_t i = g * YC_NICK_GROUP + __builtin_ctz(m);
+      const yc_name_t *n = yc_nick_ents[i].ycne_name;
+      if (n->ycn_hash == hash && n->ycn_len == len && memcmp(n->ycn_str, nick, len) == 0)
+        return i;
+    }
+
+    /* an empty entry means it was never put any further along */
+    if (yc_nick_match(ctrl, YC_NICK_EMPTY))
+      return -1;
+
+    /* been everywhere */
+    if (step > yc_nick_ngroups)
+      return -1;
+  }
+}
+
+/* put an entry in the first free place along its probe sequence. the table
+ * must have room */
+static void yc_nick_place(yc_name_t *name, yc_conn_t *conn) {
+  uint32_t h = yc_nick_mix(name->ycn_hash);
+  size_t gmask = yc_nick_ngroups - 1;
+
+  for (size_t g = (h >> 7) & gmask, step = 1; ; g = (g + step++) & gmask) {
+    int8_t *ctrl = &yc_nick_ctrl[g * YC_NICK_GROUP];
+    unsigned m = yc_nick_match_free(ctrl);
+    if (!m)
+      continue;
+
+    size_t i = g * YC_NICK_GROUP + __builtin_ctz(m);
+    if (yc_nick_ctrl[i] == YC_NICK_DELETED)
+      yc_nick_deleted--;
+    yc_nick_ctrl[i] = h & 0x7f;
+    yc_nick_ents[i] = (yc_nick_ent_t) { .ycne_name = name, .ycne_conn = conn };
+    yc_nick_used++;
+    return;
+  }
+}
+
+/* rebuild the table with room for at least need live entries */
+static void yc_nick_rebuild(size_t need) {
+  int8_t        *octrl    = yc_nick_ctrl;
+  yc_nick_ent_t *oents    = yc_nick_ents;
+  size_t         ongroups = yc_nick_ngroups;
+
+  size_t ngroups = 1;
+  while (ngroups * YC_NICK_GROUP * 7/8 <= need)
+    ngroups *= 2;
+
+  /* the control bytes are loaded a group at a time, so they need to be
+   * aligned to a group */
+  yc_nick_ctrl = aligned_alloc(YC_NICK_GROUP, ngroups * YC_NICK_GROUP);
+  yc_nick_ents = malloc(ngroups * YC_NICK_GROUP * sizeof(yc_nick_ent_t));
+  if (!yc_nick_ctrl || !yc_nick_ents) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(yc_nick_ctrl, YC_NICK_EMPTY, ngroups * YC_NICK_GROUP);
+  yc_nick_ngroups = ngroups;
+  yc_nick_used    = 0;
+  yc_nick_deleted = 0;
+
+  for (size_t i = 0; i < ongroups * YC_NICK_GROUP; i++)
+    if (octrl[i] >= 0)
+      yc_nick_place(oents[i].ycne_name, oents[i].ycne_conn);
+
+  free(octrl);
+  free(oents);
+}
+
+
+yc_conn_t *yc_nick_find(const char *nick, size_t len) {
+  ssize_t i = yc_nick_lookup(yc_name_hash(nick, len), nick, len);
+  return i < 0 ? NULL : yc_nick_ents[i].ycne_conn;
+}
+
+int yc_nick_set(yc_conn_t *c, const char *nick, size_t len) {
+  ssize_t i = yc_nick_lookup(yc_name_hash(nick, len), nick, len);
+  if (i >= 0)
+    return yc_nick_ents[i].ycne_conn == c ? 0 : -1;
+
+  yc_nick_release(c);
+
+  /* full, counting the deleted entries? rebuild. if it's mostly deleted
+   * entries, the same size will do once they're cleaned out */
+  size_t cap = yc_nick_ngroups * YC_NICK_GROUP;
+  if ((yc_nick_used + yc_nick_deleted + 1) > cap * 7/8)
+    yc_nick_rebuild(yc_nick_used + 1 > cap * 7/16 ? (yc_nick_used + 1) * 2 : yc_nick_used + 1);
+
+  c->ycc_nick = yc_name_intern(nick, len);
+  yc_nick_place(c->ycc_nick, c);
+
+  yc_room_member_changed(c);
+  return 0;
+}
+
+void yc_nick_release(yc_conn_t *c) {
+  if (!c->ycc_nick)
+    return;
+
+  yc_name_t *n = c->ycc_nick;
+  ssize_t i = yc_nick_lookup(n->ycn_hash, n->ycn_str, n->ycn_len);
+  if (i >= 0) {
+    yc_nick_ctrl[i] = YC_NICK_DELETED;
+    yc_nick_used--;
+    yc_nick_deleted++;
+  }
+
+  c->ycc_nick = NULL;
+  yc_name_unref(n);
+
+  yc_room_member_changed(c);
+}
@@ -0,0 +1,35 @@
+/* yc_nick - nicknames for yoctochat servers */
+
+/* A connection can take a nickname with /nick, and then anyone can send it
+ * a private message with /msg. That means finding a connection by its
+ * nickname, on every private message, among maybe hundreds of thousands of
+ * them. So nicknames live in a hash table built for lookups: a "Swiss
+ * table", after the design in Google's Abseil library.
+ *
+ * Alongside the array of entries is an array of control bytes, one per
+ * entry. A control byte says whether the entry is empty, deleted, or in use,
+ * and if it's in use, holds 7 bits of the key's hash. The entries are split
+ * into groups of 16, and a lookup goes straight to a group and compares all
+ * 16 control bytes against the hash bits with one SIMD instruction. Only the
+ * entries that match (almost always just the one we want) need their keys
+ * compared. If the group has an empty entry, the key can't be any further
+ * along, so one group is usually all it takes.
+ */
+
+#ifndef YC_NICK_H
+#define YC_NICK_H
+
+#include "yc_core.h"
+#include "yc_intern.h"
+
+/* find the connection with this nickname, or NULL */
+yc_conn_t *yc_nick_find(const char *nick, size_t len);
+
+/* give a connection a nickname, replacing the one it had. returns 0, or -1
+ * if someone else has it */
+int yc_nick_set(yc_conn_t *c, const char *nick, size_t len);
+
+/* let go of a connection's nickname, on the way out */
+void yc_nick_release(yc_conn_t *c);
+
+#endif
@@ -4,74 +4,82 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
 #include <poll.h>
-#include <sys/ioctl.h>
 #include <errno.h>
 
-/* number of pollfds in our array. because of the wey we're implementing this,
- * that's roughly the maximum number of connections we can handle. */
-#define NUM_POLLFDS (128)
+#include "yc_core.h"
+#include "yc_store.h"
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("usage: %s <port>\n", argv[0]);
-    exit(1);
-  }
+/* our array of pollfd structs. each one carries a file descriptor, a set of
+ * wanted events, and after the poll() call, a set of events that occurred.
+ * for our own convenience we keep a static list and use the file descriptor
+ * as the index, so we make it big enough for every descriptor the core will
+ * give us */
+static struct pollfd *pollfds;
 
-  int port = atoi(argv[1]);
-  if (port <= 0) {
-    printf("'%s' not a valid port number\n", argv[1]);
-    exit(1);
-  }
+/* one past the highest descriptor we've ever put in the array. poll() only
+ * needs to look that far */
+static int npollfds;
 
-  /* create the server socket */
-  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
-    perror("socket");
-    exit(1);
-  }
 
-  /* arrange for the listening address to be reusable. This makes TCP
-   * marginally "less safe" (for a whole bunch of obscure reasons) but allows
-   * us to kill and restart the program with ease */
-  int onoff = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &onoff, sizeof(onoff)) < 0) {
-    perror("setsockopt");
-    exit(1);
-  }
+/* called by the core when a connection has output queued. we try to send it
+ * right away; if the socket can't take it all, we ask poll() to tell us when
+ * there's room for more */
+void yc_backend_flush(yc_conn_t *c) {
+  int want = yc_conn_write(c);
+  if (want == YC_IO_CLOSED)
+    return;
 
-  /* set up the address structure for binding, which is *:<port> */
-  struct sockaddr_in sin = {
-    .sin_family = AF_INET,
-    .sin_port   = htons(port),
-    .sin_addr   = {
-      .s_addr = htonl(INADDR_ANY)
-    }
-  };
+  short in = (c->ycc_flags & YCC_PAUSED) ? 0 : POLLIN;
+  pollfds[c->ycc_fd].events = want == YC_IO_AGAIN ? in | POLLOUT : in;
+}
+
+/* called by the core to stop or start reading from a connection. we just
+ * stop asking about input; it'll wait in the socket */
+void yc_backend_pause(yc_conn_t *c, int paused) {
+  if (paused)
+    pollfds[c->ycc_fd].events &= ~POLLIN;
+  else
+    pollfds[c->ycc_fd].events |= POLLIN;
+}
+
+/* called by the core when a connection is going away */
+void yc_backend_close(yc_conn_t *c) {
+  /* setting -1 fd disables */
+  pollfds[c->ycc_fd].fd = -1;
+  close(c->ycc_fd);
+  yc_conn_free(c);
+}
 
-  /* bind the server socket to the wanted address */
-  if (bind(server_fd, (struct sockaddr *) &sin, sizeof(sin)) < 0) {
-    perror("bind");
+/* called by the core with a batch of the message log to write. poll() can't
+ * tell us when a file is ready (files are always "ready", and then block),
+ * so the store's writer thread does it */
+void yc_backend_store_write(struct yc_store_batch *b) {
+  yc_store_thread_write(b);
+}
+
+
+int main(int argc, char **argv) {
+  /* the core handles the commandline and sets up the listening socket for
+   * us */
+  int server_fd = yc_core_init(argc, argv, 0);
+
+  /* make the server socket non-blocking too, so we can accept everyone
+   * that's waiting each time it becomes readable, and know when to stop */
+  if (yc_set_nonblock(server_fd) < 0) {
+    perror("ioctl");
     exit(1);
   }
 
-  /* and open it for connections! */
-  if (listen(server_fd, 10) < 0) {
-    perror("listen");
+  /* create our pollfd array. the server socket might be past the end of
+   * the connection table, so make sure there's room for it too */
+  int size = yc_max_fds > server_fd ? yc_max_fds : server_fd+1;
+  pollfds = malloc(size * sizeof(struct pollfd));
+  if (!pollfds) {
+    perror("malloc");
     exit(1);
   }
-
-  printf("listening on port %d\n", port);
-
-  /* create an array of pollfd structs. each one carries a file descriptor, a
-   * set of wanted events, and after the poll() call, a set of events that
-   * occurred. for our own convenience we keep a static list and use the file
-   * descriptor as the index. */
-  struct pollfd pollfds[NUM_POLLFDS];
-  for (int fd = 0; fd < NUM_POLLFDS; fd++) {
+  for (int fd = 0; fd < size; fd++) {
     /* setting -1 fd disables */
     pollfds[fd].fd = -1;
   }
@@ -79,93 +87,67 @@ int main(int argc, char **argv) {
   /* add the server socket, and request read/input events */
   pollfds[server_fd].fd     = server_fd;
   pollfds[server_fd].events = POLLIN;
+  npollfds = server_fd+1;
 
   /* wait forever for something to happen */
-  while (poll(pollfds, NUM_POLLFDS, -1) >= 0) {
+  for (;;) {
+    if (poll(pollfds, npollfds, yc_core_timeout()) < 0) {
+      /* a signal arrived; nothing's wrong */
+      if (errno == EINTR)
+        continue;
+      break;
+    }
 
     /* if the server socket has activity, someone connected */
     if (pollfds[server_fd].revents & POLLIN) {
-      /* create storage for their address */
-      struct sockaddr_in sin;
-      socklen_t sinlen = sizeof(sin);
-
-      /* let them in! */
-      int new_fd = accept(server_fd, (struct sockaddr *) &sin, &sinlen);
-      if (new_fd < 0) {
-        perror("accept");
-      }
-      else {
-        /* hello */
-        printf("[%d] connect from %s:%d\n", new_fd, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-
-        /* make them non-blocking. this is necessary, because a disconnect will
-         * cause a descriptor to become readable, but reading will block
-         * forever (because they're disconnected. non-blocking will cause
-         * read() to return 0 on a disconnected descriptor, so we can take the
-         * right action */
-        int onoff = 1;
-        if (ioctl(new_fd, FIONBIO, &onoff) < 0) {
-          printf("fcntl(%d): %s\n", new_fd, strerror(errno));
-          close(new_fd);
-          continue;
-        }
-
+      /* let them all in; the core will set them up for us */
+      yc_conn_t *c;
+      while ((c = yc_conn_accept(server_fd))) {
         /* enable the pollfd for this fd, and request read events */
-        pollfds[new_fd].fd     = new_fd;
-        pollfds[new_fd].events = POLLIN;
+        pollfds[c->ycc_fd].fd      = c->ycc_fd;
+        pollfds[c->ycc_fd].events  = POLLIN;
+        pollfds[c->ycc_fd].revents = 0;
+        if (c->ycc_fd >= npollfds)
+          npollfds = c->ycc_fd+1;
       }
     }
 
-    for (int fd = 0; fd < NUM_POLLFDS; fd++) {
-      if (!(pollfds[fd].revents & POLLIN) || fd == server_fd)
+    for (int fd = 0; fd < npollfds; fd++) {
+      short revents = pollfds[fd].revents;
+      if (!revents || fd == server_fd)
         continue;
 
-      printf("[%d] activity\n", fd);
+      yc_conn_t *c = yc_conn_get(fd);
+      if (!c)
+        continue;
 
-      /* create a buffer to read into */
-      char buf[1024];
-      int nread = read(fd, buf, sizeof(buf));
+      /* can they take more output? send it */
+      if (revents & POLLOUT)
+        yc_conn_writable(c);
 
-      /* see how much we read */
-      if (nread < 0) {
-        /* less then zero is some error. disconnect them */
-        fprintf(stderr, "read(%d): %s\n", fd, strerror(errno));
-        close(fd);
-        pollfds[fd].fd = -1;
-      }
+      if (!(c = yc_conn_get(fd)))
+        continue;
 
-      else if (nread > 0) {
-        /* we got some stuff from them! */
-        printf("[%d] read: %.*s\n", fd, nread, buf);
-
-        /* loop over all our connections, and send stuff onto them! */
-        for (int dest_fd = 0; dest_fd < NUM_POLLFDS; dest_fd++) {
-
-          /* take active connections, but not ourselves */
-          if (pollfds[dest_fd].fd >= 0 && pollfds[dest_fd].fd != fd && pollfds[dest_fd].fd != server_fd) {
-            /* write to them */
-            if (write(dest_fd, buf, nread) < 0) {
-              /* disconnect if it fails; they might have legitimately gone away without telling us */
-              fprintf(stderr, "write(%d): %s\n", dest_fd, strerror(errno));
-              close(dest_fd);
-              pollfds[dest_fd].fd = -1;
-            }
-          }
-        }
+      /* poll tells us about hangups and errors even when we didn't ask for
+       * input, as we don't while they're paused. we can't read to find out
+       * which it is, but they're gone either way */
+      if (c->ycc_flags & YCC_PAUSED) {
+        if (revents & (POLLHUP | POLLERR))
+          yc_conn_close(c);
       }
 
-      /* zero byes read */
-      else {
-        /* so they gracefully disconnected and we should forget them */
-        printf("[%d] closed\n", fd);
-        close(fd);
-        pollfds[fd].fd = -1;
-      }
+      /* data (or a hangup, or an error, which read() will tell us about).
+       * the core will read it and decide what to do with it */
+      else if (revents & (POLLIN | POLLHUP | POLLERR))
+        yc_conn_read(c);
     }
+
+    /* send anything that was queued up while we were processing */
+    yc_core_tick();
   }
 
   /* poll failed. in a real server you might actually need to handle
-   * non-error cases like EINTR, but it complicates this example so we won't
+   * more non-error cases, but it complicates this example so we won't
    * bother */
   perror("poll");
   exit(1);
@@ -0,0 +1,124 @@
+/* yc_presence - join and quit notices for yoctochat servers */
+
+/* Names are written straight into a list for each kind of event as they
+ * happen, so sending a summary is just gluing the two together. Each list
+ * has room for exactly as many names as a summary will show, so nothing
+ * here allocates once it's set up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "yc_presence.h"
+#include "yc_intern.h"
+
+typedef struct {
+  char *ycpl_names;   /* " name name name" */
+  int   ycpl_len;
+  int   ycpl_count;   /* how many happened, listed or not */
+} yc_presence_list_t;
+
+static int yc_presence_window;
+static int yc_presence_max;
+
+static yc_presence_list_t yc_presence_joined;
+static yc_presence_list_t yc_presence_left;
+
+/* when the waiting summary is due (monotonic ms), or 0 if there isn't one */
+static uint64_t yc_presence_due;
+
+
+static uint64_t yc_presence_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the longest a listed name can be: " [fd]" or " nick" */
+#define YC_PRESENCE_NAME_MAX (YC_NAME_MAX + 16)
+
+static void yc_presence_list_init(yc_presence_list_t *l) {
+  l->ycpl_names = malloc(yc_presence_max * YC_PRESENCE_NAME_MAX + 1);
+  if (!l->ycpl_names) {
+    perror("malloc");
+    exit(1);
+  }
+}
+
+void yc_presence_init(int window, int max) {
+  yc_presence_window = window;
+  yc_presence_max    = max;
+  yc_presence_list_init(&yc_presence_joined);
+  yc_presence_list_init(&yc_presence_left);
+}
+
+static void yc_presence_add(yc_presence_list_t *l, yc_conn_t *c) {
+  if (!yc_presence_window)
+    return;
+
+  if (l->ycpl_count++ < yc_presence_max) {
+    char *out = l->ycpl_names + l->ycpl_len;
+    if (c->ycc_nick)
+      l->ycpl_len += sprintf(out, " %s", c->ycc_nick->ycn_str);
+    else
+      l->ycpl_len += sprintf(out, " [%d]", c->ycc_fd);
+  }
+
+  /* first one since the last summary starts the clock */
+  if (!yc_presence_due)
+    yc_presence_due = yc_presence_now() + yc_presence_window;
+}
+
+void yc_presence_join(yc_conn_t *c) {
+  yc_presence_add(&yc_presence_joined, c);
+}
+
+void yc_presence_quit(yc_conn_t *c) {
+  yc_presence_add(&yc_presence_left, c);
+}
+
+int yc_presence_timeout(void) {
+  if (!yc_presence_due)
+    return -1;
+  uint64_t now = yc_presence_now();
+  return now >= yc_presence_due ? 0 : (int) (yc_presence_due - now);
+}
+
+/* write one list into out, eg "joined: [5] [6] and 3 others". returns the
+ * length */
+static int yc_presence_format(char *out, const char *what, const yc_presence_list_t *l) {
+  int len = sprintf(out, "%s:%.*s", what, l->ycpl_len, l->ycpl_names);
+  if (l->ycpl_count > yc_presence_max)
+    len += sprintf(out + len, " and %d other%s", l->ycpl_count - yc_presence_max,
+      l->ycpl_count - yc_presence_max == 1 ? "" : "s");
+  return len;
+}
+
+void yc_presence_tick(void) {
+  if (!yc_presence_due || yc_presence_now() < yc_presence_due)
+    return;
+
+  /* both lists, the words around them and the newline */
+  yc_buf_t *b = yc_buf_new(yc_presence_joined.ycpl_len + yc_presence_left.ycpl_len + 128);
+  char *out = b->ycb_data;
+  out += sprintf(out, "* ");
+  if (yc_presence_joined.ycpl_count)
+    out += yc_presence_format(out, "joined", &yc_presence_joined);
+  if (yc_presence_joined.ycpl_count && yc_presence_left.ycpl_count)
+    out += sprintf(out, "; ");
+  if (yc_presence_left.ycpl_count)
+    out += yc_presence_format(out, "left", &yc_presence_left);
+  *out++ = '\n';
+  b->ycb_len = out - b->ycb_data;
+
+  /* start again before sending, since sending can disconnect someone, and
+   * that goes in the next summary */
+  yc_presence_joined.ycpl_len = yc_presence_joined.ycpl_count = 0;
+  yc_presence_left.ycpl_len   = yc_presence_left.ycpl_count   = 0;
+  yc_presence_due = 0;
+
+  yc_conn_send_all(b);
+  yc_buf_unref(b);
+}
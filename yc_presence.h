@@ -0,0 +1,40 @@
+/* yc_presence - join and quit notices for yoctochat servers */
+
+/* When someone connects or disconnects, everyone else is told. Done naively
+ * that's one message to every connection for every connect, so when a
+ * server restarts and fifty thousand clients reconnect at once, it would
+ * have to send fifty thousand squared notices, and do nothing else for a
+ * long time.
+ *
+ * So notices are batched. The first connect or disconnect starts a window
+ * (-o presence=N milliseconds, default 50), and everything that happens
+ * before it closes goes out together as one line:
+ *
+ *   * joined: [5] [6] [7] and 120 others; left: alice
+ *
+ * Only the first few names of each are listed (-o presencemax=N, default
+ * 32), and the rest are just counted, so a summary never gets longer than
+ * that however many arrive. That makes the cost at most one message per
+ * connection per window, whatever's going on.
+ */
+
+#ifndef YC_PRESENCE_H
+#define YC_PRESENCE_H
+
+#include "yc_core.h"
+
+/* set up. window is in milliseconds; 0 turns notices off. max is how many
+ * names of each kind a summary lists */
+void yc_presence_init(int window, int max);
+
+/* a connection arrived, or is leaving */
+void yc_presence_join(yc_conn_t *c);
+void yc_presence_quit(yc_conn_t *c);
+
+/* milliseconds until the waiting summary is due, or -1 if there isn't one */
+int yc_presence_timeout(void);
+
+/* send the waiting summary, if it's due */
+void yc_presence_tick(void);
+
+#endif
@@ -0,0 +1,392 @@
+/* yc_room - chat rooms for yoctochat servers */
+
+/* Rooms are found by name through a hash table keyed on the interned name.
+ * Since there's only one copy of each name, the table can compare pointers
+ * rather than strings, and use the hash the name already has. It's the
+ * same open addressing scheme as the intern table (see yc_intern.c).
+ *
+ * A room is made when the first person joins it, and thrown away when the
+ * last person leaves, except for the lobby, which is always there.
+ *
+ * Asking who's in a room is common (clients do it every time they
+ * connect), and a busy room's answer is long. So the answer is made once,
+ * into a buffer that's shared by everyone who asks, and only made again
+ * after someone joins, leaves or changes their name.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yc_room.h"
+
+static yc_room_t **yc_rooms;
+static size_t      yc_rooms_cap;
+static size_t      yc_rooms_len;
+
+static yc_room_t  *yc_lobby;
+
+/* how many messages each room remembers */
+static int         yc_room_history;
+
+/* the parts of a history replay, reused every time */
+static yc_qent_t  *yc_replay;
+static int         yc_replay_cap;
+
+
+static size_t yc_room_slot(const yc_name_t *name) {
+  size_t mask = yc_rooms_cap - 1;
+  for (size_t i = name->ycn_hash & mask; ; i = (i+1) & mask)
+    if (!yc_rooms[i] || yc_rooms[i]->ycrm_name == name)
+      return i;
+}
+
+static void yc_rooms_grow(void) {
+  size_t ocap = yc_rooms_cap;
+  yc_room_t **orooms = yc_rooms;
+
+  yc_rooms_cap = ocap ? ocap * 2 : 64;
+  yc_rooms = calloc(yc_rooms_cap, sizeof(yc_room_t *));
+  if (!yc_rooms) {
+    perror("calloc");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < ocap; i++)
+    if (orooms[i])
+      yc_rooms[yc_room_slot(orooms[i]->ycrm_name)] = orooms[i];
+  free(orooms);
+}
+
+static yc_room_t *yc_room_new(const char *name, size_t len) {
+  if ((yc_rooms_len+1) * 2 > yc_rooms_cap)
+    yc_rooms_grow();
+
+  yc_room_t *r = calloc(1, sizeof(yc_room_t));
+  if (!r) {
+    perror("calloc");
+    exit(1);
+  }
+  r->ycrm_name = yc_name_intern(name, len);
+
+  yc_rooms[yc_room_slot(r->ycrm_name)] = r;
+  yc_rooms_len++;
+
+  return r;
+}
+
+/* throw away the /who reply; it's out of date */
+static void yc_room_who_invalidate(yc_room_t *r) {
+  if (!r->ycrm_who)
+    return;
+  yc_buf_unref(r->ycrm_who);
+  yc_buf_unref(r->ycrm_who_hdr);
+  r->ycrm_who = r->ycrm_who_hdr = NULL;
+}
+
+static void yc_room_free(yc_room_t *r) {
+  /* take it out of the table, then close the gap the same way the intern
+   * table does */
+  size_t mask = yc_rooms_cap - 1;
+  size_t hole = yc_room_slot(r->ycrm_name);
+  yc_rooms[hole] = NULL;
+  yc_rooms_len--;
+
+  for (size_t i = (hole+1) & mask; yc_rooms[i]; i = (i+1) & mask) {
+    size_t want = yc_rooms[i]->ycrm_name->ycn_hash & mask;
+    if (((i - want) & mask) >= ((i - hole) & mask)) {
+      yc_rooms[hole] = yc_rooms[i];
+      yc_rooms[i] = NULL;
+      hole = i;
+    }
+  }
+
+  yc_room_who_invalidate(r);
+  for (int i = 0; i < r->ycrm_hist_len; i++) {
+    yc_hist_t *h = &r->ycrm_hist[(r->ycrm_hist_head + i) % yc_room_history];
+    if (h->ych_prefix)
+      yc_buf_unref(h->ych_prefix);
+    yc_buf_unref(h->ych_buf);
+  }
+  free(r->ycrm_hist);
+  yc_name_unref(r->ycrm_name);
+  free(r->ycrm_members);
+  free(r);
+}
+
+void yc_room_init(int history) {
+  yc_room_history = history > 0 ? history : 0;
+  yc_lobby = yc_room_new(YC_ROOM_LOBBY, strlen(YC_ROOM_LOBBY));
+}
+
+yc_room_t *yc_room_find(const char *name, size_t len) {
+  yc_name_t *n = yc_name_find(name, len);
+  if (!n || !yc_rooms_len)
+    return NULL;
+  return yc_rooms[yc_room_slot(n)];
+}
+
+int yc_room_is_member(yc_conn_t *c, yc_room_t *r) {
+  for (int i = 0; i < c->ycc_nrooms; i++)
+    if (c->ycc_rooms[i].ycms_room == r)
+      return 1;
+  return 0;
+}
+
+void yc_room_history_add(yc_room_t *r, yc_buf_t *prefix, yc_buf_t *buf, size_t off, size_t len) {
+  if (!yc_room_history)
+    return;
+
+  if (!r->ycrm_hist) {
+    r->ycrm_hist = malloc(yc_room_history * sizeof(yc_hist_t));
+    if (!r->ycrm_hist) {
+      perror("malloc");
+      exit(1);
+    }
+  }
+
+  /* full? the oldest one makes way */
+  yc_hist_t *h;
+  if (r->ycrm_hist_len == yc_room_history) {
+    h = &r->ycrm_hist[r->ycrm_hist_head];
+    r->ycrm_hist_head = (r->ycrm_hist_head + 1) % yc_room_history;
+    if (h->ych_prefix)
+      yc_buf_unref(h->ych_prefix);
+    yc_buf_unref(h->ych_buf);
+  }
+  else
+    h = &r->ycrm_hist[(r->ycrm_hist_head + r->ycrm_hist_len++) % yc_room_history];
+
+  *h = (yc_hist_t) {
+    .ych_prefix = prefix ? yc_buf_ref(prefix) : NULL,
+    .ych_buf    = yc_buf_ref(buf),
+    .ych_off    = off,
+    .ych_len    = len,
+  };
+}
+
+/* add a part to the replay, joining it onto the last one if it carries on
+ * from it (messages that arrived together are next to each other) */
+static int yc_replay_add(int n, yc_buf_t *b, size_t off, size_t end) {
+  if (n > 0 && yc_replay[n-1].ycq_buf == b && yc_replay[n-1].ycq_end == off) {
+    yc_replay[n-1].ycq_end = end;
+    return n;
+  }
+  yc_replay[n] = (yc_qent_t) { .ycq_buf = b, .ycq_off = off, .ycq_end = end };
+  return n+1;
+}
+
+/* send the history to someone who just arrived. it all goes in as one
+ * message, so it's written out together */
+static void yc_room_history_send(yc_conn_t *c, yc_room_t *r) {
+  if (!r->ycrm_hist_len)
+    return;
+
+  /* at most three parts a message: frame header, prefix, line */
+  if (yc_replay_cap < yc_room_history * 3) {
+    yc_replay_cap = yc_room_history * 3;
+    yc_replay = realloc(yc_replay, yc_replay_cap * sizeof(yc_qent_t));
+    if (!yc_replay) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  /* binary clients need a frame header for each message; they can all go
+   * in one buffer */
+  yc_buf_t *hbuf = NULL;
+  size_t hoff = 0;
+  if (c->ycc_proto == YC_PROTO_BINARY)
+    hbuf = yc_buf_new(r->ycrm_hist_len * YC_FRAME_HDR_MAX);
+
+  int n = 0;
+  for (int i = 0; i < r->ycrm_hist_len; i++) {
+    yc_hist_t *h = &r->ycrm_hist[(r->ycrm_hist_head + i) % yc_room_history];
+    size_t plen = h->ych_prefix ? h->ych_prefix->ycb_len : 0;
+
+    if (hbuf) {
+      size_t start = hoff;
+      hoff += yc_frame_hdr_put(hbuf->ycb_data + hoff, plen + h->ych_len, YC_FRAME_TEXT);
+      n = yc_replay_add(n, hbuf, start, hoff);
+    }
+    if (plen)
+      n = yc_replay_add(n, h->ych_prefix, 0, plen);
+    n = yc_replay_add(n, h->ych_buf, h->ych_off, h->ych_off + h->ych_len + (hbuf ? 0 : 1));
+  }
+
+  yc_conn_sendv(c, yc_replay, n);
+
+  if (hbuf)
+    yc_buf_unref(hbuf);
+}
+
+yc_room_t *yc_room_join(yc_conn_t *c, const char *name, size_t len) {
+  yc_room_t *r = yc_room_find(name, len);
+
+  /* already in it? then just switch to it */
+  if (r && yc_room_is_member(c, r)) {
+    c->ycc_room = r;
+    return r;
+  }
+
+  if (c->ycc_nrooms == YC_ROOMS_MAX)
+    return NULL;
+
+  if (!r)
+    r = yc_room_new(name, len);
+
+  /* make room on both sides. this is the only place membership allocates,
+   * and it only does so when an array is full, so it settles down quickly */
+  if (c->ycc_nrooms == c->ycc_rooms_cap) {
+    int cap = c->ycc_rooms_cap ? c->ycc_rooms_cap * 2 : 4;
+    c->ycc_rooms = realloc(c->ycc_rooms, cap * sizeof(yc_membership_t));
+    if (!c->ycc_rooms) {
+      perror("realloc");
+      exit(1);
+    }
+    c->ycc_rooms_cap = cap;
+  }
+  if (r->ycrm_nmembers == r->ycrm_cap) {
+    int cap = r->ycrm_cap ? r->ycrm_cap * 2 : 8;
+    r->ycrm_members = realloc(r->ycrm_members, cap * sizeof(yc_member_t));
+    if (!r->ycrm_members) {
+      perror("realloc");
+      exit(1);
+    }
+    r->ycrm_cap = cap;
+  }
+
+  int slot = c->ycc_nrooms++;
+  int pos  = r->ycrm_nmembers++;
+  c->ycc_rooms[slot] = (yc_membership_t) { .ycms_room = r, .ycms_pos = pos };
+  r->ycrm_members[pos] = (yc_member_t) { .ycrm_conn = c, .ycrm_slot = slot };
+  r->ycrm_nproto[c->ycc_proto]++;
+  yc_room_who_invalidate(r);
+
+  c->ycc_room = r;
+
+  /* before their first byte we don't know if they want text or binary, so
+   * the history waits for yc_room_hello() */
+  if (c->ycc_flags & YCC_HELLO)
+    yc_room_history_send(c, r);
+  return r;
+}
+
+/* remove membership slot from a connection. both arrays are swap-remove:
+ * the last entry moves into the hole, and whatever pointed at it is
+ * updated */
+static void yc_room_remove(yc_conn_t *c, int slot) {
+  yc_room_t *r = c->ycc_rooms[slot].ycms_room;
+  int pos = c->ycc_rooms[slot].ycms_pos;
+
+  /* out of the room's member array */
+  yc_member_t *last = &r->ycrm_members[--r->ycrm_nmembers];
+  if (pos != r->ycrm_nmembers) {
+    r->ycrm_members[pos] = *last;
+    last->ycrm_conn->ycc_rooms[last->ycrm_slot].ycms_pos = pos;
+  }
+  r->ycrm_nproto[c->ycc_proto]--;
+  yc_room_who_invalidate(r);
+
+  /* out of the connection's membership array */
+  yc_membership_t *mlast = &c->ycc_rooms[--c->ycc_nrooms];
+  if (slot != c->ycc_nrooms) {
+    c->ycc_rooms[slot] = *mlast;
+    mlast->ycms_room->ycrm_members[mlast->ycms_pos].ycrm_slot = slot;
+  }
+
+  if (r->ycrm_nmembers == 0 && r != yc_lobby)
+    yc_room_free(r);
+}
+
+void yc_room_part(yc_conn_t *c, yc_room_t *r) {
+  for (int i = 0; i < c->ycc_nrooms; i++) {
+    if (c->ycc_rooms[i].ycms_room != r)
+      continue;
+
+    yc_room_remove(c, i);
+
+    /* if that's where they were talking, move them to one of the others
+     * they're still in */
+    if (c->ycc_room == r)
+      c->ycc_room = c->ycc_nrooms ? c->ycc_rooms[c->ycc_nrooms-1].ycms_room : NULL;
+    return;
+  }
+}
+
+void yc_room_part_all(yc_conn_t *c) {
+  while (c->ycc_nrooms > 0)
+    yc_room_remove(c, c->ycc_nrooms-1);
+  c->ycc_room = NULL;
+
+  free(c->ycc_rooms);
+  c->ycc_rooms = NULL;
+  c->ycc_rooms_cap = 0;
+}
+
+void yc_room_proto_changed(yc_conn_t *c, int from, int to) {
+  for (int i = 0; i < c->ycc_nrooms; i++) {
+    c->ycc_rooms[i].ycms_room->ycrm_nproto[from]--;
+    c->ycc_rooms[i].ycms_room->ycrm_nproto[to]++;
+  }
+}
+
+void yc_room_hello(yc_conn_t *c) {
+  for (int i = 0; i < c->ycc_nrooms; i++)
+    yc_room_history_send(c, c->ycc_rooms[i].ycms_room);
+}
+
+void yc_room_member_changed(yc_conn_t *c) {
+  for (int i = 0; i < c->ycc_nrooms; i++)
+    yc_room_who_invalidate(c->ycc_rooms[i].ycms_room);
+}
+
+/* write a member's name for /who into out, which has room for at least
+ * YC_NAME_MAX+1 bytes. returns the length */
+static size_t yc_room_member_name(yc_conn_t *c, char *out) {
+  if (c->ycc_nick) {
+    memcpy(out, c->ycc_nick->ycn_str, c->ycc_nick->ycn_len);
+    return c->ycc_nick->ycn_len;
+  }
+  return sprintf(out, "[%d]", c->ycc_fd);
+}
+
+static void yc_room_who_build(yc_room_t *r) {
+  char head[YC_NAME_MAX + 64];
+  size_t hlen = snprintf(head, sizeof(head), "* %s (%d):",
+    r->ycrm_name->ycn_str, r->ycrm_nmembers);
+
+  /* every name fits in YC_NAME_MAX+1, plus a space before it, and there's a
+   * newline on the end */
+  yc_buf_t *b = yc_buf_new(hlen + r->ycrm_nmembers * (YC_NAME_MAX + 2) + 1);
+  char *out = b->ycb_data;
+  memcpy(out, head, hlen);
+  out += hlen;
+  for (int i = 0; i < r->ycrm_nmembers; i++) {
+    *out++ = ' ';
+    out += yc_room_member_name(r->ycrm_members[i].ycrm_conn, out);
+  }
+  *out++ = '\n';
+  b->ycb_len = out - b->ycb_data;
+
+  yc_buf_t *h = yc_buf_new(YC_FRAME_HDR_MAX);
+  h->ycb_len = yc_frame_hdr_put(h->ycb_data, b->ycb_len - 1, YC_FRAME_TEXT);
+
+  r->ycrm_who     = b;
+  r->ycrm_who_hdr = h;
+}
+
+void yc_room_who(yc_conn_t *c, yc_room_t *r) {
+  if (!r->ycrm_who)
+    yc_room_who_build(r);
+
+  if (c->ycc_proto == YC_PROTO_BINARY) {
+    yc_qent_t parts[2] = {
+      { .ycq_buf = r->ycrm_who_hdr, .ycq_off = 0, .ycq_end = r->ycrm_who_hdr->ycb_len },
+      { .ycq_buf = r->ycrm_who,     .ycq_off = 0, .ycq_end = r->ycrm_who->ycb_len - 1 },
+    };
+    yc_conn_sendv(c, parts, 2);
+  }
+  else
+    yc_conn_send(c, r->ycrm_who);
+}
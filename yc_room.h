@@ -0,0 +1,119 @@
+/* yc_room - chat rooms for yoctochat servers */
+
+/* A room is a set of connections that hear each other. Each connection can
+ * be in a few rooms at once, and has a current room, which is where the
+ * lines it sends go. Everyone starts out in the lobby.
+ *
+ * Sending a message to a room should cost one step per member, not one per
+ * connection on the server, so each room keeps its members packed into an
+ * array, like the core's active list. Membership goes both ways: the room
+ * knows where each member's entry for it is, and each member knows where
+ * it is in the room's array, so joining and leaving are O(1) either side.
+ *
+ * Each room also remembers its last few messages (-o history=N, default 20),
+ * and sends them to anyone who joins, so they can see what's going on. The
+ * history holds references to the same buffers the messages were sent from,
+ * so keeping it costs no copying, and it's all sent as one batch of output,
+ * so it goes out in a single writev() rather than one write per message.
+ */
+
+#ifndef YC_ROOM_H
+#define YC_ROOM_H
+
+#include "yc_core.h"
+#include "yc_intern.h"
+
+/* most rooms a connection can be in at once */
+#define YC_ROOMS_MAX (32)
+
+/* name of the room everyone starts in */
+#define YC_ROOM_LOBBY "lobby"
+
+/* a member of a room: which connection, and which of its memberships is
+ * this one */
+typedef struct {
+  yc_conn_t *ycrm_conn;
+  int        ycrm_slot;
+} yc_member_t;
+
+/* a message in a room's history: the line (without its newline, which is
+ * right after it) and the sender prefix, if there was one */
+typedef struct {
+  yc_buf_t *ych_prefix;
+  yc_buf_t *ych_buf;
+  size_t    ych_off;
+  size_t    ych_len;
+} yc_hist_t;
+
+typedef struct yc_room {
+  yc_name_t   *ycrm_name;
+
+  yc_member_t *ycrm_members;
+  int          ycrm_nmembers;
+  int          ycrm_cap;
+
+  /* how many members speak each protocol */
+  int          ycrm_nproto[YC_PROTO_NUM];
+
+  /* the /who reply, made when someone asks and kept until the members
+   * change. the text version is a line; the binary version is a frame
+   * header followed by the same line without its newline */
+  yc_buf_t    *ycrm_who;
+  yc_buf_t    *ycrm_who_hdr;
+
+  /* the last few messages, oldest first from ycrm_hist_head. the array is
+   * made when the first message arrives */
+  yc_hist_t   *ycrm_hist;
+  int          ycrm_hist_head;
+  int          ycrm_hist_len;
+} yc_room_t;
+
+/* a connection's membership of a room: which room, and where it is in that
+ * room's member array */
+typedef struct yc_membership {
+  yc_room_t *ycms_room;
+  int        ycms_pos;
+} yc_membership_t;
+
+
+/* set up the lobby. each room remembers its last history messages */
+void yc_room_init(int history);
+
+/* find a room by name, or NULL if it doesn't exist */
+yc_room_t *yc_room_find(const char *name, size_t len);
+
+/* join a room, making it if it doesn't exist yet, and make it the current
+ * room. if they weren't already in it, they're sent its history (or once
+ * they've said which protocol they want, if they haven't yet). returns the
+ * room, or NULL if they're in too many already */
+yc_room_t *yc_room_join(yc_conn_t *c, const char *name, size_t len);
+
+/* leave a room. if it was the current room, another one they're in becomes
+ * current (or none, if that was the last) */
+void yc_room_part(yc_conn_t *c, yc_room_t *r);
+
+/* leave every room, on the way out */
+void yc_room_part_all(yc_conn_t *c);
+
+/* the connection changed protocol; fix up the counts */
+void yc_room_proto_changed(yc_conn_t *c, int from, int to);
+
+/* the connection's first byte has arrived, so we know how to talk to it.
+ * send it the history it joined before then */
+void yc_room_hello(yc_conn_t *c);
+
+/* is the connection in this room? */
+int yc_room_is_member(yc_conn_t *c, yc_room_t *r);
+
+/* remember a message in the room's history. the line is buf[off, off+len),
+ * with a newline after it. prefix is the sender prefix, or NULL. takes new
+ * references */
+void yc_room_history_add(yc_room_t *r, yc_buf_t *prefix, yc_buf_t *buf, size_t off, size_t len);
+
+/* send the list of who's in the room */
+void yc_room_who(yc_conn_t *c, yc_room_t *r);
+
+/* something about the connection that /who shows (its nickname) changed */
+void yc_room_member_changed(yc_conn_t *c);
+
+#endif
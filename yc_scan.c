@@ -0,0 +1,73 @@
+/* yc_scan - fast byte searching for yoctochat servers */
+
+/* See yc_scan.h. We never read past end, even though it'd be faster to do a
+ * whole vector at a time and ignore the extra: end might be the last byte of
+ * a page, and the next page might not be mapped. So the vector loops only
+ * run while there's a whole vector left, and a plain loop does the rest. */
+
+#include <string.h>
+
+#include "yc_scan.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+#include <immintrin.h>
+
+/* set at startup if the CPU can do AVX2 */
+static int yc_scan_avx2;
+
+void yc_scan_init(void) {
+  __builtin_cpu_init();
+  yc_scan_avx2 = __builtin_cpu_supports("avx2");
+}
+
+static const char *yc_scan_tail(const char *p, const char *end) {
+  for (; p < end; p++)
+    if (*p == '\n')
+      return p;
+  return NULL;
+}
+
+static const char *yc_scan_nl_sse2(const char *p, const char *end) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return yc_scan_tail(p, end);
+}
+
+/* compiled for AVX2 regardless of what the rest of the program is built
+ * for; only called if the CPU has it */
+__attribute__((target("avx2")))
+static const char *yc_scan_nl_avx2(const char *p, const char *end) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+
+  /* fewer than 32 left; SSE2 can still take a bite out of it */
+  return yc_scan_nl_sse2(p, end);
+}
+
+const char *yc_scan_nl(const char *p, const char *end) {
+  /* a plain branch rather than a function pointer; it goes the same way
+   * every time, so it's free */
+  return yc_scan_avx2 ? yc_scan_nl_avx2(p, end) : yc_scan_nl_sse2(p, end);
+}
+
+#else
+
+void yc_scan_init(void) {
+}
+
+const char *yc_scan_nl(const char *p, const char *end) {
+  return memchr(p, '\n', end - p);
+}
+
+#endif
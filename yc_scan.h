@@ -0,0 +1,23 @@
+/* yc_scan - fast byte searching for yoctochat servers */
+
+/* Finding the end of each line is the one thing the server does to every
+ * byte it receives. A plain loop looks at one byte at a time; with SIMD we
+ * can compare 16 (SSE2) or 32 (AVX2) bytes against '\n' in one instruction,
+ * and turn the result into a bitmask whose lowest set bit is the first
+ * match.
+ *
+ * SSE2 is part of x86-64 so it's always there. AVX2 isn't, so we check the
+ * CPU once at startup and pick. Everywhere else, memchr() is usually a good
+ * vectorised implementation already.
+ */
+
+#ifndef YC_SCAN_H
+#define YC_SCAN_H
+
+/* check what the CPU can do. call once before yc_scan_nl() */
+void yc_scan_init(void);
+
+/* find the first '\n' in [p, end), or return NULL */
+const char *yc_scan_nl(const char *p, const char *end);
+
+#endif
@@ -0,0 +1,605 @@
+/* yc_search - searching recent messages for yoctochat servers */
+
+/* The window is a ring of messages, each a copy of its text, indexed by
+ * sequence number modulo the window size. A message's own buffer might be
+ * a whole read's worth of input, so holding references to thousands of
+ * them could pin a lot of memory; a copy of just the message is cheaper.
+ * Each slot keeps its buffer for the next message that lands in it, so
+ * once the window is full nothing allocates unless messages get longer.
+ *
+ * Along with the text, a message keeps which words it has. When it falls
+ * out of the window, each of those words' lists is sure to start with it,
+ * so taking it out is just a pop each, with no splitting or hashing.
+ *
+ * Words live in a pool, chained into a hash table by index, so the table
+ * can grow without moving them. A slot that's freed goes on a free list and
+ * gets a new generation number when it's used again, so a search that was
+ * partway through the old word's list can tell.
+ *
+ * A search walks a cursor along each of its words' lists. The rarest word
+ * drives: each of its entries is a candidate, and the others are moved up
+ * to it; if one of them goes past it, that's the next candidate instead.
+ * Between loops, the window may have moved on. A cursor's position counts
+ * bytes from the start of everything its list has ever had, so it can tell
+ * when the front has been cut off under it, and start again at the new
+ * front, which is only ever further along.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "yc_search.h"
+
+/* longest word; longer ones are cut to this */
+#define YC_SEARCH_WORD_MAX (32)
+
+/* most words indexed in a message, and looked for in a query */
+#define YC_SEARCH_WORDS_MAX (64)
+#define YC_SEARCH_TERMS_MAX (8)
+
+/* most matches sent back; they're the newest ones */
+#define YC_SEARCH_RESULTS (20)
+
+/* list entries looked at each time around the loop, over all searches */
+#define YC_SEARCH_STEPS (4096)
+
+/* most of a query that's repeated back in the reply */
+#define YC_SEARCH_QUERY_MAX (64)
+
+typedef struct {
+  uint64_t  ycsm_seq;         /* 0 if the slot's empty */
+  uint32_t  ycsm_room;
+  uint32_t  ycsm_len;
+  int       ycsm_nwords;
+  size_t    ycsm_cap;
+
+  /* its words' indexes, then its text (prefix and line, no newline), in
+   * one allocation */
+  int32_t  *ycsm_words;
+} yc_search_msg_t;
+
+static inline char *yc_search_text(yc_search_msg_t *m) {
+  return (char *) (m->ycsm_words + YC_SEARCH_WORDS_MAX);
+}
+
+typedef struct {
+  uint32_t  ycsw_hash;
+  int32_t   ycsw_next;        /* next in the hash chain, or the free list */
+  uint32_t  ycsw_gen;
+  uint8_t   ycsw_len;
+  char      ycsw_str[YC_SEARCH_WORD_MAX];
+
+  /* the posting list: the first and last entries, and the gaps between
+   * them all in [ycsw_off, ycsw_end) of ycsw_gaps */
+  uint32_t  ycsw_count;
+  uint64_t  ycsw_first;
+  uint64_t  ycsw_last;
+  uint8_t  *ycsw_gaps;
+  size_t    ycsw_off;
+  size_t    ycsw_end;
+  size_t    ycsw_cap;
+  uint64_t  ycsw_dropped;     /* bytes ever taken off the front */
+} yc_search_word_t;
+
+/* where a search is in one word's list: the entry it's on, and where the
+ * gap to the next one is, counting from the first byte the list ever had */
+typedef struct {
+  int32_t   ycsc_word;
+  uint32_t  ycsc_gen;
+  uint64_t  ycsc_val;
+  uint64_t  ycsc_pos;
+} yc_search_cursor_t;
+
+typedef struct yc_search_job {
+  yc_conn_t          *ycsj_conn;
+  uint32_t            ycsj_room;
+  uint64_t            ycsj_until;   /* newest message when it started */
+  uint64_t            ycsj_cand;    /* nothing before this can match */
+  int                 ycsj_nterms;
+  yc_search_cursor_t  ycsj_terms[YC_SEARCH_TERMS_MAX];   /* rarest first */
+
+  /* the newest matches so far, in a ring, and how many there were */
+  uint64_t            ycsj_found[YC_SEARCH_RESULTS];
+  uint64_t            ycsj_nfound;
+
+  int                 ycsj_qlen;
+  char                ycsj_query[YC_SEARCH_QUERY_MAX];
+
+  struct yc_search_job *ycsj_next;
+} yc_search_job_t;
+
+int yc_search_on;
+
+static int              yc_search_window;
+static yc_search_msg_t *yc_search_msgs;
+static uint64_t         yc_search_seq = 1;    /* the next message's */
+
+static yc_search_word_t *yc_search_words;
+static int32_t           yc_search_nwords, yc_search_words_cap;
+static int32_t           yc_search_free = -1;
+static int32_t          *yc_search_buckets;
+static uint32_t          yc_search_nbuckets;
+static int32_t           yc_search_live;      /* words in use */
+
+static yc_search_job_t  *yc_search_jobs, **yc_search_jobs_tail = &yc_search_jobs;
+
+/* counters */
+static size_t   yc_search_list_bytes;
+static uint64_t yc_search_nsearches;
+static uint64_t yc_search_nsteps;
+
+
+void yc_search_init(int window) {
+  if (window <= 0)
+    return;
+
+  yc_search_window = window;
+  yc_search_msgs = calloc(window, sizeof(yc_search_msg_t));
+  yc_search_nbuckets = 1024;
+  yc_search_buckets = malloc(yc_search_nbuckets * sizeof(int32_t));
+  if (!yc_search_msgs || !yc_search_buckets) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(yc_search_buckets, 0xff, yc_search_nbuckets * sizeof(int32_t));
+
+  yc_search_on = 1;
+}
+
+/* pull the next word out of [*p, end), lowercased and cut to length, into
+ * out, and hash it (FNV-1a; words are short, so something simple is fine).
+ * returns its length, or 0 if there are no more */
+static size_t yc_search_word(const char **p, const char *end, char *out, uint32_t *hash) {
+  const unsigned char *s = (const unsigned char *) *p, *e = (const unsigned char *) end;
+
+  #define YC_SEARCH_IS_WORD(ch) \
+    (((ch) >= 'a' && (ch) <= 'z') || ((ch) >= 'A' && (ch) <= 'Z') || ((ch) >= '0' && (ch) <= '9') || (ch) >= 0x80)
+
+  while (s < e && !YC_SEARCH_IS_WORD(*s))
+    s++;
+
+  size_t len = 0;
+  uint32_t h = 2166136261u;
+  for (; s < e && YC_SEARCH_IS_WORD(*s); s++) {
+    if (len < YC_SEARCH_WORD_MAX) {
+      unsigned char ch = (*s >= 'A' && *s <= 'Z') ? *s + ('a' - 'A') : *s;
+      out[len++] = ch;
+      h = (h ^ ch) * 16777619u;
+    }
+  }
+  *hash = h;
+
+  #undef YC_SEARCH_IS_WORD
+
+  *p = (const char *) s;
+  return len;
+}
+
+static int32_t yc_search_find(const char *w, size_t len, uint32_t h) {
+  for (int32_t i = yc_search_buckets[h & (yc_search_nbuckets-1)]; i >= 0; i = yc_search_words[i].ycsw_next) {
+    yc_search_word_t *sw = &yc_search_words[i];
+    if (sw->ycsw_hash == h && sw->ycsw_len == len && memcmp(sw->ycsw_str, w, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/* double the hash table, and rechain every word */
+static void yc_search_rehash(void) {
+  uint32_t nbuckets = yc_search_nbuckets * 2;
+  int32_t *buckets = malloc(nbuckets * sizeof(int32_t));
+  if (!buckets) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(buckets, 0xff, nbuckets * sizeof(int32_t));
+
+  for (int32_t b = 0; b < (int32_t) yc_search_nbuckets; b++) {
+    for (int32_t i = yc_search_buckets[b], next; i >= 0; i = next) {
+      yc_search_word_t *sw = &yc_search_words[i];
+      next = sw->ycsw_next;
+      sw->ycsw_next = buckets[sw->ycsw_hash & (nbuckets-1)];
+      buckets[sw->ycsw_hash & (nbuckets-1)] = i;
+    }
+  }
+
+  free(yc_search_buckets);
+  yc_search_buckets  = buckets;
+  yc_search_nbuckets = nbuckets;
+}
+
+static int32_t yc_search_word_new(const char *w, size_t len, uint32_t h) {
+  if (yc_search_live >= (int32_t) yc_search_nbuckets)
+    yc_search_rehash();
+
+  int32_t i = yc_search_free;
+  if (i >= 0)
+    yc_search_free = yc_search_words[i].ycsw_next;
+  else {
+    if (yc_search_nwords == yc_search_words_cap) {
+      yc_search_words_cap = yc_search_words_cap ? yc_search_words_cap * 2 : 1024;
+      yc_search_words = realloc(yc_search_words, yc_search_words_cap * sizeof(yc_search_word_t));
+      if (!yc_search_words) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    i = yc_search_nwords++;
+    yc_search_words[i] = (yc_search_word_t) { 0 };
+  }
+
+  yc_search_word_t *sw = &yc_search_words[i];
+  sw->ycsw_hash = h;
+  sw->ycsw_len  = len;
+  memcpy(sw->ycsw_str, w, len);
+  sw->ycsw_gen++;
+
+  sw->ycsw_next = yc_search_buckets[h & (yc_search_nbuckets-1)];
+  yc_search_buckets[h & (yc_search_nbuckets-1)] = i;
+  yc_search_live++;
+  return i;
+}
+
+/* a word's list is empty; unchain it and put it on the free list. its gap
+ * buffer is kept for whoever gets the slot next */
+static void yc_search_word_free(int32_t i) {
+  yc_search_word_t *sw = &yc_search_words[i];
+  int32_t *pp = &yc_search_buckets[sw->ycsw_hash & (yc_search_nbuckets-1)];
+  while (*pp != i)
+    pp = &yc_search_words[*pp].ycsw_next;
+  *pp = sw->ycsw_next;
+
+  yc_search_list_bytes -= sw->ycsw_end - sw->ycsw_off;
+  sw->ycsw_off = sw->ycsw_end = 0;
+  sw->ycsw_dropped = 0;
+
+  sw->ycsw_next = yc_search_free;
+  yc_search_free = i;
+  yc_search_live--;
+}
+
+/* add seq to the end of a word's list */
+static void yc_search_post(yc_search_word_t *sw, uint64_t seq) {
+  if (!sw->ycsw_count) {
+    sw->ycsw_first = sw->ycsw_last = seq;
+    sw->ycsw_count = 1;
+    return;
+  }
+
+  /* room for the longest varint. if the front has been used up, move
+   * everything down before growing */
+  if (sw->ycsw_end + 10 > sw->ycsw_cap) {
+    if (sw->ycsw_off && sw->ycsw_off >= sw->ycsw_end / 2) {
+      memmove(sw->ycsw_gaps, sw->ycsw_gaps + sw->ycsw_off, sw->ycsw_end - sw->ycsw_off);
+      sw->ycsw_end -= sw->ycsw_off;
+      sw->ycsw_off  = 0;
+    }
+    if (sw->ycsw_end + 10 > sw->ycsw_cap) {
+      sw->ycsw_cap = sw->ycsw_cap ? sw->ycsw_cap * 2 : 16;
+      sw->ycsw_gaps = realloc(sw->ycsw_gaps, sw->ycsw_cap);
+      if (!sw->ycsw_gaps) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+  }
+
+  uint64_t gap = seq - sw->ycsw_last;
+  size_t start = sw->ycsw_end;
+  while (gap >= 0x80) {
+    sw->ycsw_gaps[sw->ycsw_end++] = (uint8_t) (gap | 0x80);
+    gap >>= 7;
+  }
+  sw->ycsw_gaps[sw->ycsw_end++] = (uint8_t) gap;
+  yc_search_list_bytes += sw->ycsw_end - start;
+
+  sw->ycsw_last = seq;
+  sw->ycsw_count++;
+}
+
+/* read a varint at p. returns how many bytes it was */
+static size_t yc_search_varint(const uint8_t *p, uint64_t *v) {
+  uint64_t x = 0;
+  size_t n = 0;
+  int shift = 0;
+  do {
+    x |= (uint64_t) (p[n] & 0x7f) << shift;
+    shift += 7;
+  } while (p[n++] & 0x80);
+  *v = x;
+  return n;
+}
+
+/* take the first entry off a word's list */
+static void yc_search_pop(int32_t i) {
+  yc_search_word_t *sw = &yc_search_words[i];
+  if (--sw->ycsw_count == 0) {
+    yc_search_word_free(i);
+    return;
+  }
+
+  uint64_t gap;
+  size_t n = yc_search_varint(sw->ycsw_gaps + sw->ycsw_off, &gap);
+  sw->ycsw_first   += gap;
+  sw->ycsw_off     += n;
+  sw->ycsw_dropped += n;
+  yc_search_list_bytes -= n;
+}
+
+void yc_search_add(uint32_t room, yc_buf_t *prefix, const char *line, size_t len) {
+  yc_search_msg_t *m = &yc_search_msgs[yc_search_seq % yc_search_window];
+
+  /* the one that was here is falling out of the window */
+  if (m->ycsm_seq) {
+    for (int n = 0; n < m->ycsm_nwords; n++)
+      yc_search_pop(m->ycsm_words[n]);
+  }
+
+  size_t plen = prefix ? prefix->ycb_len : 0;
+  size_t need = YC_SEARCH_WORDS_MAX * sizeof(int32_t) + plen + len;
+  if (need > m->ycsm_cap) {
+    m->ycsm_words = realloc(m->ycsm_words, need);
+    if (!m->ycsm_words) {
+      perror("realloc");
+      exit(1);
+    }
+    m->ycsm_cap = need;
+  }
+
+  char *text = yc_search_text(m);
+  if (plen)
+    memcpy(text, prefix->ycb_data, plen);
+  memcpy(text + plen, line, len);
+  m->ycsm_len    = plen + len;
+  m->ycsm_room   = room;
+  m->ycsm_seq    = yc_search_seq;
+  m->ycsm_nwords = 0;
+
+  char w[YC_SEARCH_WORD_MAX];
+  const char *p = text, *end = p + m->ycsm_len;
+  size_t wlen;
+  uint32_t h;
+  for (int n = 0; n < YC_SEARCH_WORDS_MAX && (wlen = yc_search_word(&p, end, w, &h)); n++) {
+    int32_t i = yc_search_find(w, wlen, h);
+    if (i < 0)
+      i = yc_search_word_new(w, wlen, h);
+
+    /* once per message, however many times it says it */
+    yc_search_word_t *sw = &yc_search_words[i];
+    if (sw->ycsw_count && sw->ycsw_last == yc_search_seq)
+      continue;
+    yc_search_post(sw, yc_search_seq);
+    m->ycsm_words[m->ycsm_nwords++] = i;
+  }
+
+  yc_search_seq++;
+}
+
+
+/* make sure a cursor's word is still the one it started with, and that
+ * where it is hasn't been cut off. returns 0 if the list is gone */
+static int yc_search_cursor_check(yc_search_cursor_t *cur) {
+  yc_search_word_t *sw = &yc_search_words[cur->ycsc_word];
+  if (sw->ycsw_gen != cur->ycsc_gen || !sw->ycsw_count)
+    return 0;
+
+  if (cur->ycsc_pos < sw->ycsw_dropped) {
+    cur->ycsc_val = sw->ycsw_first;
+    cur->ycsc_pos = sw->ycsw_dropped;
+  }
+  return 1;
+}
+
+/* move a cursor to the next entry. returns 0 if there isn't one */
+static int yc_search_cursor_next(yc_search_cursor_t *cur) {
+  yc_search_word_t *sw = &yc_search_words[cur->ycsc_word];
+  size_t at = sw->ycsw_off + (cur->ycsc_pos - sw->ycsw_dropped);
+  if (at >= sw->ycsw_end)
+    return 0;
+
+  uint64_t gap;
+  size_t n = yc_search_varint(sw->ycsw_gaps + at, &gap);
+  cur->ycsc_val += gap;
+  cur->ycsc_pos += n;
+  return 1;
+}
+
+/* do up to *budget steps of a search. returns 1 if it's finished */
+static int yc_search_run(yc_search_job_t *j, int *budget) {
+  yc_search_cursor_t *drv = &j->ycsj_terms[0];
+
+  while (*budget > 0) {
+    if (!yc_search_cursor_check(drv))
+      return 1;
+    while (drv->ycsc_val < j->ycsj_cand) {
+      if (!yc_search_cursor_next(drv))
+        return 1;
+      (*budget)--;
+    }
+
+    uint64_t cand = drv->ycsc_val;
+    if (cand > j->ycsj_until)
+      return 1;
+    j->ycsj_cand = cand + 1;
+    (*budget)--;
+
+    /* bring the others up to it. if one goes past, there's no point
+     * looking at anything before where it ended up */
+    int match = 1;
+    for (int t = 1; t < j->ycsj_nterms && match; t++) {
+      yc_search_cursor_t *cur = &j->ycsj_terms[t];
+      if (!yc_search_cursor_check(cur))
+        return 1;
+      while (cur->ycsc_val < cand) {
+        if (!yc_search_cursor_next(cur))
+          return 1;
+        (*budget)--;
+      }
+      if (cur->ycsc_val != cand) {
+        j->ycsj_cand = cur->ycsc_val;
+        match = 0;
+      }
+    }
+    if (!match)
+      continue;
+
+    yc_search_msg_t *m = &yc_search_msgs[cand % yc_search_window];
+    if (m->ycsm_seq == cand && m->ycsm_room == j->ycsj_room)
+      j->ycsj_found[j->ycsj_nfound++ % YC_SEARCH_RESULTS] = cand;
+  }
+
+  return 0;
+}
+
+/* send what a finished search found, oldest first */
+static void yc_search_finish(yc_search_job_t *j) {
+  yc_conn_t *c = j->ycsj_conn;
+  uint64_t n = j->ycsj_nfound;
+  uint64_t from = n > YC_SEARCH_RESULTS ? n - YC_SEARCH_RESULTS : 0;
+
+  if (!n) {
+    yc_conn_notice(c, "search for \"%.*s\": nothing", j->ycsj_qlen, j->ycsj_query);
+    return;
+  }
+  if (from)
+    yc_conn_notice(c, "search for \"%.*s\": %llu matches, the last %d:",
+      j->ycsj_qlen, j->ycsj_query, (unsigned long long) n, YC_SEARCH_RESULTS);
+  else
+    yc_conn_notice(c, "search for \"%.*s\": %llu matches:",
+      j->ycsj_qlen, j->ycsj_query, (unsigned long long) n);
+
+  /* (any that have fallen out of the window since are left out) */
+  for (uint64_t i = from; i < n; i++) {
+    uint64_t seq = j->ycsj_found[i % YC_SEARCH_RESULTS];
+    yc_search_msg_t *m = &yc_search_msgs[seq % yc_search_window];
+    if (m->ycsm_seq == seq)
+      yc_conn_printf(c, "%.*s", (int) m->ycsm_len, yc_search_text(m));
+  }
+}
+
+void yc_search_start(yc_conn_t *c, uint32_t room, const char *query, size_t len) {
+  for (yc_search_job_t *j = yc_search_jobs; j; j = j->ycsj_next) {
+    if (j->ycsj_conn == c) {
+      yc_conn_notice(c, "still looking for \"%.*s\"", j->ycsj_qlen, j->ycsj_query);
+      return;
+    }
+  }
+
+  yc_search_job_t *j = calloc(1, sizeof(yc_search_job_t));
+  if (!j) {
+    perror("calloc");
+    exit(1);
+  }
+  j->ycsj_conn  = c;
+  j->ycsj_room  = room;
+  j->ycsj_until = yc_search_seq - 1;
+  j->ycsj_qlen  = len < YC_SEARCH_QUERY_MAX ? len : YC_SEARCH_QUERY_MAX;
+  memcpy(j->ycsj_query, query, j->ycsj_qlen);
+
+  /* a word nobody's said means nothing can match */
+  char w[YC_SEARCH_WORD_MAX];
+  const char *p = query, *end = query + len;
+  size_t wlen;
+  uint32_t h;
+  int missing = 0;
+  while (!missing && j->ycsj_nterms < YC_SEARCH_TERMS_MAX && (wlen = yc_search_word(&p, end, w, &h))) {
+    int32_t i = yc_search_find(w, wlen, h);
+    if (i < 0)
+      missing = 1;
+    if (missing)
+      break;
+
+    int t;
+    for (t = 0; t < j->ycsj_nterms && j->ycsj_terms[t].ycsc_word != i; t++)
+      ;
+    if (t < j->ycsj_nterms)
+      continue;
+
+    yc_search_word_t *sw = &yc_search_words[i];
+    j->ycsj_terms[j->ycsj_nterms++] = (yc_search_cursor_t) {
+      .ycsc_word = i, .ycsc_gen = sw->ycsw_gen, .ycsc_val = sw->ycsw_first, .ycsc_pos = sw->ycsw_dropped,
+    };
+  }
+
+  if (!j->ycsj_nterms && !missing) {
+    yc_conn_notice(c, "usage: /search <words>");
+    free(j);
+    return;
+  }
+
+  yc_search_nsearches++;
+
+  if (missing) {
+    yc_search_finish(j);
+    free(j);
+    return;
+  }
+
+  /* rarest first, since that one decides what's worth looking at */
+  for (int a = 1; a < j->ycsj_nterms; a++) {
+    yc_search_cursor_t cur = j->ycsj_terms[a];
+    uint32_t count = yc_search_words[cur.ycsc_word].ycsw_count;
+    int b = a;
+    for (; b > 0 && yc_search_words[j->ycsj_terms[b-1].ycsc_word].ycsw_count > count; b--)
+      j->ycsj_terms[b] = j->ycsj_terms[b-1];
+    j->ycsj_terms[b] = cur;
+  }
+
+  *yc_search_jobs_tail = j;
+  yc_search_jobs_tail  = &j->ycsj_next;
+}
+
+static void yc_search_unlink(yc_search_job_t **pp) {
+  yc_search_job_t *j = *pp;
+  *pp = j->ycsj_next;
+  if (yc_search_jobs_tail == &j->ycsj_next)
+    yc_search_jobs_tail = pp;
+}
+
+void yc_search_cancel(yc_conn_t *c) {
+  for (yc_search_job_t **pp = &yc_search_jobs; *pp; pp = &(*pp)->ycsj_next) {
+    if ((*pp)->ycsj_conn == c) {
+      yc_search_job_t *j = *pp;
+      yc_search_unlink(pp);
+      free(j);
+      return;
+    }
+  }
+}
+
+void yc_search_tick(void) {
+  int budget = YC_SEARCH_STEPS;
+
+  /* the one at the front gets the budget. if it runs out before it's done,
+   * it goes to the back, so a big search can't starve the others */
+  while (yc_search_jobs && budget > 0) {
+    yc_search_job_t *j = yc_search_jobs;
+    int before = budget;
+    int done = yc_search_run(j, &budget);
+    yc_search_nsteps += before - budget;
+
+    yc_search_unlink(&yc_search_jobs);
+    if (done) {
+      yc_search_finish(j);
+      free(j);
+    }
+    else {
+      j->ycsj_next = NULL;
+      *yc_search_jobs_tail = j;
+      yc_search_jobs_tail  = &j->ycsj_next;
+    }
+  }
+}
+
+int yc_search_timeout(void) {
+  return yc_search_jobs ? 0 : -1;
+}
+
+void yc_search_stats_dump(void) {
+  uint64_t held = yc_search_seq - 1 < (uint64_t) yc_search_window ? yc_search_seq - 1 : (uint64_t) yc_search_window;
+  printf("search: msgs=%llu words=%d list_bytes=%zu searches=%llu steps=%llu\n",
+    (unsigned long long) held, yc_search_live, yc_search_list_bytes,
+    (unsigned long long) yc_search_nsearches, (unsigned long long) yc_search_nsteps);
+  fflush(stdout);
+}
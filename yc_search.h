@@ -0,0 +1,61 @@
+/* yc_search - searching recent messages for yoctochat servers */
+
+/* /search <words> finds the recent messages in your current room that have
+ * all of those words in them. "Recent" is the last few thousand messages
+ * on the server (-o search=N, default 10000; 0 turns searching off).
+ *
+ * Every message is split into words as it arrives: runs of letters and
+ * digits (and anything that isn't ASCII, so other languages work too),
+ * lowercased, and cut to 32 bytes. Each word has a posting list, the
+ * sequence numbers of the messages it's in, in order, so finding the
+ * messages with all of some words is walking their lists together.
+ *
+ * The lists only store the gap from each number to the next, as a varint,
+ * so a common word costs about a byte a message. When a message falls out
+ * of the window, each of its words' lists loses its first entry, which is
+ * that message. A word with nothing left in its list is forgotten.
+ *
+ * Adding a message has to be quick, since it's on its way to everyone else.
+ * It's a hash lookup and a few bytes of append per word, and the same again
+ * for the message falling out the other end.
+ *
+ * A search doesn't run all at once. Each time around the event loop, a few
+ * thousand list entries' worth of the searches in progress gets done, so
+ * looking for common words never holds up anyone's messages. The results
+ * come back when it's finished.
+ */
+
+#ifndef YC_SEARCH_H
+#define YC_SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "yc_core.h"
+
+extern int yc_search_on;
+
+/* set up, keeping the last window messages. 0 turns searching off */
+void yc_search_init(int window);
+
+/* add a message. prefix (or NULL) and line go together as the message;
+ * line has no newline. room is the hash of the room's name */
+void yc_search_add(uint32_t room, yc_buf_t *prefix, const char *line, size_t len);
+
+/* start a search for the messages in room with all the words in query */
+void yc_search_start(yc_conn_t *c, uint32_t room, const char *query, size_t len);
+
+/* forget any search the connection has going, on the way out */
+void yc_search_cancel(yc_conn_t *c);
+
+/* do some of the searches in progress, and send the results of any that
+ * finish */
+void yc_search_tick(void);
+
+/* 0 if there are searches in progress, or -1 */
+int yc_search_timeout(void);
+
+/* print the search counters */
+void yc_search_stats_dump(void);
+
+#endif
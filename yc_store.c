@@ -0,0 +1,1608 @@
+/* yc_store - the durable message log for yoctochat servers */
+
+/* The event loop side of this is simple: messages are copied into the open
+ * batch as they arrive, and when the batch is due it's handed to the backend
+ * and a new one is started next time a message comes along. Nothing waits
+ * for a batch to finish, though no more than a few are let out at once; if
+ * the disk can't keep up, the open batch just keeps growing until one comes
+ * back, which makes the groups bigger and the syncs fewer.
+ *
+ * A batch never spans two segments. When a message won't fit in the current
+ * segment, the open batch is sent off marked as the segment's last, and
+ * whoever finishes it closes the file.
+ *
+ * The writer thread takes everything that's queued for it at once, writes
+ * it all, then syncs each segment it touched just once. So while one sync
+ * is going on, the batches that arrive behind it become one group for the
+ * next.
+ *
+ * After a crash, the last segment might end part way through a line. When
+ * the log is opened, it's cut back to the last whole line.
+ *
+ * io_uring can finish batches in any order, but a message is only committed
+ * once everything before it is, so catching up never sends a gap. A batch
+ * that finishes early waits until the ones before it are done.
+ *
+ * Every segment has an index file beside it (00000000000000000001.idx), an
+ * array of fixed-size entries, one per message, saying where it starts,
+ * which room it was in and when it arrived. It's mapped into memory and
+ * filled in as messages are appended, so it costs a store per message and
+ * no system calls. The segment a message is in is found by binary search on
+ * their first sequence numbers, and then its entry is just an array lookup.
+ *
+ * Nothing reads the log to start up. Only the current segment's index is
+ * mapped then, and only what's in the log past its last entry (nothing,
+ * unless the machine went down) is scanned. Older segments' indexes are
+ * mapped the first time they're needed, and if one's missing or doesn't
+ * match its log, it's made again.
+ *
+ * Once a segment is old enough (-o storecompress=N: older than the newest
+ * N), a thread of its own compresses it into a .z file beside it, and when
+ * that's safely on disk the event loop swaps it in and removes the log. It's
+ * compressed with zlib in blocks of 64k, each on its own, so reading a
+ * message only means decompressing the block it's in, and a table at the
+ * front says where each block starts. Blocks that small don't have much to
+ * go on, so they all start from a dictionary of lines picked from all
+ * through the segment: the nicknames and bot chatter that come round again
+ * and again are then matched from the first byte of every block. The index
+ * stays as it was; its offsets are into the log as if it wasn't compressed.
+ *
+ * Compressed segments can't be sent with sendfile(), so catching up from
+ * one decompresses it into memory, and stops after a couple of hundred k,
+ * ending on a whole message. The client can ask for more. The newest
+ * segments, which is what nearly everyone catching up wants, are never
+ * compressed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#include "yc_store.h"
+#include "yc_log.h"
+#include "yc_scan.h"
+
+/* most batches being written at once */
+#define YC_STORE_INFLIGHT (4)
+
+/* starting size of a batch's buffer */
+#define YC_STORE_BATCH_SIZE (65536)
+
+/* the index has an entry for every message in a segment. its sequence
+ * number is where it is in the index, so that's not stored */
+typedef struct {
+  uint32_t ycsi_off;        /* where it starts in the segment */
+  uint32_t ycsi_room;       /* hash of the room's name (see yc_intern.h) */
+  int64_t  ycsi_time;       /* when it arrived, ms since the epoch */
+} yc_store_idx_t;
+
+/* the front of an index file. the entries follow it */
+typedef struct {
+  char     ycsh_magic[8];
+  uint64_t ycsh_count;
+} yc_store_idx_hdr_t;
+
+#define YC_STORE_IDX_MAGIC "ycidx01"
+
+/* entries an index file starts out with room for. it doubles when full */
+#define YC_STORE_IDX_SIZE (4096)
+
+/* the front of a compressed segment. the dictionary follows it, then the
+ * block table (where each block starts in the file, and where the last one
+ * ends), then the blocks */
+typedef struct {
+  char     yczh_magic[8];
+  uint64_t yczh_len;        /* of the log, uncompressed */
+  uint32_t yczh_block;      /* bytes of log in each block */
+  uint32_t yczh_nblocks;
+  uint32_t yczh_dictlen;
+  uint32_t yczh_pad;
+} yc_store_zip_hdr_t;
+
+#define YC_STORE_ZIP_MAGIC "yczip01"
+
+/* bytes of log compressed in each block */
+#define YC_STORE_ZIP_BLOCK (65536)
+
+/* a dictionary is up to 32k (as far back as zlib can look), made from this
+ * many samples of 1k each */
+#define YC_STORE_ZIP_DICT    (32768)
+#define YC_STORE_ZIP_SAMPLES (32)
+
+/* a compressed segment, once its table has been read */
+typedef struct {
+  int       yczs_fd;
+  uint64_t  yczs_len;
+  uint32_t  yczs_block;
+  uint32_t  yczs_nblocks;
+  uint32_t  yczs_dictlen;
+  char     *yczs_dict;
+  uint64_t  yczs_table[];
+} yc_store_zip_t;
+
+/* how a segment's log is kept */
+enum {
+  YC_STORE_PLAIN,
+  YC_STORE_ZIPPING,         /* being compressed, or that failed */
+  YC_STORE_ZIPPED,
+};
+
+typedef struct {
+  uint64_t            ycss_first;   /* sequence number of its first message */
+  yc_store_idx_hdr_t *ycss_hdr;     /* its index, mapped. NULL until needed */
+  size_t              ycss_cap;     /* entries the mapping has room for */
+  int                 ycss_state;
+  yc_store_zip_t     *ycss_zip;     /* if it's compressed. NULL until needed */
+} yc_store_seg_t;
+
+/* a segment for the compressing thread */
+typedef struct yc_store_zjob {
+  uint64_t  yczj_first;
+  int       yczj_err;       /* a negative errno, or 0 */
+  uint64_t  yczj_len;       /* how big it was */
+  uint64_t  yczj_zlen;      /* and is now */
+  struct yc_store_zjob *yczj_next;
+} yc_store_zjob_t;
+
+/* most of a compressed segment decompressed for one /catchup or /history */
+#define YC_STORE_UNZIP_MAX (256*1024)
+
+static inline yc_store_idx_t *yc_store_idx(yc_store_seg_t *s) {
+  return (yc_store_idx_t *) (s->ycss_hdr + 1);
+}
+
+int yc_store_on;
+
+/* settings */
+static size_t   yc_store_segment;
+static uint64_t yc_store_commit_ns;
+static size_t   yc_store_commit_bytes;
+static int      yc_store_strict;
+static int      yc_store_compress;
+
+/* the log directory, and the segment being appended to */
+static const char *yc_store_dir;
+static int         yc_store_dirfd;
+static int         yc_store_fd;
+static off_t       yc_store_seg_len;     /* including what's not written yet */
+
+/* sequence number the next message will get */
+static uint64_t    yc_store_next;
+
+/* every segment, oldest first. the last one is the current one */
+static yc_store_seg_t *yc_store_segs;
+static size_t          yc_store_nsegs, yc_store_segs_cap;
+
+/* how far the log is committed: the last message, and where it ends. the
+ * writer thread moves it along, so it's behind a lock. batches that finish
+ * early wait in yc_store_early */
+static pthread_mutex_t yc_store_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t        yc_store_commit_seq;
+static uint64_t        yc_store_commit_seg;
+static off_t           yc_store_commit_end;
+
+typedef struct {
+  uint64_t ycse_first, ycse_last, ycse_seg;
+  off_t    ycse_end;
+} yc_store_early_t;
+/* usually no more than YC_STORE_INFLIGHT, but a burst that crosses segment
+ * boundaries submits each one as it goes, whatever's in flight, so it grows
+ * if it has to */
+static yc_store_early_t *yc_store_early;
+static int               yc_store_nearly, yc_store_early_cap;
+
+/* the batch messages are going into, if there is one */
+static yc_store_batch_t *yc_store_cur;
+
+static _Atomic int yc_store_inflight;
+
+/* the writer thread's queue */
+static pthread_mutex_t   yc_store_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    yc_store_wake = PTHREAD_COND_INITIALIZER;
+static yc_store_batch_t *yc_store_queue, **yc_store_queue_tail = &yc_store_queue;
+static int               yc_store_thread_running;
+
+/* the compressing thread's queue, and what it's finished. segments before
+ * yc_store_zip_next have been looked at already */
+static pthread_mutex_t  yc_store_zip_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   yc_store_zip_wake = PTHREAD_COND_INITIALIZER;
+static yc_store_zjob_t *yc_store_zip_queue, **yc_store_zip_queue_tail = &yc_store_zip_queue;
+static yc_store_zjob_t *yc_store_zip_done;
+static _Atomic int      yc_store_zip_ready;
+static int              yc_store_zip_running;
+static size_t           yc_store_zip_next;
+
+/* the last block decompressed, since reads tend to come in order */
+static z_stream  yc_store_inflate;
+static int       yc_store_inflate_ready;
+static char     *yc_store_blk;
+static uint64_t  yc_store_blk_seg;
+static uint32_t  yc_store_blk_no;
+static char     *yc_store_zbuf;
+static size_t    yc_store_zbuf_cap;
+
+/* counters. batches finish on whichever thread wrote them, so these are
+ * atomic. commit latency is also kept as a histogram with a bucket per power
+ * of two microseconds, for the percentiles */
+#define YC_STORE_LAT_BUCKETS (32)
+static _Atomic uint64_t yc_store_nbatches;
+static _Atomic uint64_t yc_store_nmsgs;
+static _Atomic uint64_t yc_store_nbytes;
+static _Atomic uint64_t yc_store_nerrors;
+static _Atomic uint64_t yc_store_batch_max;
+static _Atomic uint64_t yc_store_lat_sum;
+static _Atomic uint64_t yc_store_lat_max;
+static _Atomic uint64_t yc_store_lat_hist[YC_STORE_LAT_BUCKETS];
+
+/* compression's counters are only touched by the event loop */
+static uint64_t yc_store_zip_nsegs;
+static uint64_t yc_store_zip_len;
+static uint64_t yc_store_zip_zlen;
+static uint64_t yc_store_zip_nunzipped;
+
+
+static uint64_t yc_store_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ms since the epoch, for the index */
+static int64_t yc_store_wallclock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void yc_store_max(_Atomic uint64_t *max, uint64_t v) {
+  uint64_t cur = atomic_load_explicit(max, memory_order_relaxed);
+  while (v > cur && !atomic_compare_exchange_weak_explicit(max, &cur, v,
+                                                           memory_order_relaxed, memory_order_relaxed))
+    ;
+}
+
+/* write all of len bytes at off. returns 0, or a negative errno */
+static int yc_store_write_at(int fd, const char *p, size_t len, off_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, p + done, len - done, off + done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+/* read all of len bytes at off. returns 0, or a negative errno (EIO if the
+ * file's too short) */
+static int yc_store_read_at(int fd, char *p, size_t len, off_t off) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, p + done, len - done, off + done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (n == 0)
+      return -EIO;
+    done += n;
+  }
+  return 0;
+}
+
+static yc_store_seg_t *yc_store_seg_add(uint64_t first) {
+  if (yc_store_nsegs == yc_store_segs_cap) {
+    yc_store_segs_cap = yc_store_segs_cap ? yc_store_segs_cap * 2 : 16;
+    yc_store_segs = realloc(yc_store_segs, yc_store_segs_cap * sizeof(yc_store_seg_t));
+    if (!yc_store_segs) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  yc_store_seg_t *s = &yc_store_segs[yc_store_nsegs++];
+  *s = (yc_store_seg_t) { .ycss_first = first };
+  return s;
+}
+
+static int yc_store_seg_cmp(const void *a, const void *b) {
+  uint64_t x = ((const yc_store_seg_t *) a)->ycss_first, y = ((const yc_store_seg_t *) b)->ycss_first;
+  return x < y ? -1 : x > y;
+}
+
+/* which segment is message seq in? the last one that starts at or before it */
+static size_t yc_store_seg_find(uint64_t seq) {
+  size_t lo = 0, hi = yc_store_nsegs;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (yc_store_segs[mid].ycss_first <= seq)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* open one of a segment's files, its log or its index. O_EXCL means it's
+ * being made */
+static int yc_store_seg_open(uint64_t first, const char *ext, int flags) {
+  char name[32];
+  snprintf(name, sizeof(name), "%020llu.%s", (unsigned long long) first, ext);
+  int fd = openat(yc_store_dirfd, name, flags | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    yc_log(YC_LOG_ERROR, "store: %s/%s: %s", yc_store_dir, name, strerror(errno));
+    return -1;
+  }
+
+  /* a new file is only really there once its directory is synced too */
+  if (flags & O_EXCL)
+    fsync(yc_store_dirfd);
+
+  return fd;
+}
+
+static void yc_store_idx_unmap(yc_store_seg_t *s) {
+  if (!s->ycss_hdr)
+    return;
+  munmap(s->ycss_hdr, sizeof(yc_store_idx_hdr_t) + s->ycss_cap * sizeof(yc_store_idx_t));
+  s->ycss_hdr = NULL;
+  s->ycss_cap = 0;
+}
+
+/* map a segment's index, with room for at least cap entries, making it if
+ * it isn't there. returns -1 if it can't */
+static int yc_store_idx_map(yc_store_seg_t *s, size_t cap) {
+  int fd = yc_store_seg_open(s->ycss_first, "idx", O_RDWR | O_CREAT);
+  if (fd < 0)
+    return -1;
+
+  /* bigger than asked for is fine; it's from a mapping that grew */
+  struct stat st;
+  void *p = MAP_FAILED;
+  if (fstat(fd, &st) == 0) {
+    if ((size_t) st.st_size > sizeof(yc_store_idx_hdr_t) &&
+        (st.st_size - sizeof(yc_store_idx_hdr_t)) / sizeof(yc_store_idx_t) > cap)
+      cap = (st.st_size - sizeof(yc_store_idx_hdr_t)) / sizeof(yc_store_idx_t);
+
+    size_t size = sizeof(yc_store_idx_hdr_t) + cap * sizeof(yc_store_idx_t);
+    if ((size_t) st.st_size >= size || ftruncate(fd, size) == 0)
+      p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (p == MAP_FAILED) {
+    yc_log(YC_LOG_ERROR, "store: mapping index for segment %llu: %s",
+      (unsigned long long) s->ycss_first, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  yc_store_idx_unmap(s);
+  s->ycss_hdr = p;
+  s->ycss_cap = cap;
+
+  /* a new one (or something that isn't one) starts out empty */
+  if (memcmp(s->ycss_hdr->ycsh_magic, YC_STORE_IDX_MAGIC, sizeof(s->ycss_hdr->ycsh_magic)) != 0) {
+    memcpy(s->ycss_hdr->ycsh_magic, YC_STORE_IDX_MAGIC, sizeof(s->ycss_hdr->ycsh_magic));
+    s->ycss_hdr->ycsh_count = 0;
+  }
+  if (s->ycss_hdr->ycsh_count > s->ycss_cap)
+    s->ycss_hdr->ycsh_count = s->ycss_cap;
+
+  return 0;
+}
+
+/* set entry i of a segment's index, growing it if need be. it doesn't change
+ * the count */
+static void yc_store_idx_put(yc_store_seg_t *s, uint64_t i, off_t off, uint32_t room, int64_t time) {
+  if (i >= s->ycss_cap && yc_store_idx_map(s, s->ycss_cap * 2) < 0)
+    exit(1);
+  yc_store_idx(s)[i] = (yc_store_idx_t) { .ycsi_off = off, .ycsi_room = room, .ycsi_time = time };
+}
+
+/* read a compressed segment's header and block table, the first time it's
+ * needed. returns -1 if it can't */
+static int yc_store_zip_load(yc_store_seg_t *s) {
+  if (s->ycss_zip)
+    return 0;
+
+  int fd = yc_store_seg_open(s->ycss_first, "z", O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  yc_store_zip_hdr_t h;
+  yc_store_zip_t *z = NULL;
+  int err = yc_store_read_at(fd, (char *) &h, sizeof(h), 0);
+  if (!err && (memcmp(h.yczh_magic, YC_STORE_ZIP_MAGIC, sizeof(h.yczh_magic)) != 0 ||
+               h.yczh_block == 0 || h.yczh_block > YC_STORE_ZIP_BLOCK || h.yczh_dictlen > YC_STORE_ZIP_DICT ||
+               h.yczh_nblocks != (h.yczh_len + h.yczh_block - 1) / h.yczh_block))
+    err = -EINVAL;
+
+  /* the table and the dictionary go in one allocation, with the table first
+   * to keep it aligned */
+  if (!err) {
+    size_t tlen = (h.yczh_nblocks + 1) * sizeof(uint64_t);
+    z = malloc(sizeof(yc_store_zip_t) + tlen + h.yczh_dictlen);
+    if (!z) {
+      perror("malloc");
+      exit(1);
+    }
+    z->yczs_fd      = fd;
+    z->yczs_len     = h.yczh_len;
+    z->yczs_block   = h.yczh_block;
+    z->yczs_nblocks = h.yczh_nblocks;
+    z->yczs_dictlen = h.yczh_dictlen;
+    z->yczs_dict    = (char *) z->yczs_table + tlen;
+
+    err = yc_store_read_at(fd, z->yczs_dict, h.yczh_dictlen, sizeof(h));
+    if (!err)
+      err = yc_store_read_at(fd, (char *) z->yczs_table, tlen, sizeof(h) + h.yczh_dictlen);
+  }
+
+  if (err) {
+    yc_log(YC_LOG_ERROR, "store: reading compressed segment %llu: %s",
+      (unsigned long long) s->ycss_first, strerror(-err));
+    free(z);
+    close(fd);
+    return -1;
+  }
+
+  s->ycss_zip = z;
+  return 0;
+}
+
+/* decompress block k of a compressed segment into yc_store_blk. returns -1
+ * if it can't */
+static int yc_store_zip_unblock(yc_store_seg_t *s, uint32_t k) {
+  yc_store_zip_t *z = s->ycss_zip;
+
+  if (!yc_store_inflate_ready) {
+    /* raw deflate; the blocks have no zlib header, to save a few bytes */
+    yc_store_blk = malloc(YC_STORE_ZIP_BLOCK);
+    if (!yc_store_blk || inflateInit2(&yc_store_inflate, -15) != Z_OK) {
+      perror("inflateInit2");
+      exit(1);
+    }
+    yc_store_inflate_ready = 1;
+  }
+
+  uint64_t zlen = z->yczs_table[k+1] - z->yczs_table[k];
+  size_t len = k+1 < z->yczs_nblocks ? z->yczs_block : z->yczs_len - (uint64_t) k * z->yczs_block;
+  if (zlen > yc_store_zbuf_cap) {
+    yc_store_zbuf = realloc(yc_store_zbuf, zlen);
+    if (!yc_store_zbuf) {
+      perror("realloc");
+      exit(1);
+    }
+    yc_store_zbuf_cap = zlen;
+  }
+
+  yc_store_blk_seg = 0;
+  int err = yc_store_read_at(z->yczs_fd, yc_store_zbuf, zlen, z->yczs_table[k]);
+  if (err) {
+    yc_log(YC_LOG_ERROR, "store: reading compressed segment %llu: %s",
+      (unsigned long long) s->ycss_first, strerror(-err));
+    return -1;
+  }
+
+  z_stream *zs = &yc_store_inflate;
+  inflateReset(zs);
+  if (z->yczs_dictlen)
+    inflateSetDictionary(zs, (const Bytef *) z->yczs_dict, z->yczs_dictlen);
+  zs->next_in   = (Bytef *) yc_store_zbuf;
+  zs->avail_in  = zlen;
+  zs->next_out  = (Bytef *) yc_store_blk;
+  zs->avail_out = len;
+  if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_out != 0) {
+    yc_log(YC_LOG_ERROR, "store: compressed segment %llu: block %u is damaged",
+      (unsigned long long) s->ycss_first, k);
+    return -1;
+  }
+
+  yc_store_blk_seg = s->ycss_first;
+  yc_store_blk_no  = k;
+  yc_store_zip_nunzipped++;
+  return 0;
+}
+
+/* read len bytes at off from a compressed segment's log, decompressing only
+ * the blocks they're in. returns -1 if it can't */
+static int yc_store_zip_read(yc_store_seg_t *s, char *buf, size_t len, uint64_t off) {
+  if (yc_store_zip_load(s) < 0)
+    return -1;
+  yc_store_zip_t *z = s->ycss_zip;
+  if (off + len > z->yczs_len)
+    return -1;
+
+  while (len) {
+    uint32_t k = off / z->yczs_block;
+    if ((yc_store_blk_seg != s->ycss_first || yc_store_blk_no != k) && yc_store_zip_unblock(s, k) < 0)
+      return -1;
+
+    size_t at = off - (uint64_t) k * z->yczs_block;
+    size_t n = z->yczs_block - at;
+    if (n > len)
+      n = len;
+    memcpy(buf, yc_store_blk + at, n);
+    buf += n;
+    off += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* read from a segment's log, whichever way it's kept. fd is the log, if it
+ * isn't compressed. returns how much was read, 0 at the end, or -1 */
+static ssize_t yc_store_seg_read(yc_store_seg_t *s, int fd, char *buf, size_t len, off_t off) {
+  if (s->ycss_state != YC_STORE_ZIPPED)
+    return pread(fd, buf, len, off);
+
+  if (yc_store_zip_load(s) < 0)
+    return -1;
+  if ((uint64_t) off >= s->ycss_zip->yczs_len)
+    return 0;
+  if (len > s->ycss_zip->yczs_len - off)
+    len = s->ycss_zip->yczs_len - off;
+  return yc_store_zip_read(s, buf, len, off) < 0 ? -1 : (ssize_t) len;
+}
+
+/* bring a segment's index up to date with its log, from entry n on, which
+ * starts at off. every whole line from there gets an entry, keeping what's
+ * there already if it's right; if not, the room and time are lost. returns
+ * where the last whole line ends, or -1 if the log can't be read */
+static off_t yc_store_seg_scan(yc_store_seg_t *s, int fd, uint64_t n, off_t off) {
+  uint64_t had = s->ycss_hdr->ycsh_count;
+  int64_t time = n ? yc_store_idx(s)[n-1].ycsi_time : 0;
+  off_t start = off;
+
+  char buf[65536];
+  ssize_t len;
+  while ((len = yc_store_seg_read(s, fd, buf, sizeof(buf), off)) > 0) {
+    for (const char *p = buf; (p = yc_scan_nl(p, buf + len)); p++) {
+      if (n < had && yc_store_idx(s)[n].ycsi_off == start)
+        time = yc_store_idx(s)[n].ycsi_time;
+      else
+        yc_store_idx_put(s, n, start, 0, time);
+      n++;
+      start = off + (p - buf) + 1;
+    }
+    off += len;
+  }
+  if (len < 0)
+    return -1;
+
+  s->ycss_hdr->ycsh_count = n;
+  return start;
+}
+
+/* make sure an old segment's index is mapped, and has an entry for every
+ * message up to the next segment. if it doesn't, it's rebuilt. returns -1
+ * if it can't be */
+static int yc_store_seg_index(size_t i) {
+  yc_store_seg_t *s = &yc_store_segs[i];
+  if (s->ycss_hdr)
+    return 0;
+  if (yc_store_idx_map(s, YC_STORE_IDX_SIZE) < 0)
+    return -1;
+
+  if (s->ycss_hdr->ycsh_count == yc_store_segs[i+1].ycss_first - s->ycss_first)
+    return 0;
+
+  yc_log(YC_LOG_ERROR, "store: rebuilding index for segment %llu", (unsigned long long) s->ycss_first);
+  int zipped = s->ycss_state == YC_STORE_ZIPPED;
+  int fd = zipped ? -1 : yc_store_seg_open(s->ycss_first, "log", O_RDONLY);
+  off_t end = fd < 0 && !zipped ? -1 : yc_store_seg_scan(s, fd, 0, 0);
+  if (fd >= 0)
+    close(fd);
+  if (end < 0) {
+    yc_store_idx_unmap(s);
+    return -1;
+  }
+  return 0;
+}
+
+/* open the current segment after a restart, and bring its index up to
+ * date. returns how many messages it has.
+ *
+ * the index isn't synced (it can always be made again from the log), so
+ * after a crash it might be behind the log, or ahead of it if the log lost
+ * more. entries past the end of the log are dropped, and the log is scanned
+ * from the last entry left, so only what the index missed is read. anything
+ * after the last whole line is cut off */
+static uint64_t yc_store_seg_recover(yc_store_seg_t *s, int fd) {
+  if (yc_store_idx_map(s, YC_STORE_IDX_SIZE) < 0)
+    exit(1);
+
+  off_t size = lseek(fd, 0, SEEK_END);
+  yc_store_idx_t *idx = yc_store_idx(s);
+  uint64_t n = s->ycss_hdr->ycsh_count;
+  while (n && idx[n-1].ycsi_off >= size)
+    n--;
+
+  off_t end = yc_store_seg_scan(s, fd, n ? n-1 : 0, n ? idx[n-1].ycsi_off : 0);
+  if (end < 0) {
+    fprintf(stderr, "store: reading %s: %s\n", yc_store_dir, strerror(errno));
+    exit(1);
+  }
+
+  if (end < size) {
+    yc_log(YC_LOG_ERROR, "store: dropping %lld bytes of partial message at end of log",
+      (long long) (size - end));
+    if (ftruncate(fd, end) < 0 || fdatasync(fd) < 0) {
+      fprintf(stderr, "store: truncating %s: %s\n", yc_store_dir, strerror(errno));
+      exit(1);
+    }
+  }
+
+  yc_store_seg_len = end;
+  return s->ycss_hdr->ycsh_count;
+}
+
+/* start a new segment */
+static void yc_store_seg_new(void) {
+  yc_store_fd = yc_store_seg_open(yc_store_next, "log", O_RDWR | O_CREAT | O_EXCL);
+  if (yc_store_fd < 0 || yc_store_idx_map(yc_store_seg_add(yc_store_next), YC_STORE_IDX_SIZE) < 0)
+    exit(1);
+  yc_store_seg_len = 0;
+}
+
+void yc_store_open(const char *dir, size_t segment, int commit_ms, size_t commit_bytes, int strict, int compress) {
+  /* the index keeps offsets in 32 bits */
+  if (segment > UINT32_MAX)
+    segment = UINT32_MAX;
+
+  yc_store_dir          = dir;
+  yc_store_segment      = segment;
+  yc_store_commit_ns    = (uint64_t) commit_ms * 1000000;
+  yc_store_commit_bytes = commit_bytes;
+  yc_store_strict       = strict;
+  yc_store_compress     = compress;
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "store: mkdir %s: %s\n", dir, strerror(errno));
+    exit(1);
+  }
+  yc_store_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *d = yc_store_dirfd < 0 ? NULL : fdopendir(dup(yc_store_dirfd));
+  if (!d) {
+    fprintf(stderr, "store: %s: %s\n", dir, strerror(errno));
+    exit(1);
+  }
+
+  /* find all the segments, compressed or not. the newest is the one with
+   * the biggest first message. a compression that didn't finish is thrown
+   * away */
+  struct dirent *de;
+  while ((de = readdir(d))) {
+    char *end;
+    unsigned long long first = strtoull(de->d_name, &end, 10);
+    if (end == de->d_name)
+      continue;
+    if (strcmp(end, ".log") == 0)
+      yc_store_seg_add(first);
+    else if (strcmp(end, ".z") == 0)
+      yc_store_seg_add(first)->ycss_state = YC_STORE_ZIPPED;
+    else if (strcmp(end, ".z.tmp") == 0)
+      unlinkat(yc_store_dirfd, de->d_name, 0);
+  }
+  closedir(d);
+  if (yc_store_nsegs)
+    qsort(yc_store_segs, yc_store_nsegs, sizeof(yc_store_seg_t), yc_store_seg_cmp);
+
+  /* a segment with both was compressed, but the server stopped before the
+   * log was removed. the compressed one is complete, or it wouldn't have
+   * that name */
+  size_t n = 0;
+  for (size_t i = 0; i < yc_store_nsegs; i++) {
+    if (n && yc_store_segs[n-1].ycss_first == yc_store_segs[i].ycss_first) {
+      char name[32];
+      snprintf(name, sizeof(name), "%020llu.log", (unsigned long long) yc_store_segs[i].ycss_first);
+      unlinkat(yc_store_dirfd, name, 0);
+      yc_store_segs[n-1].ycss_state = YC_STORE_ZIPPED;
+      continue;
+    }
+    yc_store_segs[n++] = yc_store_segs[i];
+  }
+  yc_store_nsegs = n;
+
+  if (yc_store_nsegs) {
+    yc_store_seg_t *s = &yc_store_segs[yc_store_nsegs-1];
+    yc_store_fd   = yc_store_seg_open(s->ycss_first, "log", O_RDWR);
+    if (yc_store_fd < 0)
+      exit(1);
+    yc_store_next = s->ycss_first + yc_store_seg_recover(s, yc_store_fd);
+  }
+  else {
+    yc_store_next = 1;
+    yc_store_seg_new();
+  }
+
+  yc_store_commit_seq = yc_store_next - 1;
+  yc_store_commit_seg = yc_store_segs[yc_store_nsegs-1].ycss_first;
+  yc_store_commit_end = yc_store_seg_len;
+
+  yc_log(YC_LOG_CONNECT, "store: logging to %s, next message is %llu",
+    dir, (unsigned long long) yc_store_next);
+
+  yc_store_on = 1;
+}
+
+
+/* make a dictionary for a segment: whole lines from all through it, so
+ * whatever its blocks have in common can be matched from their start. it's
+ * stored with the segment, so a small segment gets a small one */
+static size_t yc_store_zip_train(int fd, uint64_t len, char *dict) {
+  char buf[YC_STORE_ZIP_DICT / YC_STORE_ZIP_SAMPLES];
+  size_t sample = len / (YC_STORE_ZIP_SAMPLES * 8);
+  if (sample > sizeof(buf))
+    sample = sizeof(buf);
+  size_t n = 0;
+
+  for (int k = 0; k < YC_STORE_ZIP_SAMPLES && sample; k++) {
+    off_t off = len * k / YC_STORE_ZIP_SAMPLES;
+    ssize_t got = pread(fd, buf, sample, off);
+    if (got <= 0)
+      break;
+
+    /* from the start of the first whole line to the end of the last */
+    const char *p = buf, *end = buf + got, *last = NULL;
+    if (off && (p = yc_scan_nl(p, end)))
+      p++;
+    for (const char *nl = p; nl && (nl = yc_scan_nl(nl, end)); nl++)
+      last = nl;
+    if (!last)
+      continue;
+
+    memcpy(dict + n, p, last + 1 - p);
+    n += last + 1 - p;
+  }
+  return n;
+}
+
+/* compress len bytes of log from in to out, block by block, and say how
+ * big the result was. returns 0, or a negative errno */
+static int yc_store_zip_blocks(int in, int out, uint64_t len, uint64_t *zlen) {
+  uint32_t nblocks = (len + YC_STORE_ZIP_BLOCK - 1) / YC_STORE_ZIP_BLOCK;
+  yc_store_zip_hdr_t h = {
+    .yczh_magic = YC_STORE_ZIP_MAGIC, .yczh_len = len, .yczh_block = YC_STORE_ZIP_BLOCK, .yczh_nblocks = nblocks,
+  };
+
+  /* raw deflate, like the reading side */
+  z_stream zs = { 0 };
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    perror("deflateInit2");
+    exit(1);
+  }
+  size_t zcap = deflateBound(&zs, YC_STORE_ZIP_BLOCK);
+  char *dict = malloc(YC_STORE_ZIP_DICT), *raw = malloc(YC_STORE_ZIP_BLOCK), *zbuf = malloc(zcap);
+  uint64_t *table = malloc((nblocks + 1) * sizeof(uint64_t));
+  if (!dict || !raw || !zbuf || !table) {
+    perror("malloc");
+    exit(1);
+  }
+
+  h.yczh_dictlen = yc_store_zip_train(in, len, dict);
+
+  /* the blocks go after the table, which is filled in as they're written */
+  uint64_t pos = sizeof(h) + h.yczh_dictlen + (nblocks + 1) * sizeof(uint64_t);
+  int err = 0;
+  for (uint32_t k = 0; k < nblocks && !err; k++) {
+    size_t n = k+1 < nblocks ? YC_STORE_ZIP_BLOCK : len - (uint64_t) k * YC_STORE_ZIP_BLOCK;
+    err = yc_store_read_at(in, raw, n, (off_t) k * YC_STORE_ZIP_BLOCK);
+    if (err)
+      break;
+
+    deflateReset(&zs);
+    if (h.yczh_dictlen)
+      deflateSetDictionary(&zs, (const Bytef *) dict, h.yczh_dictlen);
+    zs.next_in   = (Bytef *) raw;
+    zs.avail_in  = n;
+    zs.next_out  = (Bytef *) zbuf;
+    zs.avail_out = zcap;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+      err = -EIO;
+      break;
+    }
+
+    table[k] = pos;
+    err = yc_store_write_at(out, zbuf, zcap - zs.avail_out, pos);
+    pos += zcap - zs.avail_out;
+  }
+  table[nblocks] = pos;
+
+  if (!err)
+    err = yc_store_write_at(out, (const char *) &h, sizeof(h), 0);
+  if (!err)
+    err = yc_store_write_at(out, dict, h.yczh_dictlen, sizeof(h));
+  if (!err)
+    err = yc_store_write_at(out, (const char *) table, (nblocks + 1) * sizeof(uint64_t), sizeof(h) + h.yczh_dictlen);
+
+  deflateEnd(&zs);
+  free(dict);
+  free(raw);
+  free(zbuf);
+  free(table);
+  *zlen = pos;
+  return err;
+}
+
+/* compress a segment into a .z file beside its log. this is on the
+ * compressing thread, so it only touches the files. it's written under
+ * another name and renamed when it's synced, so a .z is always complete */
+static int yc_store_zip_write(yc_store_zjob_t *j) {
+  uint64_t first = j->yczj_first;
+  int in = yc_store_seg_open(first, "log", O_RDONLY);
+  if (in < 0)
+    return -1;
+  int out = yc_store_seg_open(first, "z.tmp", O_WRONLY | O_CREAT | O_TRUNC);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+
+  struct stat st;
+  int err = fstat(in, &st) < 0 ? -errno : 0;
+  if (!err) {
+    j->yczj_len = st.st_size;
+    err = yc_store_zip_blocks(in, out, st.st_size, &j->yczj_zlen);
+  }
+  if (!err && fdatasync(out) < 0)
+    err = -errno;
+  close(in);
+  close(out);
+
+  char tmp[32], name[32];
+  snprintf(tmp, sizeof(tmp), "%020llu.z.tmp", (unsigned long long) first);
+  snprintf(name, sizeof(name), "%020llu.z", (unsigned long long) first);
+  if (!err && renameat(yc_store_dirfd, tmp, yc_store_dirfd, name) < 0)
+    err = -errno;
+  if (err) {
+    yc_log(YC_LOG_ERROR, "store: compressing segment %llu: %s", (unsigned long long) first, strerror(-err));
+    unlinkat(yc_store_dirfd, tmp, 0);
+    return -1;
+  }
+  fsync(yc_store_dirfd);
+
+  return 0;
+}
+
+static void *yc_store_zip_run(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&yc_store_zip_lock);
+    while (!yc_store_zip_queue)
+      pthread_cond_wait(&yc_store_zip_wake, &yc_store_zip_lock);
+    yc_store_zjob_t *j = yc_store_zip_queue;
+    yc_store_zip_queue = j->yczj_next;
+    if (!yc_store_zip_queue)
+      yc_store_zip_queue_tail = &yc_store_zip_queue;
+    pthread_mutex_unlock(&yc_store_zip_lock);
+
+    j->yczj_err = yc_store_zip_write(j);
+
+    pthread_mutex_lock(&yc_store_zip_lock);
+    j->yczj_next = yc_store_zip_done;
+    yc_store_zip_done = j;
+    pthread_mutex_unlock(&yc_store_zip_lock);
+    atomic_store(&yc_store_zip_ready, 1);
+  }
+
+  return NULL;
+}
+
+static void yc_store_zip_submit(uint64_t first) {
+  if (!yc_store_zip_running) {
+    pthread_t t;
+    int err = pthread_create(&t, NULL, yc_store_zip_run, NULL);
+    if (err) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(1);
+    }
+    pthread_detach(t);
+    yc_store_zip_running = 1;
+  }
+
+  yc_store_zjob_t *j = calloc(1, sizeof(yc_store_zjob_t));
+  if (!j) {
+    perror("calloc");
+    exit(1);
+  }
+  j->yczj_first = first;
+
+  pthread_mutex_lock(&yc_store_zip_lock);
+  *yc_store_zip_queue_tail = j;
+  yc_store_zip_queue_tail = &j->yczj_next;
+  pthread_cond_signal(&yc_store_zip_wake);
+  pthread_mutex_unlock(&yc_store_zip_lock);
+}
+
+/* the compressed file is safely there, so the log can go. anything that
+ * has it open already can go on reading it */
+static void yc_store_zip_finish(yc_store_zjob_t *j) {
+  yc_store_seg_t *s = &yc_store_segs[yc_store_seg_find(j->yczj_first)];
+
+  /* if it failed, it stays as it is, and isn't tried again */
+  if (!j->yczj_err) {
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu.log", (unsigned long long) j->yczj_first);
+    unlinkat(yc_store_dirfd, name, 0);
+    s->ycss_state = YC_STORE_ZIPPED;
+
+    yc_store_zip_nsegs++;
+    yc_store_zip_len  += j->yczj_len;
+    yc_store_zip_zlen += j->yczj_zlen;
+    yc_log(YC_LOG_CONNECT, "store: compressed segment %llu, %llu bytes to %llu",
+      (unsigned long long) j->yczj_first, (unsigned long long) j->yczj_len, (unsigned long long) j->yczj_zlen);
+  }
+
+  free(j);
+}
+
+/* swap in any segments that have been compressed, and hand over the ones
+ * that are old enough */
+static void yc_store_zip_tick(void) {
+  if (atomic_load(&yc_store_zip_ready)) {
+    atomic_store(&yc_store_zip_ready, 0);
+    pthread_mutex_lock(&yc_store_zip_lock);
+    yc_store_zjob_t *list = yc_store_zip_done;
+    yc_store_zip_done = NULL;
+    pthread_mutex_unlock(&yc_store_zip_lock);
+
+    while (list) {
+      yc_store_zjob_t *next = list->yczj_next;
+      yc_store_zip_finish(list);
+      list = next;
+    }
+  }
+
+  if (!yc_store_compress)
+    return;
+
+  while (yc_store_zip_next + yc_store_compress < yc_store_nsegs) {
+    yc_store_seg_t *s = &yc_store_segs[yc_store_zip_next];
+    if (s->ycss_state == YC_STORE_PLAIN) {
+      /* not until all of it is on disk */
+      pthread_mutex_lock(&yc_store_commit_lock);
+      uint64_t committed = yc_store_commit_seq;
+      pthread_mutex_unlock(&yc_store_commit_lock);
+      if (committed + 1 < yc_store_segs[yc_store_zip_next+1].ycss_first)
+        break;
+
+      s->ycss_state = YC_STORE_ZIPPING;
+      yc_store_zip_submit(s->ycss_first);
+    }
+    yc_store_zip_next++;
+  }
+}
+
+
+static yc_store_batch_t *yc_store_batch_new(void) {
+  yc_store_batch_t *b = calloc(1, sizeof(yc_store_batch_t));
+  if (!b) {
+    perror("calloc");
+    exit(1);
+  }
+  b->ycsb_fd     = yc_store_fd;
+  b->ycsb_seg    = yc_store_segs[yc_store_nsegs-1].ycss_first;
+  b->ycsb_off    = yc_store_seg_len;
+  b->ycsb_first  = yc_store_next;
+  b->ycsb_tstart = yc_store_now();
+  return b;
+}
+
+/* write a batch, all of it */
+static int yc_store_pwrite(yc_store_batch_t *b) {
+  return yc_store_write_at(b->ycsb_fd, b->ycsb_data, b->ycsb_len, b->ycsb_off);
+}
+
+/* send the open batch off to be written */
+static void yc_store_submit(void) {
+  yc_store_batch_t *b = yc_store_cur;
+  yc_store_cur = NULL;
+  atomic_fetch_add(&yc_store_inflight, 1);
+
+  if (yc_store_strict) {
+    int err = yc_store_pwrite(b);
+    if (!err && fdatasync(b->ycsb_fd) < 0)
+      err = -errno;
+    yc_store_done(b, err);
+  }
+  else
+    yc_backend_store_write(b);
+}
+
+/* the current segment is full; finish it and start another */
+static void yc_store_roll(void) {
+  /* whatever writes the segment's last batch closes it. if there isn't a
+   * batch open, an empty one does the job */
+  if (!yc_store_cur)
+    yc_store_cur = yc_store_batch_new();
+  yc_store_cur->ycsb_seal = 1;
+  yc_store_submit();
+
+  yc_store_seg_new();
+}
+
+void yc_store_append(yc_buf_t *prefix, const char *line, size_t len, uint32_t room) {
+  size_t plen = prefix ? prefix->ycb_len : 0;
+  size_t need = plen + len;
+
+  if (yc_store_seg_len && yc_store_seg_len + need > yc_store_segment)
+    yc_store_roll();
+
+  if (!yc_store_cur)
+    yc_store_cur = yc_store_batch_new();
+  yc_store_batch_t *b = yc_store_cur;
+
+  yc_store_seg_t *s = &yc_store_segs[yc_store_nsegs-1];
+  uint64_t i = yc_store_next - s->ycss_first;
+  yc_store_idx_put(s, i, yc_store_seg_len, room, yc_store_wallclock());
+  s->ycss_hdr->ycsh_count = i+1;
+
+  if (b->ycsb_len + need > b->ycsb_cap) {
+    size_t cap = b->ycsb_cap ? b->ycsb_cap : YC_STORE_BATCH_SIZE;
+    while (cap < b->ycsb_len + need)
+      cap *= 2;
+    b->ycsb_data = realloc(b->ycsb_data, cap);
+    if (!b->ycsb_data) {
+      perror("realloc");
+      exit(1);
+    }
+    b->ycsb_cap = cap;
+  }
+
+  if (plen)
+    memcpy(b->ycsb_data + b->ycsb_len, prefix->ycb_data, plen);
+  memcpy(b->ycsb_data + b->ycsb_len + plen, line, len);
+  b->ycsb_len += need;
+  b->ycsb_nmsgs++;
+  b->ycsb_last = yc_store_next++;
+
+  yc_store_seg_len += need;
+}
+
+void yc_store_tick(void) {
+  yc_store_zip_tick();
+
+  yc_store_batch_t *b = yc_store_cur;
+  if (!b)
+    return;
+
+  if (!yc_store_strict) {
+    if (b->ycsb_len < yc_store_commit_bytes && yc_store_now() - b->ycsb_tstart < yc_store_commit_ns)
+      return;
+    if (atomic_load(&yc_store_inflight) >= YC_STORE_INFLIGHT)
+      return;
+  }
+
+  yc_store_submit();
+}
+
+int yc_store_timeout(void) {
+  yc_store_batch_t *b = yc_store_cur;
+  if (!b)
+    return -1;
+
+  uint64_t now = yc_store_now();
+  if (now - b->ycsb_tstart >= yc_store_commit_ns) {
+    /* overdue, so it's only waiting for one of the others to finish. look
+     * again soon */
+    return atomic_load(&yc_store_inflight) >= YC_STORE_INFLIGHT ? 1 : 0;
+  }
+  return (b->ycsb_tstart + yc_store_commit_ns - now + 999999) / 1000000;
+}
+
+/* a batch is finished. move the committed point along, if it's the next
+ * one; if not, it waits for the ones before it */
+static void yc_store_commit(yc_store_batch_t *b) {
+  pthread_mutex_lock(&yc_store_commit_lock);
+
+  if (b->ycsb_first != yc_store_commit_seq + 1) {
+    if (yc_store_nearly == yc_store_early_cap) {
+      yc_store_early_cap = yc_store_early_cap ? yc_store_early_cap * 2 : YC_STORE_INFLIGHT;
+      yc_store_early = realloc(yc_store_early, yc_store_early_cap * sizeof(yc_store_early_t));
+      if (!yc_store_early) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    assert(yc_store_nearly < yc_store_early_cap);
+    yc_store_early[yc_store_nearly++] = (yc_store_early_t) {
+      .ycse_first = b->ycsb_first, .ycse_last = b->ycsb_last,
+      .ycse_seg   = b->ycsb_seg,   .ycse_end  = b->ycsb_off + b->ycsb_len,
+    };
+  }
+  else {
+    yc_store_commit_seq = b->ycsb_last;
+    yc_store_commit_seg = b->ycsb_seg;
+    yc_store_commit_end = b->ycsb_off + b->ycsb_len;
+
+    /* and any that were waiting for it */
+    for (int i = 0; i < yc_store_nearly; ) {
+      yc_store_early_t *e = &yc_store_early[i];
+      if (e->ycse_first != yc_store_commit_seq + 1) {
+        i++;
+        continue;
+      }
+      yc_store_commit_seq = e->ycse_last;
+      yc_store_commit_seg = e->ycse_seg;
+      yc_store_commit_end = e->ycse_end;
+      *e = yc_store_early[--yc_store_nearly];
+      i = 0;
+    }
+  }
+
+  pthread_mutex_unlock(&yc_store_commit_lock);
+}
+
+uint64_t yc_store_committed(void) {
+  pthread_mutex_lock(&yc_store_commit_lock);
+  uint64_t seq = yc_store_commit_seq;
+  pthread_mutex_unlock(&yc_store_commit_lock);
+  return seq;
+}
+
+void yc_store_done(yc_store_batch_t *b, int err) {
+  /* even if it failed, there's no going back and trying again, so it's
+   * committed as far as catching up is concerned */
+  if (b->ycsb_nmsgs)
+    yc_store_commit(b);
+
+  if (err) {
+    atomic_fetch_add_explicit(&yc_store_nerrors, 1, memory_order_relaxed);
+    yc_log(YC_LOG_ERROR, "store: writing %d messages: %s", b->ycsb_nmsgs, strerror(-err));
+  }
+  else if (b->ycsb_nmsgs) {
+    uint64_t lat = (yc_store_now() - b->ycsb_tstart) / 1000;
+    int bucket = 63 - __builtin_clzll(lat | 1);
+    if (bucket >= YC_STORE_LAT_BUCKETS)
+      bucket = YC_STORE_LAT_BUCKETS-1;
+
+    atomic_fetch_add_explicit(&yc_store_nbatches, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&yc_store_nmsgs, b->ycsb_nmsgs, memory_order_relaxed);
+    atomic_fetch_add_explicit(&yc_store_nbytes, b->ycsb_len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&yc_store_lat_sum, lat, memory_order_relaxed);
+    atomic_fetch_add_explicit(&yc_store_lat_hist[bucket], 1, memory_order_relaxed);
+    yc_store_max(&yc_store_lat_max, lat);
+    yc_store_max(&yc_store_batch_max, b->ycsb_nmsgs);
+  }
+
+  if (b->ycsb_seal)
+    close(b->ycsb_fd);
+  free(b->ycsb_data);
+  free(b);
+
+  atomic_fetch_sub(&yc_store_inflight, 1);
+}
+
+
+static void *yc_store_run(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&yc_store_lock);
+    while (!yc_store_queue)
+      pthread_cond_wait(&yc_store_wake, &yc_store_lock);
+    yc_store_batch_t *list = yc_store_queue;
+    yc_store_queue = NULL;
+    yc_store_queue_tail = &yc_store_queue;
+    pthread_mutex_unlock(&yc_store_lock);
+
+    /* write everything, and remember what went wrong */
+    for (yc_store_batch_t *b = list; b; b = b->ycsb_next)
+      b->ycsb_err = yc_store_pwrite(b);
+
+    /* then sync once for each run of batches in the same segment. they're
+     * in order, so a segment's batches are all together */
+    while (list) {
+      yc_store_batch_t *run = list, *b = list;
+      while (b->ycsb_next && b->ycsb_next->ycsb_fd == run->ycsb_fd)
+        b = b->ycsb_next;
+      list = b->ycsb_next;
+      b->ycsb_next = NULL;
+
+      int err = fdatasync(run->ycsb_fd) < 0 ? -errno : 0;
+      while (run) {
+        yc_store_batch_t *next = run->ycsb_next;
+        yc_store_done(run, run->ycsb_err ? run->ycsb_err : err);
+        run = next;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+void yc_store_thread_write(yc_store_batch_t *b) {
+  if (!yc_store_thread_running) {
+    pthread_t t;
+    int err = pthread_create(&t, NULL, yc_store_run, NULL);
+    if (err) {
+      fprintf(stderr, "pthread_create: %s\n", strerror(err));
+      exit(1);
+    }
+    pthread_detach(t);
+    yc_store_thread_running = 1;
+  }
+
+  b->ycsb_next = NULL;
+  pthread_mutex_lock(&yc_store_lock);
+  *yc_store_queue_tail = b;
+  yc_store_queue_tail = &b->ycsb_next;
+  pthread_cond_signal(&yc_store_wake);
+  pthread_mutex_unlock(&yc_store_lock);
+}
+
+
+/* most to send in one go. that's plenty for anyone, and they can always ask
+ * for more */
+#define YC_STORE_CATCHUP_MAX (1ull << 30)
+
+/* one part per segment, plus a frame header. kept between calls */
+static yc_qent_t *yc_store_parts;
+static size_t     yc_store_parts_cap;
+
+int64_t yc_store_catchup(yc_conn_t *c, uint64_t seq) {
+  pthread_mutex_lock(&yc_store_commit_lock);
+  uint64_t last    = yc_store_commit_seq;
+  uint64_t lastseg = yc_store_commit_seg;
+  off_t    lastend = yc_store_commit_end;
+  pthread_mutex_unlock(&yc_store_commit_lock);
+
+  if (seq >= last)
+    return 0;
+  if (seq + 1 < yc_store_segs[0].ycss_first)
+    return -1;
+
+  size_t from = yc_store_seg_find(seq + 1), to = yc_store_seg_find(lastseg);
+  if (yc_store_parts_cap < to - from + 2) {
+    yc_store_parts_cap = to - from + 2;
+    yc_store_parts = realloc(yc_store_parts, yc_store_parts_cap * sizeof(yc_qent_t));
+    if (!yc_store_parts) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  /* binary clients get it all as one log frame, so leave room for its
+   * header at the front */
+  int binary = c->ycc_proto == YC_PROTO_BINARY;
+  int n = binary;
+  size_t total = 0;
+  int64_t ret = last - seq;
+
+  /* what's decompressed has to fit in their output queue, along with
+   * whatever else is going on */
+  size_t room = yc_conn_oq_room(c) / 2;
+  if (room > YC_STORE_UNZIP_MAX)
+    room = YC_STORE_UNZIP_MAX;
+
+  for (size_t i = from; i <= to; i++) {
+    yc_store_seg_t *s = &yc_store_segs[i];
+    if (i == from && yc_store_seg_index(i) < 0) {
+      ret = -1;
+      break;
+    }
+    int zipped = s->ycss_state == YC_STORE_ZIPPED;
+    int fd = -1;
+    if (zipped ? yc_store_zip_load(s) < 0 : (fd = yc_store_seg_open(s->ycss_first, "log", O_RDONLY)) < 0) {
+      ret = -1;
+      break;
+    }
+
+    /* the last segment might still be being written; only send what's
+     * committed. any before it are finished */
+    off_t start = 0;
+    if (i == from)
+      start = seq + 1 - s->ycss_first < s->ycss_hdr->ycsh_count ?
+              yc_store_idx(s)[seq + 1 - s->ycss_first].ycsi_off : -1;
+    off_t end = lastend;
+    if (i < to && zipped)
+      end = s->ycss_zip->yczs_len;
+    else if (i < to) {
+      struct stat st;
+      end = fstat(fd, &st) < 0 ? -1 : st.st_size;
+    }
+    if (start < 0 || end < start) {
+      yc_log(YC_LOG_ERROR, "store: can't find message %llu in segment %llu",
+        (unsigned long long) seq + 1, (unsigned long long) s->ycss_first);
+      if (fd >= 0)
+        close(fd);
+      ret = -1;
+      break;
+    }
+
+    /* stop at a segment boundary if it's getting too big */
+    if (n > binary && total + (end - start) > YC_STORE_CATCHUP_MAX) {
+      if (fd >= 0)
+        close(fd);
+      last = s->ycss_first - 1;
+      ret  = last - seq;
+      break;
+    }
+
+    /* (a segment that's just been started can have nothing committed yet) */
+    if (end == start) {
+      if (fd >= 0)
+        close(fd);
+      continue;
+    }
+
+    if (!zipped) {
+      yc_store_parts[n++] = (yc_qent_t) {
+        .ycq_buf = yc_buf_file(fd, end), .ycq_off = start, .ycq_end = end,
+      };
+      total += end - start;
+      continue;
+    }
+
+    /* a compressed one is sent from memory, so if there's too much of it,
+     * it's cut off after the last whole message that fits. if not even one
+     * does, they get one anyway, unless there's something before it */
+    int cut = 0;
+    if ((size_t) (end - start) > room) {
+      if (yc_store_seg_index(i) < 0) {
+        ret = -1;
+        break;
+      }
+      yc_store_idx_t *idx = yc_store_idx(s);
+      uint64_t lo = i == from ? seq + 1 - s->ycss_first : 0, hi = s->ycss_hdr->ycsh_count;
+      uint64_t first = lo;
+      while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if ((size_t) (idx[mid].ycsi_off - start) <= room)
+          lo = mid;
+        else
+          hi = mid;
+      }
+      if (lo == first) {
+        if (n > binary) {
+          last = s->ycss_first - 1;
+          ret  = last - seq;
+          break;
+        }
+        lo++;
+      }
+      end  = lo < s->ycss_hdr->ycsh_count ? idx[lo].ycsi_off : end;
+      last = s->ycss_first + lo - 1;
+      ret  = last - seq;
+      cut  = 1;
+    }
+
+    yc_buf_t *b = yc_buf_new(end - start);
+    if (yc_store_zip_read(s, b->ycb_data, end - start, start) < 0) {
+      yc_buf_unref(b);
+      ret = -1;
+      break;
+    }
+    yc_store_parts[n++] = (yc_qent_t) { .ycq_buf = b, .ycq_off = 0, .ycq_end = end - start };
+    total += end - start;
+    room  -= (size_t) (end - start) < room ? (size_t) (end - start) : room;
+    if (cut)
+      break;
+  }
+
+  if (ret > 0) {
+    yc_conn_notice(c, "catching up on messages %llu to %llu",
+      (unsigned long long) seq + 1, (unsigned long long) last);
+
+    if (binary) {
+      yc_buf_t *hdr = yc_buf_new(YC_FRAME_HDR_MAX);
+      hdr->ycb_len = yc_frame_hdr_put(hdr->ycb_data, total, YC_FRAME_LOG);
+      yc_store_parts[0] = (yc_qent_t) { .ycq_buf = hdr, .ycq_off = 0, .ycq_end = hdr->ycb_len };
+    }
+    yc_conn_sendv(c, yc_store_parts, n);
+
+    yc_conn_notice(c, "caught up to %llu", (unsigned long long) last);
+  }
+
+  for (int i = ret > 0 ? 0 : binary; i < n; i++)
+    yc_buf_unref(yc_store_parts[i].ycq_buf);
+
+  return ret;
+}
+
+/* messages picked out for /history, newest first. kept between calls */
+static uint64_t *yc_store_picked;
+static int       yc_store_picked_cap;
+
+int yc_store_history(yc_conn_t *c, uint32_t room, int64_t since, int max) {
+  pthread_mutex_lock(&yc_store_commit_lock);
+  uint64_t last    = yc_store_commit_seq;
+  off_t    lastend = yc_store_commit_end;
+  pthread_mutex_unlock(&yc_store_commit_lock);
+
+  if (!last || last < yc_store_segs[0].ycss_first)
+    return 0;
+
+  if (yc_store_picked_cap < max) {
+    yc_store_picked_cap = max;
+    yc_store_picked = realloc(yc_store_picked, max * sizeof(uint64_t));
+    if (!yc_store_picked) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  /* go back from the newest, until they're too old or there's enough.
+   * ones from compressed segments are sent from memory, so there's only so
+   * much room for those */
+  size_t zroom = yc_conn_oq_room(c) / 2;
+  if (zroom > YC_STORE_UNZIP_MAX)
+    zroom = YC_STORE_UNZIP_MAX;
+
+  int n = 0, done = 0;
+  for (size_t i = yc_store_seg_find(last) + 1; i-- > 0 && !done; ) {
+    if (yc_store_seg_index(i) < 0)
+      return -1;
+
+    yc_store_seg_t *s = &yc_store_segs[i];
+    yc_store_idx_t *idx = yc_store_idx(s);
+    int zipped = s->ycss_state == YC_STORE_ZIPPED;
+    if (zipped && yc_store_zip_load(s) < 0)
+      return -1;
+    uint64_t j = last - s->ycss_first + 1;
+    if (j > s->ycss_hdr->ycsh_count)
+      j = s->ycss_hdr->ycsh_count;
+
+    while (j-- > 0) {
+      if (idx[j].ycsi_time < since || n == max) {
+        done = 1;
+        break;
+      }
+      if (idx[j].ycsi_room != room)
+        continue;
+      if (zipped) {
+        size_t size = (j+1 < s->ycss_hdr->ycsh_count ? idx[j+1].ycsi_off : s->ycss_zip->yczs_len) - idx[j].ycsi_off;
+        if (size > zroom) {
+          done = 1;
+          break;
+        }
+        zroom -= size;
+      }
+      yc_store_picked[n++] = s->ycss_first + j;
+    }
+  }
+  if (!n)
+    return 0;
+
+  if (yc_store_parts_cap < (size_t) n + 1) {
+    yc_store_parts_cap = n + 1;
+    yc_store_parts = realloc(yc_store_parts, yc_store_parts_cap * sizeof(yc_qent_t));
+    if (!yc_store_parts) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  /* then forward, oldest first, making a file range for each run of them
+   * that are next to each other in the log. binary clients get them all as
+   * one log frame */
+  int binary = c->ycc_proto == YC_PROTO_BINARY;
+  int nparts = binary;
+  size_t total = 0;
+  size_t cur = SIZE_MAX;
+  yc_buf_t *file = NULL;
+  int ret = n;
+
+  for (int k = n-1; k >= 0; k--) {
+    uint64_t seq = yc_store_picked[k];
+    size_t i = yc_store_seg_find(seq);
+    yc_store_seg_t *s = &yc_store_segs[i];
+    uint64_t j = seq - s->ycss_first;
+
+    int zipped = s->ycss_state == YC_STORE_ZIPPED;
+
+    if (i != cur && !zipped) {
+      int fd = yc_store_seg_open(s->ycss_first, "log", O_RDONLY);
+      if (fd < 0) {
+        ret = -1;
+        break;
+      }
+      file = yc_buf_file(fd, 0);
+      cur = i;
+    }
+
+    /* it ends where the next one starts. the last one in a segment ends at
+     * the end of the file, or where the commit is up to */
+    off_t start = yc_store_idx(s)[j].ycsi_off, end;
+    if (j+1 < s->ycss_hdr->ycsh_count)
+      end = yc_store_idx(s)[j+1].ycsi_off;
+    else if (seq == last)
+      end = lastend;
+    else if (zipped)
+      end = s->ycss_zip->yczs_len;
+    else {
+      struct stat st;
+      end = fstat(file->ycb_fd, &st) < 0 ? start : st.st_size;
+    }
+
+    if (zipped) {
+      yc_buf_t *b = yc_buf_new(end - start);
+      if (yc_store_zip_read(s, b->ycb_data, end - start, start) < 0) {
+        yc_buf_unref(b);
+        ret = -1;
+        break;
+      }
+      yc_store_parts[nparts++] = (yc_qent_t) { .ycq_buf = b, .ycq_off = 0, .ycq_end = end - start };
+      total += end - start;
+      continue;
+    }
+
+    if ((size_t) end > file->ycb_len)
+      file->ycb_len = end;
+
+    yc_qent_t *q = nparts > binary ? &yc_store_parts[nparts-1] : NULL;
+    if (q && q->ycq_buf == file && q->ycq_end == (size_t) start)
+      q->ycq_end = end;
+    else
+      yc_store_parts[nparts++] = (yc_qent_t) { .ycq_buf = file, .ycq_off = start, .ycq_end = end };
+    total += end - start;
+  }
+
+  if (ret > 0) {
+    if (binary) {
+      yc_buf_t *hdr = yc_buf_new(YC_FRAME_HDR_MAX);
+      hdr->ycb_len = yc_frame_hdr_put(hdr->ycb_data, total, YC_FRAME_LOG);
+      yc_store_parts[0] = (yc_qent_t) { .ycq_buf = hdr, .ycq_off = 0, .ycq_end = hdr->ycb_len };
+    }
+    yc_conn_sendv(c, yc_store_parts, nparts);
+    if (binary)
+      yc_buf_unref(yc_store_parts[0].ycq_buf);
+  }
+
+  /* each file is in a run of parts; let go of it once */
+  for (int k = binary; k < nparts; k++)
+    if (k == binary || yc_store_parts[k].ycq_buf != yc_store_parts[k-1].ycq_buf)
+      yc_buf_unref(yc_store_parts[k].ycq_buf);
+
+  return ret;
+}
+
+
+/* the upper bound of the histogram bucket the given fraction of batches
+ * are in or under */
+static uint64_t yc_store_lat_pct(uint64_t nbatches, double frac) {
+  uint64_t want = (uint64_t) (nbatches * frac + 0.5), seen = 0;
+  for (int i = 0; i < YC_STORE_LAT_BUCKETS; i++) {
+    seen += atomic_load_explicit(&yc_store_lat_hist[i], memory_order_relaxed);
+    if (seen >= want)
+      return 2ull << i;
+  }
+  return 0;
+}
+
+void yc_store_stats_dump(void) {
+  uint64_t nbatches = atomic_load(&yc_store_nbatches);
+  uint64_t nmsgs    = atomic_load(&yc_store_nmsgs);
+  printf("store: committed=%llu batches=%llu msgs=%llu bytes=%llu errors=%llu "
+         "batch_avg=%.1f batch_max=%llu commit_avg_us=%llu commit_p50_us<%llu commit_p99_us<%llu commit_max_us=%llu "
+         "zipped=%llu zip_ratio=%.1f unzipped_blocks=%llu\n",
+    (unsigned long long) yc_store_committed(),
+    (unsigned long long) nbatches,
+    (unsigned long long) nmsgs,
+    (unsigned long long) atomic_load(&yc_store_nbytes),
+    (unsigned long long) atomic_load(&yc_store_nerrors),
+    nbatches ? (double) nmsgs / nbatches : 0.0,
+    (unsigned long long) atomic_load(&yc_store_batch_max),
+    (unsigned long long) (nbatches ? atomic_load(&yc_store_lat_sum) / nbatches : 0),
+    (unsigned long long) yc_store_lat_pct(nbatches, 0.50),
+    (unsigned long long) yc_store_lat_pct(nbatches, 0.99),
+    (unsigned long long) atomic_load(&yc_store_lat_max),
+    (unsigned long long) yc_store_zip_nsegs,
+    yc_store_zip_zlen ? (double) yc_store_zip_len / yc_store_zip_zlen : 0.0,
+    (unsigned long long) yc_store_zip_nunzipped);
+  fflush(stdout);
+}
@@ -0,0 +1,120 @@
+/* yc_store - the durable message log for yoctochat servers */
+
+/* With -o store=dir, every chat message is appended to a log on disk, so
+ * history survives the server restarting. The log is a series of segment
+ * files in that directory, each named for the sequence number of its first
+ * message, eg 00000000000000000001.log. A segment is just the messages, one
+ * line each, exactly as a text client would see them, so it can be read with
+ * less, and sent straight from the file to a client.
+ *
+ * Getting a message onto disk is quick. Making sure it's really there (that
+ * it'd survive the power going out) means fdatasync(), which can take
+ * milliseconds, and doing that for every message would cap the server at a
+ * few hundred of them a second. So messages are committed in groups: they're
+ * gathered into a batch, and the batch is written and synced in one go when
+ * it's been open a while (-o storecommit=N ms, default 10) or has got big
+ * (-o storebytes=N, default 1m).
+ *
+ * By default the event loop doesn't wait for any of that. Messages are sent
+ * to everyone as soon as they arrive, and the batch is written in the
+ * background: by the io_uring server with io_uring, and by the others with
+ * a writer thread, since they have no way to wait for file IO in their
+ * event loops. A crash can lose the last batch or so.
+ *
+ * With -o storesync=strict, nothing is sent to anyone until it's on disk.
+ * The batch is written and synced by the event loop itself, right before
+ * output is flushed, so everything from one trip around the loop is one
+ * group. That costs a sync per trip, and the loop waits for it.
+ *
+ * Every batch reports how long it took from its first message arriving to
+ * the sync finishing, and how big it was. They're in the counters.
+ *
+ * A client that was disconnected for a while can ask for what it missed
+ * with /catchup <seq>. The messages are sent straight from the segment
+ * files, with sendfile() (or splice, for io_uring), so however many there
+ * are, they never pass through the server's memory.
+ *
+ * Old segments are compressed in the background (-o storecompress=N keeps
+ * the newest N as they are; 0 never compresses). Chat is mostly the same
+ * few things said over and over, so they shrink a lot. Those do have to
+ * be decompressed to be sent, so catching up from that far back comes a
+ * couple of hundred k at a time.
+ *
+ * Each segment also has an index, saying where each message is, which room
+ * it was in and when it arrived, which /history uses to find a room's
+ * messages since a given time. It's a file that's mapped into memory, so
+ * it's there as soon as the server starts, however big the log is.
+ */
+
+#ifndef YC_STORE_H
+#define YC_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "yc_core.h"
+
+/* a batch of messages on its way to disk. the event loop fills it in and
+ * hands it to the backend to write, and the backend hands it back to
+ * yc_store_done() when it's written and synced */
+typedef struct yc_store_batch {
+  int       ycsb_fd;        /* segment it goes in */
+  uint64_t  ycsb_seg;       /* (the first message in that segment) */
+  off_t     ycsb_off;       /* and where */
+  char     *ycsb_data;
+  size_t    ycsb_len;
+  size_t    ycsb_cap;
+  int       ycsb_nmsgs;
+  uint64_t  ycsb_first;     /* sequence numbers of the first and last */
+  uint64_t  ycsb_last;      /* messages in it */
+  uint64_t  ycsb_tstart;    /* when its first message arrived (monotonic ns) */
+  int       ycsb_seal;      /* last batch for this segment; close it after */
+
+  /* for whoever's writing it */
+  int       ycsb_err;
+
+  struct yc_store_batch *ycsb_next;   /* writer thread's queue */
+} yc_store_batch_t;
+
+extern int yc_store_on;
+
+/* open (or create) the log in dir, and find where it left off. exits the
+ * program if it can't */
+void yc_store_open(const char *dir, size_t segment, int commit_ms, size_t commit_bytes, int strict, int compress);
+
+/* append a message. prefix (or NULL) and line go together as one line in
+ * the log; line ends in '\n'. room is the hash of the room's name */
+void yc_store_append(yc_buf_t *prefix, const char *line, size_t len, uint32_t room);
+
+/* start writing the open batch, if it's time */
+void yc_store_tick(void);
+
+/* milliseconds until the open batch is due to be written, or -1 if there
+ * isn't one */
+int yc_store_timeout(void);
+
+/* a batch has been written and synced (err is 0), or failed (err is a
+ * negative errno). can be called from any thread */
+void yc_store_done(yc_store_batch_t *b, int err);
+
+/* write a batch on the writer thread. for backends that can't do it
+ * themselves */
+void yc_store_thread_write(yc_store_batch_t *b);
+
+/* the last message that's safely on disk */
+uint64_t yc_store_committed(void);
+
+/* send a connection every message after seq, up to the last one committed.
+ * returns how many that was, or -1 if they're all gone */
+int64_t yc_store_catchup(yc_conn_t *c, uint64_t seq);
+
+/* send a connection the messages in a room (by its name hash) that arrived
+ * at or after since (ms since the epoch), up to the last max of them.
+ * returns how many that was, or -1 if the log couldn't be read */
+int yc_store_history(yc_conn_t *c, uint32_t room, int64_t since, int max);
+
+/* print the store's counters */
+void yc_store_stats_dump(void);
+
+#endif
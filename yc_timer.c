@@ -0,0 +1,183 @@
+/* yc_timer - a timer wheel for yoctochat servers */
+
+/* See yc_timer.h for the idea. Each slot is a list threaded through the
+ * timers themselves. Every timer also points back at whatever points at
+ * it, so it can be taken out without walking anything, and remembers which
+ * slot it's in, so the slot's bit can be cleared when it's the last one
+ * out.
+ *
+ * Everything's worked out from yc_timer_base, the last millisecond that's
+ * been dealt with. Wheel w is in "blocks" of 64^w ms, and block k of it is
+ * slot k%64. A timer on wheel w is always in one of the 64 blocks after the
+ * one the base is in, so each slot only ever means one block at a time,
+ * and a timer in it cascades when that block starts. On the bottom wheel a
+ * block is a millisecond, so "cascading" is going off.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "yc_timer.h"
+
+#define YC_TIMER_BITS   (6)
+#define YC_TIMER_SLOTS  (1 << YC_TIMER_BITS)
+#define YC_TIMER_WHEELS (6)
+
+/* as far ahead as the top wheel reaches. anything later is brought in to
+ * here */
+#define YC_TIMER_MAX ((uint64_t) (YC_TIMER_SLOTS-1) << (YC_TIMER_BITS * (YC_TIMER_WHEELS-1)))
+
+static yc_timer_t *yc_timer_wheel[YC_TIMER_WHEELS][YC_TIMER_SLOTS];
+static uint64_t    yc_timer_used[YC_TIMER_WHEELS];
+
+/* the last millisecond that's been dealt with */
+static uint64_t yc_timer_base;
+
+/* how many timers are set (including any that are due, but not called yet) */
+static int yc_timer_count;
+
+/* timers that are due, taken out of their slots but not called yet. they
+ * stay set until they're called, so they can still be cancelled */
+static yc_timer_t *yc_timer_due;
+
+
+static void yc_timer_link(yc_timer_t **head, yc_timer_t *t) {
+  t->yct_next = *head;
+  if (t->yct_next)
+    t->yct_next->yct_pprev = &t->yct_next;
+  t->yct_pprev = head;
+  *head = t;
+}
+
+static void yc_timer_unlink(yc_timer_t *t) {
+  *t->yct_pprev = t->yct_next;
+  if (t->yct_next)
+    t->yct_next->yct_pprev = t->yct_pprev;
+
+  /* last one out of a slot */
+  if (t->yct_slot >= 0) {
+    int w = t->yct_slot >> YC_TIMER_BITS, s = t->yct_slot & (YC_TIMER_SLOTS-1);
+    if (!yc_timer_wheel[w][s])
+      yc_timer_used[w] &= ~(1ull << s);
+  }
+
+  t->yct_next  = NULL;
+  t->yct_pprev = NULL;
+}
+
+/* put a timer in the lowest wheel that reaches it, which is the first one
+ * where it's no more than 64 blocks past the base */
+static void yc_timer_add(yc_timer_t *t) {
+  int w = 0;
+  while (w < YC_TIMER_WHEELS-1 &&
+         (t->yct_when >> (YC_TIMER_BITS * w)) - (yc_timer_base >> (YC_TIMER_BITS * w)) > YC_TIMER_SLOTS)
+    w++;
+
+  int s = (t->yct_when >> (YC_TIMER_BITS * w)) & (YC_TIMER_SLOTS-1);
+  t->yct_slot = (w << YC_TIMER_BITS) | s;
+  yc_timer_link(&yc_timer_wheel[w][s], t);
+  yc_timer_used[w] |= 1ull << s;
+}
+
+/* the next millisecond anything happens: the first used slot on each wheel,
+ * counting from the block after the base, and the earliest of those */
+static uint64_t yc_timer_next(void) {
+  uint64_t next = UINT64_MAX;
+  for (int w = 0; w < YC_TIMER_WHEELS; w++) {
+    uint64_t used = yc_timer_used[w];
+    if (!used)
+      continue;
+    uint64_t block = (yc_timer_base >> (YC_TIMER_BITS * w)) + 1;
+    int from = block & (YC_TIMER_SLOTS-1);
+    uint64_t rot = from ? (used >> from) | (used << (YC_TIMER_SLOTS - from)) : used;
+    uint64_t when = (block + __builtin_ctzll(rot)) << (YC_TIMER_BITS * w);
+    if (when < next)
+      next = when;
+  }
+  return next;
+}
+
+void yc_timer_init(uint64_t now) {
+  yc_timer_base = now;
+}
+
+void yc_timer_set(yc_timer_t *t, uint64_t when, void (*fn)(yc_timer_t *t)) {
+  if (t->yct_pprev)
+    yc_timer_unlink(t);
+  else
+    yc_timer_count++;
+
+  /* everything up to the base has been done, so anything due before then
+   * goes off next time. and the wheels only go so far */
+  if (when <= yc_timer_base)
+    when = yc_timer_base+1;
+  else if (when - yc_timer_base > YC_TIMER_MAX)
+    when = yc_timer_base + YC_TIMER_MAX;
+
+  t->yct_when = when;
+  t->yct_fn   = fn;
+  yc_timer_add(t);
+}
+
+void yc_timer_cancel(yc_timer_t *t) {
+  if (!t->yct_pprev)
+    return;
+  yc_timer_unlink(t);
+  yc_timer_count--;
+}
+
+void yc_timer_run(uint64_t now) {
+  /* jump straight to each time something happens. nothing happens in
+   * between, so there's nothing to walk */
+  uint64_t ms;
+  while (yc_timer_count && (ms = yc_timer_next()) <= now) {
+    /* cascade every slot whose block starts now, from the top, so they're
+     * put back relative to the millisecond before. nothing here is due
+     * before ms, so it all lands in blocks from ms on */
+    yc_timer_base = ms-1;
+    for (int w = YC_TIMER_WHEELS-1; w > 0; w--) {
+      if (ms & ((1ull << (YC_TIMER_BITS * w)) - 1))
+        continue;
+      int s = (ms >> (YC_TIMER_BITS * w)) & (YC_TIMER_SLOTS-1);
+      yc_timer_t *t;
+      while ((t = yc_timer_wheel[w][s])) {
+        yc_timer_unlink(t);
+        yc_timer_add(t);
+      }
+    }
+
+    /* everything in this millisecond's slot on the bottom wheel is due */
+    int s = ms & (YC_TIMER_SLOTS-1);
+    yc_timer_t *t;
+    while ((t = yc_timer_wheel[0][s])) {
+      yc_timer_unlink(t);
+      t->yct_slot = -1;
+      yc_timer_link(&yc_timer_due, t);
+    }
+    yc_timer_base = ms;
+
+    /* and call them. one callback can cancel another that's due, which
+     * just takes it off this list */
+    while ((t = yc_timer_due)) {
+      yc_timer_unlink(t);
+      yc_timer_count--;
+      t->yct_fn(t);
+    }
+  }
+
+  if (now > yc_timer_base)
+    yc_timer_base = now;
+}
+
+int yc_timer_timeout(uint64_t now) {
+  if (!yc_timer_count)
+    return -1;
+
+  /* this might only be a cascade, not a timer going off, but then we come
+   * back and ask again. there's at most one of those per wheel */
+  uint64_t next = yc_timer_next();
+  if (next <= now)
+    return 0;
+  return next - now > INT_MAX ? INT_MAX : (int) (next - now);
+}
@@ -0,0 +1,69 @@
+/* yc_timer - a timer wheel for yoctochat servers */
+
+/* Some things want to happen "in a little while": a connection that's been
+ * sending too fast wants to be woken when it's allowed to send again, and
+ * every connection wants checking on if it's been quiet for too long.
+ * That's a timer for every connection there is, a million of them if
+ * that's how many there are, and most are moved or cancelled before they
+ * ever go off. So setting one, cancelling one and finding the next one due
+ * all have to be O(1), whatever else is going on.
+ *
+ * That's a hierarchical timer wheel. The bottom wheel has 64 slots, one
+ * per millisecond. The one above it has 64 slots of 64ms each, then 4096ms,
+ * and so on up, six wheels in all, which covers a couple of years. A timer
+ * goes into the lowest wheel that reaches far enough, in the slot its time
+ * falls in. When time gets to the start of a slot on an upper wheel,
+ * everything in it is moved down to the wheels below (it "cascades"),
+ * until it's in the bottom wheel, in its own millisecond, and goes off.
+ * Each timer cascades at most once per wheel, so it all costs O(1) per
+ * timer.
+ *
+ * Each wheel also keeps a bitmap of which of its slots have anything in
+ * them, so the next thing that needs doing (a timer going off, or a slot
+ * cascading) is a few bit operations per wheel away, never a walk over
+ * slots or timers.
+ *
+ * Times are monotonic milliseconds, from whatever clock the caller likes,
+ * as long as it's the same one every time. The core gives it the time it
+ * keeps for each trip around the loop.
+ *
+ * A timer lives inside whatever it's for (a connection, say), so there's
+ * nothing to allocate. The callback gets the timer back, and finds its way
+ * to the thing around it from there.
+ */
+
+#ifndef YC_TIMER_H
+#define YC_TIMER_H
+
+#include <stdint.h>
+
+typedef struct yc_timer {
+  struct yc_timer  *yct_next;
+  struct yc_timer **yct_pprev;    /* what points at us, or NULL if not set */
+  uint64_t          yct_when;
+  int               yct_slot;     /* wheel*64 + slot, or -1 if it's due */
+  void            (*yct_fn)(struct yc_timer *t);
+} yc_timer_t;
+
+/* set up. now is the current time */
+void yc_timer_init(uint64_t now);
+
+/* (re)set a timer to call fn at when. if when has already gone, it goes
+ * off next time the timers are run */
+void yc_timer_set(yc_timer_t *t, uint64_t when, void (*fn)(yc_timer_t *t));
+
+/* stop a timer from going off. fine to call if it isn't set */
+void yc_timer_cancel(yc_timer_t *t);
+
+static inline int yc_timer_pending(const yc_timer_t *t) {
+  return t->yct_pprev != NULL;
+}
+
+/* call everything that's due. a callback may set or cancel any timer,
+ * including its own */
+void yc_timer_run(uint64_t now);
+
+/* milliseconds until the next timer is due, or -1 if none are set */
+int yc_timer_timeout(uint64_t now);
+
+#endif
@@ -0,0 +1,197 @@
+/* yc_timercheck - make sure the timer wheel does what it says */
+
+/* Two checks of yc_timer.c, run by make check:
+ *
+ *   - a model check. a few thousand timers are set, moved and cancelled at
+ *     random, at every distance from one millisecond to days, while time
+ *     moves on in random steps. a plain array of expiry times says what
+ *     should happen, and we check that every timer goes off exactly once,
+ *     not before it's due, and no later than the run that reaches it, and
+ *     that yc_timer_timeout() never sleeps past the earliest one.
+ *
+ *   - a scale check. a million timers are set, all set again somewhere
+ *     else, and then run to the end by sleeping exactly as long as
+ *     yc_timer_timeout() says each time. every one has to go off in its
+ *     own millisecond. how long each part took is printed, for the
+ *     curious.
+ *
+ * If anything's wrong, it says so and exits with status 1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "yc_timer.h"
+
+#define MODEL_TIMERS (2000)
+#define MODEL_OPS    (200000)
+#define SCALE_TIMERS (1000000)
+
+/* what the wheel thinks the time is */
+static uint64_t now;
+
+static long errors;
+
+static void fail(const char *what, long i) {
+  if (++errors <= 10)
+    printf("FAIL: %s (timer %ld, now %llu)\n", what, i, (unsigned long long) now);
+}
+
+/* a small, fast, repeatable random number generator (xorshift64) */
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t rnd(uint64_t n) {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng % n;
+}
+
+static double ms_since(const struct timespec *start) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - start->tv_sec) * 1e3 + (ts.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+
+/* the model: when each timer should go off, if it's set */
+static yc_timer_t model[MODEL_TIMERS];
+static uint64_t   model_when[MODEL_TIMERS];
+static int        model_set[MODEL_TIMERS];
+
+static void model_fire(yc_timer_t *t);
+
+static void model_arm(int i, uint64_t when) {
+  yc_timer_set(&model[i], when, model_fire);
+  model_when[i] = when;
+  model_set[i]  = 1;
+}
+
+static void model_fire(yc_timer_t *t) {
+  int i = t - model;
+  if (!model_set[i])
+    fail("went off when it wasn't set", i);
+  else if (model_when[i] > now)
+    fail("went off early", i);
+  model_set[i] = 0;
+
+  /* callbacks can set timers too, including their own */
+  if (rnd(3) == 0)
+    model_arm(rnd(MODEL_TIMERS), now + 1 + rnd(5000));
+}
+
+static void model_check(void) {
+  now = 1000000;
+  yc_timer_init(now);
+
+  for (long op = 0; op < MODEL_OPS; op++) {
+    int i = rnd(MODEL_TIMERS);
+    switch (rnd(10)) {
+      case 0: case 1: case 2: case 3: {
+        static const uint64_t range[] = { 64, 5000, 1000000, 1000000000 };
+        model_arm(i, now + 1 + rnd(range[rnd(4)]));
+        break;
+      }
+
+      case 4:
+        yc_timer_cancel(&model[i]);
+        model_set[i] = 0;
+        break;
+
+      default: {
+        uint64_t first = UINT64_MAX;
+        for (int j = 0; j < MODEL_TIMERS; j++)
+          if (model_set[j] && model_when[j] < first)
+            first = model_when[j];
+
+        int timeout = yc_timer_timeout(now);
+        if (timeout < 0 && first != UINT64_MAX)
+          fail("no timeout, but timers are set", -1);
+        if (timeout >= 0 && first != UINT64_MAX && now + timeout > first)
+          fail("timeout is after the first timer", -1);
+
+        /* sometimes sleep as long as we're told, sometimes not */
+        uint64_t step = rnd(2) && timeout >= 0 ? (uint64_t) timeout : rnd(3000);
+        uint64_t end = now + step;
+        do {
+          uint64_t left = end - now, by = 1 + rnd(200);
+          now += by < left ? by : left;
+          yc_timer_run(now);
+          for (int j = 0; j < MODEL_TIMERS; j++)
+            if (model_set[j] && model_when[j] <= now) {
+              fail("didn't go off", j);
+              model_set[j] = 0;
+            }
+        } while (now < end);
+      }
+    }
+  }
+
+  for (int i = 0; i < MODEL_TIMERS; i++)
+    yc_timer_cancel(&model[i]);
+}
+
+
+/* the scale check */
+static long scale_fired;
+
+static void scale_fire(yc_timer_t *t) {
+  if (t->yct_when != now)
+    fail("went off in the wrong millisecond", -1);
+  scale_fired++;
+}
+
+static void scale_check(void) {
+  yc_timer_t *timers = calloc(SCALE_TIMERS, sizeof(yc_timer_t));
+  if (!timers) {
+    perror("calloc");
+    exit(1);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < SCALE_TIMERS; i++)
+    yc_timer_set(&timers[i], now + 1000 + rnd(600000), scale_fire);
+  printf("set %d timers: %.1f ms\n", SCALE_TIMERS, ms_since(&start));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < SCALE_TIMERS; i++)
+    yc_timer_set(&timers[i], now + 1000 + rnd(600000), scale_fire);
+  printf("set them all again: %.1f ms\n", ms_since(&start));
+
+  long wakeups = 0;
+  int timeout;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uint64_t last = now + 1000 + 600000;
+  while ((timeout = yc_timer_timeout(now)) >= 0) {
+    /* a broken wheel could have us waiting forever */
+    if (now > last) {
+      fail("still waiting after the last timer", -1);
+      break;
+    }
+    now += timeout;
+    yc_timer_run(now);
+    wakeups++;
+  }
+  printf("run them all: %.1f ms, %ld wakeups\n", ms_since(&start), wakeups);
+
+  if (scale_fired != SCALE_TIMERS)
+    fail("not every timer went off", scale_fired);
+
+  free(timers);
+}
+
+
+int main(int argc, char **argv) {
+  model_check();
+  scale_check();
+
+  if (errors) {
+    printf("%ld failures\n", errors);
+    return 1;
+  }
+  printf("timers ok\n");
+  return 0;
+}
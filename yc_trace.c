@@ -0,0 +1,110 @@
+/* yc_trace - binary event journal for yoctochat servers */
+
+/* See yc_trace.h for what this is for. The only interesting part is handing
+ * out rings: the first time a thread records something, it takes the next
+ * free ring in the file. If they've all gone, the thread gets a tiny private
+ * ring instead, so it can carry on without checking, and its events are
+ * simply lost. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "yc_trace.h"
+
+int yc_trace_on;
+
+__thread yc_trace_thread_t yc_trace_thread;
+
+static yc_trace_file_t *yc_trace_file;
+static size_t           yc_trace_ring_size;
+
+/* where threads go when there's no ring left for them */
+static __thread struct {
+  yc_trace_ring_t ring;
+  yc_trace_rec_t  rec;
+} yc_trace_nowhere;
+
+
+static uint64_t yc_trace_clock(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t yc_trace_gettid(void) {
+#ifdef SYS_gettid
+  return (uint32_t) syscall(SYS_gettid);
+#else
+  return (uint32_t) getpid();
+#endif
+}
+
+void yc_trace_open(const char *path, size_t ring_cap) {
+  /* round up to a power of two, so the ring can wrap with a mask */
+  size_t cap = 1;
+  while (cap < ring_cap)
+    cap <<= 1;
+
+  yc_trace_ring_size = sizeof(yc_trace_ring_t) + cap * sizeof(yc_trace_rec_t);
+  size_t size = YC_TRACE_HDR_SIZE + YC_TRACE_MAX_RINGS * yc_trace_ring_size;
+
+  /* start from scratch each time. the file is sparse, so rings that never
+   * get used (or filled) don't take up any disk */
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(path);
+    exit(1);
+  }
+  if (ftruncate(fd, size) < 0) {
+    perror("ftruncate");
+    exit(1);
+  }
+
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  close(fd);
+
+  yc_trace_file = map;
+  yc_trace_file->ytf_rec_size  = sizeof(yc_trace_rec_t);
+  yc_trace_file->ytf_ring_cap  = cap;
+  yc_trace_file->ytf_max_rings = YC_TRACE_MAX_RINGS;
+  yc_trace_file->ytf_nrings    = 0;
+  yc_trace_file->ytf_pid       = getpid();
+  yc_trace_file->ytf_mono_base = yc_trace_clock(CLOCK_MONOTONIC);
+  yc_trace_file->ytf_real_base = yc_trace_clock(CLOCK_REALTIME);
+
+  /* magic goes in last, so a decoder never sees a half-written header */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(yc_trace_file->ytf_magic, YC_TRACE_MAGIC, sizeof(yc_trace_file->ytf_magic));
+
+  yc_trace_on = 1;
+}
+
+void yc_trace_claim(void) {
+  yc_trace_thread_t *t = &yc_trace_thread;
+
+  uint32_t n = __atomic_fetch_add(&yc_trace_file->ytf_nrings, 1, __ATOMIC_RELAXED);
+  if (n >= YC_TRACE_MAX_RINGS) {
+    /* undo, so ytf_nrings stays truthful for the decoder */
+    __atomic_fetch_sub(&yc_trace_file->ytf_nrings, 1, __ATOMIC_RELAXED);
+    t->ytt_ring = &yc_trace_nowhere.ring;
+    t->ytt_recs = &yc_trace_nowhere.rec;
+    t->ytt_mask = 0;
+    return;
+  }
+
+  char *base = (char *) yc_trace_file + YC_TRACE_HDR_SIZE + n * yc_trace_ring_size;
+  t->ytt_ring = (yc_trace_ring_t *) base;
+  t->ytt_recs = (yc_trace_rec_t *) (base + sizeof(yc_trace_ring_t));
+  t->ytt_mask = yc_trace_file->ytf_ring_cap - 1;
+
+  t->ytt_ring->ytr_tid = yc_trace_gettid();
+}
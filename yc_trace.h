@@ -0,0 +1,121 @@
+/* yc_trace - binary event journal for yoctochat servers */
+
+/* Text logging (yc_log.h) is for people watching a server. This is for the
+ * morning after: when something went wrong and you want to know exactly what
+ * the server was doing in the seconds before.
+ *
+ * Each thread that traces gets its own ring of fixed-size records inside a
+ * file that's mmap()'d shared. Recording an event is a clock read and a few
+ * stores into memory; there's no formatting, no locking and no syscall. The
+ * kernel owns the pages, so even if the server crashes, everything it
+ * recorded is in the file, and the last few million events can be decoded
+ * afterwards with yc_tracedump.
+ *
+ * When tracing is off (the default), each trace point costs one test of a
+ * global.
+ */
+
+#ifndef YC_TRACE_H
+#define YC_TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* file layout. a header page, then YC_TRACE_MAX_RINGS rings, each a ring
+ * header followed by a power-of-two number of records. everything is in
+ * native byte order; the decoder is expected to run on the same machine */
+#define YC_TRACE_MAGIC     "YCTRACE1"
+#define YC_TRACE_HDR_SIZE  (4096)
+#define YC_TRACE_MAX_RINGS (4)
+
+typedef struct {
+  char     ytf_magic[8];
+  uint32_t ytf_rec_size;    /* sizeof(yc_trace_rec_t) */
+  uint32_t ytf_ring_cap;    /* records per ring */
+  uint32_t ytf_max_rings;
+  uint32_t ytf_nrings;      /* rings claimed so far */
+  uint32_t ytf_pid;
+  uint32_t ytf_pad;
+  uint64_t ytf_mono_base;   /* CLOCK_MONOTONIC and CLOCK_REALTIME at start, */
+  uint64_t ytf_real_base;   /* so timestamps can be turned into wall time */
+} yc_trace_file_t;
+
+/* ring header. ytr_head counts every record ever written to the ring; the
+ * live ones are the last ytf_ring_cap of them */
+typedef struct {
+  uint64_t ytr_head;
+  uint32_t ytr_tid;
+  uint32_t ytr_pad[13];
+} yc_trace_ring_t;
+
+/* what happened */
+enum {
+  YC_TRACE_CONNECT = 1,     /* new connection */
+  YC_TRACE_READ,            /* bytes arrived; latency is time spent handling them */
+  YC_TRACE_WRITE,           /* bytes sent; latency is how long the oldest had been queued */
+  YC_TRACE_CLOSE,           /* disconnected; bytes is unsent output, latency is lifetime */
+  YC_TRACE_OQFULL,          /* output queue overflowed; bytes is how much was queued */
+};
+
+/* one event. 32 bytes, so two to a cache line */
+typedef struct {
+  uint64_t ytr_ts;          /* CLOCK_MONOTONIC, ns */
+  uint64_t ytr_latency;     /* ns, meaning depends on kind */
+  uint32_t ytr_bytes;
+  int32_t  ytr_fd;
+  uint32_t ytr_kind;
+  uint32_t ytr_aux;
+} yc_trace_rec_t;
+
+
+/* nonzero if yc_trace_open() succeeded */
+extern int yc_trace_on;
+
+/* create the trace file at path, with room for ring_cap records per thread
+ * (rounded up to a power of two). exits if it can't */
+void yc_trace_open(const char *path, size_t ring_cap);
+
+/* internal; used by yc_trace() below */
+typedef struct {
+  yc_trace_ring_t *ytt_ring;
+  yc_trace_rec_t  *ytt_recs;
+  uint64_t         ytt_mask;
+} yc_trace_thread_t;
+
+extern __thread yc_trace_thread_t yc_trace_thread;
+void yc_trace_claim(void);
+
+
+static inline uint64_t yc_trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* record an event, with a timestamp we already have */
+static inline void yc_trace_at(uint64_t ts, uint32_t kind, int fd, uint64_t bytes, uint64_t latency) {
+  yc_trace_thread_t *t = &yc_trace_thread;
+  if (!t->ytt_ring)
+    yc_trace_claim();
+
+  /* fill in the record, then publish it by moving the head. a crash halfway
+   * through leaves the head where it was, so the decoder never sees a torn
+   * record */
+  uint64_t head = t->ytt_ring->ytr_head;
+  yc_trace_rec_t *r = &t->ytt_recs[head & t->ytt_mask];
+  r->ytr_ts      = ts;
+  r->ytr_latency = latency;
+  r->ytr_bytes   = bytes > UINT32_MAX ? UINT32_MAX : (uint32_t) bytes;
+  r->ytr_fd      = fd;
+  r->ytr_kind    = kind;
+  r->ytr_aux     = 0;
+  __atomic_store_n(&t->ytt_ring->ytr_head, head+1, __ATOMIC_RELEASE);
+}
+
+#define yc_trace(kind, fd, bytes, latency)                              \
+  do {                                                                  \
+    if (yc_trace_on)                                                    \
+      yc_trace_at(yc_trace_now(), kind, fd, bytes, latency);            \
+  } while (0)
+
+#endif
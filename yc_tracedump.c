@@ -0,0 +1,231 @@
+/* yc_tracedump - decode a yoctochat server's binary trace file */
+
+/* A server run with -o trace=path records every connection event into that
+ * file (see yc_trace.h). This turns it back into something a person can read:
+ * the events from every thread's ring, merged into time order, with wall
+ * clock timestamps. It works on the file from a server that's still running
+ * or one that's crashed; either way it shows what was recorded up to that
+ * point.
+ *
+ * Each ring only holds its most recent events, so the oldest ones have
+ * probably been overwritten. What's left is the last few seconds (or hours,
+ * for a quiet server), which is usually what you want after an incident.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "yc_trace.h"
+
+/* an event, plus which ring it came from */
+typedef struct {
+  yc_trace_rec_t rec;
+  int            ring;
+} event_t;
+
+static const char *kind_names[] = {
+  [YC_TRACE_CONNECT] = "connect",
+  [YC_TRACE_READ]    = "read",
+  [YC_TRACE_WRITE]   = "write",
+  [YC_TRACE_CLOSE]   = "close",
+  [YC_TRACE_OQFULL]  = "oqfull",
+};
+#define NUM_KINDS (sizeof(kind_names) / sizeof(kind_names[0]))
+
+static const char *kind_name(uint32_t kind) {
+  return kind < NUM_KINDS && kind_names[kind] ? kind_names[kind] : "?";
+}
+
+static int kind_parse(const char *name) {
+  for (int k = 0; k < NUM_KINDS; k++)
+    if (kind_names[k] && strcmp(kind_names[k], name) == 0)
+      return k;
+  return -1;
+}
+
+static int event_cmp(const void *a, const void *b) {
+  uint64_t ta = ((const event_t *) a)->rec.ytr_ts;
+  uint64_t tb = ((const event_t *) b)->rec.ytr_ts;
+  return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+/* turn a monotonic timestamp into "YYYY-mm-dd HH:MM:SS.uuuuuu" */
+static void format_time(const yc_trace_file_t *hdr, uint64_t ts, char *buf, size_t len) {
+  uint64_t real = hdr->ytf_real_base + (ts - hdr->ytf_mono_base);
+  time_t sec = real / 1000000000ull;
+  struct tm tm;
+  localtime_r(&sec, &tm);
+  size_t n = strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm);
+  snprintf(buf+n, len-n, ".%06llu", (unsigned long long) (real % 1000000000ull) / 1000);
+}
+
+
+static void usage(const char *prog) {
+  printf("usage: %s [-n count] [-f fd] [-k kind] [-s] <tracefile>\n"
+         "  -n count  only show the last count events\n"
+         "  -f fd     only show events for this descriptor\n"
+         "  -k kind   only show events of this kind (connect, read, write, close, oqfull)\n"
+         "  -s        show a summary for each kind instead of the events\n",
+         prog);
+}
+
+int main(int argc, char **argv) {
+  long last = -1;
+  int want_fd = -1, want_kind = -1, summary = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:f:k:sh")) != -1) {
+    switch (opt) {
+      case 'n': last = atol(optarg); break;
+      case 'f': want_fd = atoi(optarg); break;
+      case 'k':
+        if ((want_kind = kind_parse(optarg)) < 0) {
+          fprintf(stderr, "unknown event kind '%s'\n", optarg);
+          exit(2);
+        }
+        break;
+      case 's': summary = 1; break;
+      case 'h': usage(argv[0]); exit(0);
+      default:  usage(argv[0]); exit(2);
+    }
+  }
+  if (argc - optind != 1) {
+    usage(argv[0]);
+    exit(2);
+  }
+
+  const char *path = argv[optind];
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    exit(1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("fstat");
+    exit(1);
+  }
+  if (st.st_size < YC_TRACE_HDR_SIZE) {
+    fprintf(stderr, "%s: too short to be a trace file\n", path);
+    exit(1);
+  }
+
+  const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  close(fd);
+
+  /* check this is a file we understand */
+  const yc_trace_file_t *hdr = (const yc_trace_file_t *) map;
+  if (memcmp(hdr->ytf_magic, YC_TRACE_MAGIC, sizeof(hdr->ytf_magic)) != 0 ||
+      hdr->ytf_rec_size != sizeof(yc_trace_rec_t) || hdr->ytf_ring_cap == 0) {
+    fprintf(stderr, "%s: not a trace file, or from a different version\n", path);
+    exit(1);
+  }
+
+  size_t cap       = hdr->ytf_ring_cap;
+  size_t ring_size = sizeof(yc_trace_ring_t) + cap * sizeof(yc_trace_rec_t);
+  unsigned nrings  = hdr->ytf_nrings;
+  if (nrings > hdr->ytf_max_rings)
+    nrings = hdr->ytf_max_rings;
+  if (YC_TRACE_HDR_SIZE + hdr->ytf_max_rings * ring_size > st.st_size) {
+    fprintf(stderr, "%s: truncated\n", path);
+    exit(1);
+  }
+
+  /* gather up every live record from every ring */
+  event_t *events = NULL;
+  size_t nevents = 0, maxevents = 0;
+
+  printf("# pid %u, %u rings of %zu events\n", hdr->ytf_pid, nrings, cap);
+
+  for (unsigned r = 0; r < nrings; r++) {
+    const char *base = map + YC_TRACE_HDR_SIZE + r * ring_size;
+    const yc_trace_ring_t *ring = (const yc_trace_ring_t *) base;
+    const yc_trace_rec_t  *recs = (const yc_trace_rec_t *) (base + sizeof(yc_trace_ring_t));
+
+    /* the head only moves once a record is complete. if the server died
+     * while writing, it was writing over the oldest record, so skip that
+     * one if the ring has wrapped */
+    uint64_t head  = ring->ytr_head;
+    uint64_t first = head > cap ? head - cap + 1 : 0;
+
+    printf("# ring %u: thread %u, %llu events recorded, %llu kept\n", r, ring->ytr_tid,
+      (unsigned long long) head, (unsigned long long) (head - first));
+
+    for (uint64_t i = first; i < head; i++) {
+      const yc_trace_rec_t *rec = &recs[i & (cap-1)];
+      if (want_fd >= 0 && rec->ytr_fd != want_fd)
+        continue;
+      if (want_kind >= 0 && rec->ytr_kind != want_kind)
+        continue;
+
+      if (nevents == maxevents) {
+        maxevents = maxevents ? maxevents * 2 : 65536;
+        events = realloc(events, maxevents * sizeof(event_t));
+        if (!events) {
+          perror("realloc");
+          exit(1);
+        }
+      }
+      events[nevents].rec  = *rec;
+      events[nevents].ring = r;
+      nevents++;
+    }
+  }
+
+  qsort(events, nevents, sizeof(event_t), event_cmp);
+
+  if (summary) {
+    struct {
+      uint64_t count, bytes, lat_total, lat_max;
+    } kinds[NUM_KINDS] = { 0 };
+
+    for (size_t i = 0; i < nevents; i++) {
+      const yc_trace_rec_t *rec = &events[i].rec;
+      if (rec->ytr_kind >= NUM_KINDS)
+        continue;
+      kinds[rec->ytr_kind].count++;
+      kinds[rec->ytr_kind].bytes     += rec->ytr_bytes;
+      kinds[rec->ytr_kind].lat_total += rec->ytr_latency;
+      if (rec->ytr_latency > kinds[rec->ytr_kind].lat_max)
+        kinds[rec->ytr_kind].lat_max = rec->ytr_latency;
+    }
+
+    if (nevents > 0) {
+      char from[64], to[64];
+      format_time(hdr, events[0].rec.ytr_ts, from, sizeof(from));
+      format_time(hdr, events[nevents-1].rec.ytr_ts, to, sizeof(to));
+      printf("# %s to %s\n", from, to);
+    }
+
+    printf("%-8s %12s %14s %14s %14s\n", "kind", "count", "bytes", "avg lat us", "max lat us");
+    for (int k = 0; k < NUM_KINDS; k++) {
+      if (!kind_names[k] || !kinds[k].count)
+        continue;
+      printf("%-8s %12llu %14llu %14.1f %14.1f\n", kind_names[k],
+        (unsigned long long) kinds[k].count, (unsigned long long) kinds[k].bytes,
+        kinds[k].lat_total / 1000.0 / kinds[k].count, kinds[k].lat_max / 1000.0);
+    }
+    return 0;
+  }
+
+  size_t start = (last >= 0 && last < nevents) ? nevents - last : 0;
+  for (size_t i = start; i < nevents; i++) {
+    const yc_trace_rec_t *rec = &events[i].rec;
+    char when[64];
+    format_time(hdr, rec->ytr_ts, when, sizeof(when));
+    printf("%s  t%d  %-7s  fd %-6d  bytes %-8u  lat %.1fus\n", when, events[i].ring,
+      kind_name(rec->ytr_kind), rec->ytr_fd, rec->ytr_bytes, rec->ytr_latency / 1000.0);
+  }
+
+  return 0;
+}
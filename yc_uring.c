@@ -34,19 +34,24 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <arpa/inet.h>
-#include <sys/ioctl.h>
+#include <poll.h>
 #include <liburing.h>
 #include <errno.h>
 
-/* max number of connections. in a real program you probably wouldn't do this,
- * and instead use a more dynamic structure for tracking connections */
-#define NUM_CONNS (128)
+#include "yc_core.h"
+#include "yc_log.h"
+#include "yc_store.h"
 
 /* max number of requests in flight. there will be an accept request, one read
- * request per active conn, and potentionally a write per active conn too. so
- * twice NUM_CONNS should be enough. */
-#define QUEUE_DEPTH (256)
+ * request per active conn, and potentionally a write per active conn too. if
+ * we ever run out of submission slots we just submit what we have and carry
+ * on, so this doesn't limit the number of connections, but bigger means fewer
+ * trips into the kernel */
+#define QUEUE_DEPTH (1024)
+
+/* most to move from a file to a socket in one go. a pipe holds 64K by
+ * default, so there's no point asking for more */
+#define YC_SPLICE_MAX (65536)
 
 
 /* our request objects. we need to make space for request and result data to be
@@ -59,6 +64,10 @@ typedef enum {
   YCR_KIND_READ,
   YCR_KIND_WRITE,
   YCR_KIND_CLOSE,
+  YCR_KIND_STORE,
+  YCR_KIND_SPLICE_IN,
+  YCR_KIND_SPLICE_OUT,
+  YCR_KIND_POLL,
 } ycr_kind_t;
 
 /* minimal request; just the kind and the file descriptor it relates to. used
@@ -68,14 +77,23 @@ typedef struct {
   int        ycr_fd;
 } yc_request_t;
 
-/* read/write request. only readv/writev equivalents are available, so we put
- * an iovec in here, and enough buffer space to handle whatever we might read
- * or write. you definitely wouldn't do it this way in a real server */
+/* read request. only readv/writev equivalents are available, so we put an
+ * iovec in here. it points into the connection's input buffer, so the data
+ * lands exactly where the core wants it */
 typedef struct {
   yc_request_t ycr_req;
   struct iovec ycr_iovec;
-  char         ycr_iobuf[1024];
-} yc_io_request_t;
+} yc_read_request_t;
+
+/* write request. the iovecs point straight at the buffers in the
+ * connection's output queue, so there's no copying at all: the message that
+ * was read from the sender is the same memory the kernel sends from */
+typedef struct {
+  yc_request_t ycr_req;
+  int          ycr_niov;
+  size_t       ycr_len;
+  struct iovec ycr_iov[YC_IOV_MAX];
+} yc_write_request_t;
 
 /* an accept request. carries space for the client IP and port */
 typedef struct {
@@ -84,6 +102,80 @@ typedef struct {
   socklen_t          ycr_addrlen;
 } yc_accept_request_t;
 
+/* a message log write. it's two requests, a write and then a sync, linked
+ * so the kernel won't start the sync until the write is done. both come
+ * back to us separately, and the batch is finished when they have */
+typedef struct {
+  yc_request_t      ycr_req;
+  yc_store_batch_t *ycr_batch;
+  int               ycr_pending;
+  int               ycr_err;
+} yc_store_request_t;
+
+/* per-connection state. a connection has at most one read and one write in
+ * flight at a time, so rather than allocating requests over and over, each
+ * connection carries its own.
+ *
+ * when there's a file range at the front of the output queue (see
+ * yc_buf_file()), there's no sendfile for io_uring, but there is splice,
+ * which does the same thing through a pipe: one splice from the file into
+ * the pipe, linked to another from the pipe to the socket. the bytes only
+ * ever move around inside the kernel. each connection gets its own pipe the
+ * first time it needs one.
+ *
+ * when a write comes up short, the socket's full (the core sets
+ * TCP_NOTSENT_LOWAT, so that's only a little unsent data). we could ask for
+ * another write straight away, and the kernel would hold on to it until
+ * there's room, but then it'd be holding on to the output queue too, and
+ * whatever's in it couldn't be dropped or sent in a different order. so
+ * instead we ask to be told when the socket's writable (a poll request),
+ * and only then work out what to write */
+typedef struct {
+  yc_read_request_t  ycu_rreq;
+  yc_write_request_t ycu_wreq;
+  yc_request_t       ycu_sinreq;
+  yc_request_t       ycu_soutreq;
+  yc_request_t       ycu_preq;
+  int                ycu_pipe[2];
+  size_t             ycu_piped;    /* bytes in the pipe, not sent yet */
+} yc_uconn_t;
+
+/* backend flags: what requests this connection has in flight */
+#define YCU_READING    (1<<0)
+#define YCU_WRITING    (1<<1)
+#define YCU_SPLICE_IN  (1<<2)
+#define YCU_SPLICE_OUT (1<<3)
+#define YCU_POLLING    (1<<4)
+
+
+/* the ring. it's global so the backend functions the core calls can get at
+ * it */
+static struct io_uring ring;
+
+/* wait for a CQE, but not past when the core next has something to do.
+ * returns -ETIME if that came first */
+static int yc_wait_cqe(struct io_uring_cqe **cqe) {
+  int timeout = yc_core_timeout();
+  if (timeout < 0)
+    return io_uring_wait_cqe(&ring, cqe);
+
+  struct __kernel_timespec ts = {
+    .tv_sec  = timeout / 1000,
+    .tv_nsec = (timeout % 1000) * 1000000,
+  };
+  return io_uring_wait_cqe_timeout(&ring, cqe, &ts);
+}
+
+/* get a free submission queue entry. if the queue is full, submit what's in
+ * it to make room */
+static struct io_uring_sqe *yc_get_sqe(void) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+  if (!sqe) {
+    io_uring_submit(&ring);
+    sqe = io_uring_get_sqe(&ring);
+  }
+  return sqe;
+}
 
 /* allocate a minimal request */
 static yc_request_t *yc_req_new(ycr_kind_t event, int fd) {
@@ -93,16 +185,6 @@ static yc_request_t *yc_req_new(ycr_kind_t event, int fd) {
   return req;
 }
 
-/* allocate a read/write request for the given fd */
-static yc_io_request_t *yc_io_req_new(ycr_kind_t event, int fd) {
-  yc_io_request_t *req = malloc(sizeof(yc_io_request_t));
-  req->ycr_req.ycr_event  = event;
-  req->ycr_req.ycr_fd     = fd;
-  req->ycr_iovec.iov_base = req->ycr_iobuf;
-  req->ycr_iovec.iov_len  = sizeof(req->ycr_iobuf);
-  return req;
-}
-
 /* allocate an accept request for the given server fd */
 static yc_accept_request_t *yc_accept_req_new(int fd) {
   yc_accept_request_t *req = malloc(sizeof(yc_accept_request_t));
@@ -118,71 +200,191 @@ static void yc_req_free(yc_request_t *req) {
 }
 
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("usage: %s <port>\n", argv[0]);
-    exit(1);
-  }
+/* set up an async read for a connection, into the free space at the end of
+ * its input buffer */
+static void yc_uring_read(yc_conn_t *c) {
+  yc_uconn_t *u = c->ycc_bdata;
+  yc_read_request_t *rreq = &u->ycu_rreq;
+  rreq->ycr_iovec = yc_conn_rbuf(c);
 
-  int port = atoi(argv[1]);
-  if (port <= 0) {
-    printf("'%s' not a valid port number\n", argv[1]);
-    exit(1);
-  }
+  struct io_uring_sqe *sqe = yc_get_sqe();
+  io_uring_prep_readv(sqe, c->ycc_fd, &rreq->ycr_iovec, 1, 0);
+  io_uring_sqe_set_data(sqe, rreq);
 
-  /* create the server socket */
-  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
-    perror("socket");
-    exit(1);
+  c->ycc_bflags |= YCU_READING;
+}
+
+/* finish closing a connection, if it's safe to. we can't let go of the
+ * connection while the kernel still has requests that point into it, so we
+ * wait for them all to come back first */
+static void yc_uring_release(yc_conn_t *c) {
+  if (c->ycc_bflags & (YCU_READING | YCU_WRITING | YCU_SPLICE_IN | YCU_SPLICE_OUT | YCU_POLLING))
+    return;
+
+  int fd = c->ycc_fd;
+  yc_uconn_t *u = c->ycc_bdata;
+  if (u->ycu_pipe[0] >= 0) {
+    close(u->ycu_pipe[0]);
+    close(u->ycu_pipe[1]);
   }
+  free(u);
+  yc_conn_free(c);
+
+  /* make a async close request. we use a minimal request object because
+   * close has no interesting args or return; we just need a marker so we can
+   * recognise the response for what it is */
+  yc_request_t *clreq = yc_req_new(YCR_KIND_CLOSE, fd);
+  struct io_uring_sqe *sqe = yc_get_sqe();
+  io_uring_prep_close(sqe, fd);
+  io_uring_sqe_set_data(sqe, clreq);
+}
 
-  /* arrange for the listening address to be reusable. This makes TCP
-   * marginally "less safe" (for a whole bunch of obscure reasons) but allows
-   * us to kill and restart the program with ease */
-  int onoff = 1;
-  if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &onoff, sizeof(onoff)) < 0) {
-    perror("setsockopt");
-    exit(1);
+
+/* wait for the socket to have room before writing any more */
+static void yc_uring_poll_out(yc_conn_t *c) {
+  yc_uconn_t *u = c->ycc_bdata;
+  struct io_uring_sqe *sqe = yc_get_sqe();
+  io_uring_prep_poll_add(sqe, c->ycc_fd, POLLOUT);
+  io_uring_sqe_set_data(sqe, &u->ycu_preq);
+  c->ycc_bflags |= YCU_POLLING;
+  yc_stats.ycs_oq_blocked++;
+}
+
+/* send what's in the pipe on to the socket */
+static void yc_uring_splice_out(yc_conn_t *c) {
+  yc_uconn_t *u = c->ycc_bdata;
+  struct io_uring_sqe *sqe = yc_get_sqe();
+  io_uring_prep_splice(sqe, u->ycu_pipe[0], -1, c->ycc_fd, -1, u->ycu_piped, 0);
+  io_uring_sqe_set_data(sqe, &u->ycu_soutreq);
+  c->ycc_bflags |= YCU_SPLICE_OUT;
+}
+
+/* move a file range from the front of the output queue to the socket, by
+ * way of the pipe */
+static void yc_uring_splice(yc_conn_t *c, int ffd, off_t off, size_t len) {
+  yc_uconn_t *u = c->ycc_bdata;
+  if (u->ycu_pipe[0] < 0 && pipe(u->ycu_pipe) < 0) {
+    yc_log(YC_LOG_ERROR, "pipe(%d): %s", c->ycc_fd, strerror(errno));
+    u->ycu_pipe[0] = u->ycu_pipe[1] = -1;
+    yc_conn_close(c);
+    return;
   }
 
-  /* set up the address structure for binding, which is *:<port> */
-  struct sockaddr_in sin = {
-    .sin_family = AF_INET,
-    .sin_port   = htons(port),
-    .sin_addr   = {
-      .s_addr = htonl(INADDR_ANY)
-    }
-  };
-  socklen_t sin_len = sizeof(sin);
+  if (len > YC_SPLICE_MAX)
+    len = YC_SPLICE_MAX;
 
-  /* bind the server socket to the wanted address */
-  if (bind(server_fd, (struct sockaddr *) &sin, sin_len) < 0) {
-    perror("bind");
-    exit(1);
+  /* a link can't cross a submission, so make sure there's room for both */
+  if (io_uring_sq_space_left(&ring) < 2)
+    io_uring_submit(&ring);
+
+  /* the first fills the pipe. if it comes up short, the kernel cancels the
+   * second, and we'll send what did make it next time around */
+  struct io_uring_sqe *sqe = yc_get_sqe();
+  io_uring_prep_splice(sqe, ffd, off, u->ycu_pipe[1], -1, len, 0);
+  io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+  io_uring_sqe_set_data(sqe, &u->ycu_sinreq);
+
+  sqe = yc_get_sqe();
+  io_uring_prep_splice(sqe, u->ycu_pipe[0], -1, c->ycc_fd, -1, len, 0);
+  io_uring_sqe_set_data(sqe, &u->ycu_soutreq);
+
+  c->ycc_bflags |= YCU_SPLICE_IN | YCU_SPLICE_OUT;
+}
+
+/* called by the core when a connection has output queued. if there's
+ * already a write in flight, or we're waiting for room to write, we leave it
+ * be; when that completes we'll come back here for whatever's left */
+void yc_backend_flush(yc_conn_t *c) {
+  if (c->ycc_bflags & (YCU_WRITING | YCU_SPLICE_IN | YCU_SPLICE_OUT | YCU_POLLING))
+    return;
+
+  /* finish sending what's in the pipe before anything else */
+  yc_uconn_t *u = c->ycc_bdata;
+  if (u->ycu_piped) {
+    yc_uring_splice_out(c);
+    return;
   }
 
-  /* and open it for connections! */
-  if (listen(server_fd, 10) < 0) {
-    perror("listen");
-    exit(1);
+  int ffd;
+  off_t off;
+  size_t len;
+  if (yc_conn_wfile(c, &ffd, &off, &len)) {
+    yc_uring_splice(c, ffd, off, len);
+    return;
   }
 
-  printf("listening on port %d\n", port);
+  yc_write_request_t *wreq = &u->ycu_wreq;
+  wreq->ycr_niov = yc_conn_wbuf(c, wreq->ycr_iov, YC_IOV_MAX);
+  if (!wreq->ycr_niov)
+    return;
+
+  wreq->ycr_len = 0;
+  for (int i = 0; i < wreq->ycr_niov; i++)
+    wreq->ycr_len += wreq->ycr_iov[i].iov_len;
+
+  /* async write request. everything that's queued goes in a single writev,
+   * no matter how many messages it is */
+  struct io_uring_sqe *sqe = yc_get_sqe();
+  io_uring_prep_writev(sqe, c->ycc_fd, wreq->ycr_iov, wreq->ycr_niov, 0);
+  io_uring_sqe_set_data(sqe, wreq);
+
+  c->ycc_bflags |= YCU_WRITING;
+}
+
+/* called by the core to stop or start reading from a connection. we only
+ * ever have one read in flight, and we don't ask for another while it's
+ * paused (see YCR_KIND_READ), so stopping is nothing to do. if there's
+ * still a read in flight when it starts again, that'll carry on by itself */
+void yc_backend_pause(yc_conn_t *c, int paused) {
+  if (!paused && !(c->ycc_bflags & YCU_READING))
+    yc_uring_read(c);
+}
+
+/* called by the core when a connection is going away. there may be a read or
+ * write in flight; shutting down the socket makes them complete right away
+ * (with zero or an error), and then we can finish up */
+void yc_backend_close(yc_conn_t *c) {
+  shutdown(c->ycc_fd, SHUT_RDWR);
+  yc_uring_release(c);
+}
+
+
+/* called by the core with a batch of the message log to write. unlike the
+ * readiness servers, we can do file IO without blocking, so we do it
+ * ourselves */
+void yc_backend_store_write(yc_store_batch_t *b) {
+  yc_store_request_t *req = malloc(sizeof(yc_store_request_t));
+  req->ycr_req.ycr_event = YCR_KIND_STORE;
+  req->ycr_req.ycr_fd    = b->ycsb_fd;
+  req->ycr_batch         = b;
+  req->ycr_pending       = 2;
+  req->ycr_err           = 0;
+
+  /* a link can't cross a submission, so make sure there's room for both */
+  if (io_uring_sq_space_left(&ring) < 2)
+    io_uring_submit(&ring);
+
+  struct io_uring_sqe *sqe = yc_get_sqe();
+  io_uring_prep_write(sqe, b->ycsb_fd, b->ycsb_data, b->ycsb_len, b->ycsb_off);
+  io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+  io_uring_sqe_set_data(sqe, req);
+
+  sqe = yc_get_sqe();
+  io_uring_prep_fsync(sqe, b->ycsb_fd, IORING_FSYNC_DATASYNC);
+  io_uring_sqe_set_data(sqe, req);
+}
+
+
+int main(int argc, char **argv) {
+  /* the core handles the commandline and sets up the listening socket for
+   * us */
+  int server_fd = yc_core_init(argc, argv, 0);
 
-  struct io_uring ring;
   if (io_uring_queue_init(QUEUE_DEPTH, &ring, 0) < 0) {
     perror("io_uring_queue_init");
     exit(1);
   }
 
-  /* create storage for our active connections. in a real server, this would be
-   * some mapping from file descriptor -> connection object. here the only
-   * thing we're interested is if the descriptor is connected at all, so a bool
-   * (int) is enough: if conns[fd] is true, then fd is connected right now */
-  int conns[NUM_CONNS];
-  memset(&conns, 0, sizeof(conns));
-
   /* start with async form of accept(). just like the traditional version, it
    * will "block" until there's something to read, but that all happens inside
    * the kernel so we don't have to worry about it.
@@ -191,191 +393,275 @@ int main(int argc, char **argv) {
    * for the an async accept(), include our own request state so we can
    * understand the completion queue entry (CQE) that comes back, and submit it
    * for processing */
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-  yc_accept_request_t *req = yc_accept_req_new(server_fd);
-  io_uring_prep_accept(sqe, server_fd, (struct sockaddr *) &req->ycr_addr, &req->ycr_addrlen, 0);
-  io_uring_sqe_set_data(sqe, req);
+  struct io_uring_sqe *sqe = yc_get_sqe();
+  yc_accept_request_t *areq = yc_accept_req_new(server_fd);
+  io_uring_prep_accept(sqe, server_fd, (struct sockaddr *) &areq->ycr_addr, &areq->ycr_addrlen, 0);
+  io_uring_sqe_set_data(sqe, areq);
   io_uring_submit(&ring);
 
-  /* main loop. we just wait until a CQE is available, then process it */
+  /* main loop. we wait until a CQE is available, then process it and any
+   * others that are ready. new requests made while processing are batched up
+   * and submitted together at the end, in a single system call */
   struct io_uring_cqe *cqe;
-  while (io_uring_wait_cqe(&ring, &cqe) >= 0) {
+  int ret;
+  while ((ret = yc_wait_cqe(&cqe)) >= 0 || ret == -EINTR || ret == -ETIME) {
+    /* a signal arrived, or the core has something to do; nothing's wrong */
+    if (ret < 0) {
+      yc_core_tick();
+      io_uring_submit(&ring);
+      continue;
+    }
 
-    /* get our own request back. for the moment, just the header */
-    yc_request_t *req = (yc_request_t *) cqe->user_data;
-    int fd = req->ycr_fd;
+    do {
+      /* get our own request back. for the moment, just the header */
+      yc_request_t *req = (yc_request_t *) cqe->user_data;
+      int fd = req->ycr_fd;
 
-    /* the return value of the underlying syscall. typically a negative value
-     * will be the negated errno value for the call, so we can still do error
-     * handling */
-    int res = cqe->res;
+      /* the return value of the underlying syscall. typically a negative value
+       * will be the negated errno value for the call, so we can still do error
+       * handling */
+      int res = cqe->res;
 
-    /* do the right thing depending on what kind of request just completed */
-    switch (req->ycr_event) {
+      /* do the right thing depending on what kind of request just completed */
+      switch (req->ycr_event) {
 
-      /* someone connected! */
-      case YCR_KIND_ACCEPT: {
-        /* get a handle on the more specialised request */
-        yc_accept_request_t *areq = (yc_accept_request_t *) req;
+        /* someone connected! */
+        case YCR_KIND_ACCEPT: {
+          /* get a handle on the more specialised request */
+          yc_accept_request_t *areq = (yc_accept_request_t *) req;
 
-        /* maybe it failed? */
-        if (res < 0) {
-          /* note negation of return value in place of errno */
-          fprintf(stderr, "accept: %s\n", strerror(-res));
-        }
+          /* maybe it failed? */
+          if (res < 0) {
+            /* note negation of return value in place of errno */
+            yc_log(YC_LOG_ERROR, "accept: %s", strerror(-res));
+          }
+
+          else {
+            /* hello! client address is in the req object, because that's what
+             * we pointed the request to in io_uring_prep_accept. the core
+             * will take it from here */
+            yc_conn_t *c = yc_conn_open(res, &areq->ycr_addr);
+            if (c) {
+              c->ycc_bdata = calloc(1, sizeof(yc_uconn_t));
+              yc_uconn_t *u = c->ycc_bdata;
+              u->ycu_rreq.ycr_req.ycr_event = YCR_KIND_READ;
+              u->ycu_rreq.ycr_req.ycr_fd    = res;
+              u->ycu_wreq.ycr_req.ycr_event = YCR_KIND_WRITE;
+              u->ycu_wreq.ycr_req.ycr_fd    = res;
+              u->ycu_sinreq  = (yc_request_t) { .ycr_event = YCR_KIND_SPLICE_IN,  .ycr_fd = res };
+              u->ycu_soutreq = (yc_request_t) { .ycr_event = YCR_KIND_SPLICE_OUT, .ycr_fd = res };
+              u->ycu_preq    = (yc_request_t) { .ycr_event = YCR_KIND_POLL,       .ycr_fd = res };
+              u->ycu_pipe[0] = u->ycu_pipe[1] = -1;
+
+              /* set up an async read for the new connection */
+              yc_uring_read(c);
+            }
+          }
 
-        else {
-          /* hello! client address is in the req object, because that's what we
-           * pointed the request to in io_uring_prep_accept */
-          printf("[%d] connect from %s:%d\n", res, inet_ntoa(areq->ycr_addr.sin_addr), ntohs(areq->ycr_addr.sin_port));
-
-          /* remember our new connection. in a real server, you'd create a
-           * connection or user object of some sort, maybe send them a
-           * greeting, begin authentication, etc */
-          conns[res] = 1;
-
-          /* set up an async read for the new connection */
-          sqe = io_uring_get_sqe(&ring);
-          yc_io_request_t *rreq = yc_io_req_new(YCR_KIND_READ, res);
-          io_uring_prep_readv(sqe, res, &rreq->ycr_iovec, 1, 0);
-          io_uring_sqe_set_data(sqe, rreq);
-          io_uring_submit(&ring);
+          /* make a new async accept, since the previous one was consumed. note
+           * that we're reusing the request object, but its not special - freeing
+           * it and making a new one would also be just fine */
+          areq->ycr_addrlen = sizeof(areq->ycr_addr);
+          sqe = yc_get_sqe();
+          io_uring_prep_accept(sqe, fd, (struct sockaddr *) &areq->ycr_addr, &areq->ycr_addrlen, 0);
+          io_uring_sqe_set_data(sqe, areq);
+
+          break;
         }
 
-        /* make a new async accept, since the previous one was consumed. note
-         * that we're reusing the request object, but its not special - freeing
-         * it and making a new one would also be just fine */
-        sqe = io_uring_get_sqe(&ring);
-        io_uring_prep_accept(sqe, fd, (struct sockaddr *) &areq->ycr_addr, &areq->ycr_addrlen, 0);
-        io_uring_sqe_set_data(sqe, areq);
-        io_uring_submit(&ring);
+        /* someone sent something */
+        case YCR_KIND_READ: {
+          yc_conn_t *c = yc_conn_get(fd);
+          c->ycc_bflags &= ~YCU_READING;
 
-        break;
-      }
+          /* we're already closing them, and were just waiting for this to
+           * come back */
+          if (c->ycc_flags & YCC_CLOSING) {
+            yc_uring_release(c);
+            break;
+          }
 
-      /* someone sent something */
-      case YCR_KIND_READ: {
-        /* get a handle on the more specialised request */
-        yc_io_request_t *rreq = (yc_io_request_t *) req;
+          /* some error, disconnect them */
+          if (res < 0) {
+            yc_log(YC_LOG_ERROR, "readv(%d): %s", fd, strerror(-res));
+            yc_conn_close(c);
+          }
 
-        /* some error, disconnect them */
-        if (res < 0) {
-          fprintf(stderr, "readv(%d): %s\n", fd, strerror(-res));
+          /* zero read, they gracefully closed the connection */
+          else if (res == 0) {
+            yc_log(YC_LOG_CONNECT, "[%d] closed", fd);
+            yc_conn_close(c);
+          }
 
-          /* free the read request, since we're not going to be reissuing it */
-          yc_req_free(req);
+          /* they sent some data, which is now in the connection's input
+           * buffer (via the iovec we sent in). let the core deal with it, and
+           * then if they're still around (and not paused), read some more */
+          else if (yc_conn_received(c, res) != YC_IO_CLOSED && !(c->ycc_flags & YCC_PAUSED))
+            yc_uring_read(c);
 
-          /* make a async close request. we use a minimal request object
-           * because close has no interesting args or return; we just need a
-           * marker so we can recognise the response for what it is */
-          yc_request_t *clreq = yc_req_new(YCR_KIND_CLOSE, fd);
-          sqe = io_uring_get_sqe(&ring);
-          io_uring_prep_close(sqe, fd);
-          io_uring_sqe_set_data(sqe, clreq);
-          io_uring_submit(&ring);
-
-          /* mark them "disconnected", so we don't try to send to them while the close request is pending */
-          conns[fd] = 0;
+          break;
         }
 
-        /* zero read, they gracefully closed the connection */
-        else if (res == 0) {
-          printf("[%d] closed\n", fd);
+        /* they finished receiving what we sent */
+        case YCR_KIND_WRITE: {
+          yc_conn_t *c = yc_conn_get(fd);
+          yc_uconn_t *u = c->ycc_bdata;
+          c->ycc_bflags &= ~YCU_WRITING;
 
-          /* see error block above, this is the same behaviour */
+          if (c->ycc_flags & YCC_CLOSING) {
+            yc_uring_release(c);
+            break;
+          }
 
-          yc_req_free(req);
+          /* failed write, so disconnect them */
+          if (res < 0) {
+            yc_log(YC_LOG_ERROR, "writev(%d): %s", fd, strerror(-res));
+            yc_conn_close(c);
+          }
 
-          yc_request_t *clreq = yc_req_new(YCR_KIND_CLOSE, fd);
-          sqe = io_uring_get_sqe(&ring);
-          io_uring_prep_close(sqe, fd);
-          io_uring_sqe_set_data(sqe, clreq);
-          io_uring_submit(&ring);
+          else {
+            /* tell the core what went out, and if there's more waiting, go
+             * again. if we only managed part of it, the socket's full, so
+             * wait till it isn't */
+            yc_conn_sent(c, res);
+            if (c->ycc_oq_len && !(c->ycc_flags & YCC_CLOSING)) {
+              if ((size_t) res < u->ycu_wreq.ycr_len)
+                yc_uring_poll_out(c);
+              else
+                yc_conn_writable(c);
+            }
+          }
 
-          conns[fd] = 0;
+          break;
         }
 
-        else {
-          /* they sent some data, which is now in the request iobuf (via the
-           * iovec we sent in) */
-          printf("[%d] read: %.*s\n", fd, res, rreq->ycr_iobuf);
-
-          /* loop over all our connections, and send stuff onto them! */
-          for (int dest_fd = 0; dest_fd < NUM_CONNS; dest_fd++) {
-
-            /* take active connections, but not ourselves */
-            if (conns[dest_fd] && dest_fd != fd) {
-
-              /* async write request. create new write requests, one for each
-               * connection. we copy the data into it but if we were being much
-               * cleverer about memory management we could just point the the
-               * buffers in the read request, resulting a zero-copy forwarder! */
-              yc_io_request_t *wreq = yc_io_req_new(YCR_KIND_WRITE, dest_fd);
-              memcpy(wreq->ycr_iobuf, rreq->ycr_iobuf, res);
-              wreq->ycr_iovec.iov_len = res;
-
-              sqe = io_uring_get_sqe(&ring);
-              io_uring_prep_writev(sqe, dest_fd, &wreq->ycr_iovec, 1, 0);
-              io_uring_sqe_set_data(sqe, wreq);
-              io_uring_submit(&ring);
-            }
+        /* a file range has been moved into the pipe. nothing's been sent
+         * yet, so there's nothing to tell the core */
+        case YCR_KIND_SPLICE_IN: {
+          yc_conn_t *c = yc_conn_get(fd);
+          yc_uconn_t *u = c->ycc_bdata;
+          c->ycc_bflags &= ~YCU_SPLICE_IN;
+
+          if (c->ycc_flags & YCC_CLOSING) {
+            yc_uring_release(c);
+            break;
           }
 
-        /* make a new async read, since the previous one was consumed. note
-         * that we're reusing the request object, but its not special - freeing
-         * it and making a new one would also be just fine */
-          sqe = io_uring_get_sqe(&ring);
-          io_uring_prep_readv(sqe, fd, &rreq->ycr_iovec, 1, 0);
-          io_uring_sqe_set_data(sqe, rreq);
-          io_uring_submit(&ring);
+          /* the file should have everything the range says. if it doesn't
+           * (or can't be read), we can't send what they were promised */
+          if (res <= 0) {
+            yc_log(YC_LOG_ERROR, "splice(%d): %s", fd, strerror(res < 0 ? -res : EIO));
+            yc_conn_close(c);
+          }
+          else {
+            /* the splice out normally follows on by itself, but if it was
+             * cancelled and has already come back, start it again */
+            u->ycu_piped += res;
+            yc_conn_writable(c);
+          }
+
+          break;
         }
 
-        break;
-      }
+        /* some of what was in the pipe went out to the socket */
+        case YCR_KIND_SPLICE_OUT: {
+          yc_conn_t *c = yc_conn_get(fd);
+          yc_uconn_t *u = c->ycc_bdata;
+          c->ycc_bflags &= ~YCU_SPLICE_OUT;
 
-      /* they finished receiving what we sent */
-      case YCR_KIND_WRITE: {
+          if (c->ycc_flags & YCC_CLOSING) {
+            yc_uring_release(c);
+            break;
+          }
 
-        /* failed write, so disconnect them */
-        if (res < 0) {
-          fprintf(stderr, "writev(%d): %s\n", fd, strerror(-res));
-          yc_req_free(req);
+          /* cancelled because the splice in came up short (or failed, and
+           * that's dealt with there). whatever's in the pipe goes next time */
+          if (res == -ECANCELED)
+            ;
+
+          else if (res < 0) {
+            yc_log(YC_LOG_ERROR, "splice(%d): %s", fd, strerror(-res));
+            yc_conn_close(c);
+            break;
+          }
 
-          /* see read error handling */
+          else {
+            u->ycu_piped -= res;
+            yc_conn_sent(c, res);
+          }
 
-          yc_request_t *clreq = yc_req_new(YCR_KIND_CLOSE, fd);
-          sqe = io_uring_get_sqe(&ring);
-          io_uring_prep_close(sqe, fd);
-          io_uring_sqe_set_data(sqe, clreq);
-          io_uring_submit(&ring);
+          /* anything left in the pipe means the socket filled up */
+          if (c->ycc_oq_len && !(c->ycc_flags & YCC_CLOSING)) {
+            if (res > 0 && u->ycu_piped)
+              yc_uring_poll_out(c);
+            else
+              yc_conn_writable(c);
+          }
 
-          conns[fd] = 0;
+          break;
         }
 
-        else {
-          /* written successfully, so just free the read req */
-          yc_req_free(req);
+        /* there's room to write again (or the socket's been shut down, and
+         * the write will find that out) */
+        case YCR_KIND_POLL: {
+          yc_conn_t *c = yc_conn_get(fd);
+          c->ycc_bflags &= ~YCU_POLLING;
+
+          if (c->ycc_flags & YCC_CLOSING) {
+            yc_uring_release(c);
+            break;
+          }
+
+          if (res < 0) {
+            yc_log(YC_LOG_ERROR, "poll(%d): %s", fd, strerror(-res));
+            yc_conn_close(c);
+          }
+          else
+            yc_conn_writable(c);
+
+          break;
         }
 
-        break;
-      }
+        /* half of a message log write. the write returns how much it wrote,
+         * which should be all of it, and the sync returns 0. if the write
+         * fails, the kernel cancels the sync */
+        case YCR_KIND_STORE: {
+          yc_store_request_t *sreq = (yc_store_request_t *) req;
+          yc_store_batch_t *b = sreq->ycr_batch;
+          if (!sreq->ycr_err && (res < 0 || (res > 0 && (size_t) res != b->ycsb_len)))
+            sreq->ycr_err = res < 0 ? res : -EIO;
+
+          if (--sreq->ycr_pending == 0) {
+            yc_store_done(b, sreq->ycr_err);
+            yc_req_free(req);
+          }
+          break;
+        }
 
-      /* async close completed */
-      case YCR_KIND_CLOSE: {
-        /* just free the request, we've already cleaned up and there's nothing
-         * useful we could do if the close failed anyway */
-        yc_req_free(req);
-        break;
+        /* async close completed */
+        case YCR_KIND_CLOSE: {
+          /* just free the request, we've already cleaned up and there's nothing
+           * useful we could do if the close failed anyway */
+          yc_req_free(req);
+          break;
+        }
       }
-    }
 
-    /* mark the CQE "seen", returning it to the ring for reuse */
-    io_uring_cqe_seen(&ring, cqe);
+      /* mark the CQE "seen", returning it to the ring for reuse */
+      io_uring_cqe_seen(&ring, cqe);
+
+    } while (io_uring_peek_cqe(&ring, &cqe) == 0);
+
+    /* queue up writes for anything that was sent to while we were
+     * processing, then submit everything in one go */
+    yc_core_tick();
+    io_uring_submit(&ring);
   }
 
   /* io_uring_wait_cqe failed. in a real server you might actually need to
-   * handle non-error cases like EINTR, but it complicates this example so we
+   * handle more non-error cases, but it complicates this example so we
    * won't bother */
+  errno = -ret;
   perror("io_uring_wait_cqe");
   exit(1);
 }